@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -44,7 +45,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <limits>
+#include <numeric>
+#include <random>
 #include <string>
 #include <unordered_set>
 
@@ -106,6 +111,7 @@ void setup_correlation( CLI::App& app )
     options->jplace_input.add_mass_norm_opt_to_app( sub, true );
     options->jplace_input.add_point_mass_opt_to_app( sub );
     options->jplace_input.add_ignore_multiplicities_opt_to_app( sub );
+    options->jplace_input.add_profile_file_opt_to_app( sub );
 
     // Metadata table input.
     options->metadata_input.add_table_input_opt_to_app( sub, true );
@@ -134,6 +140,25 @@ void setup_correlation( CLI::App& app )
         CLI::IsMember({ "all", "pearson", "spearman", "kendall" }, CLI::ignore_case )
     );
 
+    // Permutation test.
+    auto permutations_opt = sub->add_option(
+        "--permutations",
+        options->permutations,
+        "If set to a value greater than 0, run a permutation test with this many permutations "
+        "of each metadata column, and write a table per variant and metadata column with the "
+        "correlation, its empirical (two-sided) p-value, and the Benjamini-Hochberg corrected "
+        "q-value for each edge.",
+        true
+    )->group( "Settings" );
+    sub->add_option(
+        "--permutation-seed",
+        options->permutation_seed,
+        "Seed for the random permutations. If set to 0 (default), a random seed is used, "
+        "which is printed, so that the run can be reproduced.",
+        true
+    )->group( "Settings" )
+    ->needs( permutations_opt );
+
     // Color. We allow max, but not min, as this is always 0.
     options->color_map.add_color_list_opt_to_app( sub, "spectral" );
     options->color_map.add_mask_opt_to_app( sub, "#dfdfdf" );
@@ -257,15 +282,15 @@ void check_jplace_input( CorrelationOptions const& options )
 // =================================================================================================
 
 void make_correlation_color_tree(
-    CorrelationOptions const&  options,
-    std::vector<double> const& values,
-    genesis::tree::Tree const& tree,
-    std::string const&         infix
+    CorrelationOptions const&                options,
+    std::vector<double> const&               values,
+    TreeOutputOptions::PreparedLayout const& layout,
+    std::string const&                       infix
 ) {
     using namespace genesis::utils;
 
     // Just in case...
-    if( values.size() != tree.edge_count() ) {
+    if( values.size() != layout.tree.edge_count() ) {
         throw std::runtime_error( "Internal error: Trees and matrices do not fit to each other." );
     }
 
@@ -276,15 +301,664 @@ void make_correlation_color_tree(
     // Now, make a color vector and write to files.
     auto const colors = color_map( color_norm, values );
     options.tree_output.write_tree_to_files(
-        tree,
+        layout,
         colors,
         color_map,
         color_norm,
         options.file_output,
-        infix
+        infix,
+        false
+    );
+}
+
+// =================================================================================================
+//      Correlation Kernels
+// =================================================================================================
+
+/**
+ * @brief Per metadata column data that is independent of the edges, and hence only prepared once.
+ *
+ * The genesis correlation functions only use pairs of values where both are finite. As metadata
+ * might contain missing (NaN) values, we hence only use the rows (samples) where the metadata
+ * value is finite, and compact the edge values accordingly.
+ */
+struct CorrelationMeta
+{
+    /**
+     * @brief Rows of the profile matrix with a finite metadata value.
+     */
+    std::vector<size_t> rows;
+
+    /**
+     * @brief Centered metadata values and their sum of squares, for Pearson.
+     */
+    std::vector<double> centered;
+    double              sum_sq = 0.0;
+
+    /**
+     * @brief Centered metadata ranks and their sum of squares, for Spearman.
+     */
+    std::vector<double> rank_centered;
+    double              rank_sum_sq = 0.0;
+
+    /**
+     * @brief Order that sorts the metadata values, for Kendall.
+     *
+     * For each run of tied values in that order, @p tie_ends contains the (past-the-end) index
+     * of the run, and @p tie_pairs is the number of pairs that are tied.
+     */
+    std::vector<size_t> order;
+    std::vector<size_t> tie_ends;
+    double              tie_pairs = 0.0;
+};
+
+/**
+ * @brief Buffers for the per-edge computations, so that we do not need to allocate them
+ * again for every edge.
+ */
+struct CorrelationBuffers
+{
+    std::vector<double> values;
+    std::vector<double> centered;
+    std::vector<double> ranks;
+    std::vector<double> rank_centered;
+    std::vector<size_t> order;
+    std::vector<double> merge;
+    std::vector<double> merge_tmp;
+};
+
+/**
+ * @brief Compute the fractional ranking (1-based, ties get the average of their ranks)
+ * of the given values, as used for Spearman's rank correlation.
+ */
+void fractional_ranks(
+    double const* values, size_t n, std::vector<double>& ranks, std::vector<size_t>& order
+) {
+    order.resize( n );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        return values[a] < values[b];
+    });
+
+    ranks.resize( n );
+    size_t i = 0;
+    while( i < n ) {
+        size_t j = i + 1;
+        while( j < n && values[ order[j] ] == values[ order[i] ] ) {
+            ++j;
+        }
+        // Ranks i+1 to j (inclusive) are tied, and all get their average.
+        auto const rank = static_cast<double>( i + 1 + j ) / 2.0;
+        for( size_t k = i; k < j; ++k ) {
+            ranks[ order[k] ] = rank;
+        }
+        i = j;
+    }
+}
+
+/**
+ * @brief Center the values around their mean, and return the sum of squares of the result.
+ */
+double center_values( double const* values, size_t n, std::vector<double>& centered )
+{
+    centered.resize( n );
+    if( n == 0 ) {
+        return 0.0;
+    }
+    auto out = centered.data();
+
+    double sum = 0.0;
+    #pragma omp simd reduction(+:sum)
+    for( size_t i = 0; i < n; ++i ) {
+        sum += values[i];
+    }
+    double const mean = sum / static_cast<double>( n );
+
+    double sum_sq = 0.0;
+    #pragma omp simd reduction(+:sum_sq)
+    for( size_t i = 0; i < n; ++i ) {
+        double const d = values[i] - mean;
+        out[i] = d;
+        sum_sq += d * d;
+    }
+    return sum_sq;
+}
+
+/**
+ * @brief Pearson correlation of two centered vectors, given their sums of squares.
+ *
+ * As in genesis, the result is NaN if any of the two has no variance.
+ */
+double centered_pearson(
+    double const* a, double a_sum_sq, double const* b, double b_sum_sq, size_t n
+) {
+    if( n == 0 || a_sum_sq == 0.0 || b_sum_sq == 0.0 ) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    double num = 0.0;
+    #pragma omp simd reduction(+:num)
+    for( size_t i = 0; i < n; ++i ) {
+        num += a[i] * b[i];
+    }
+    return num / ( std::sqrt( a_sum_sq ) * std::sqrt( b_sum_sq ));
+}
+
+/**
+ * @brief Return the number of pairs of equal values in a sorted range.
+ */
+double sorted_tie_pairs( double const* values, size_t n )
+{
+    double result = 0.0;
+    size_t i = 0;
+    while( i < n ) {
+        size_t j = i + 1;
+        while( j < n && values[j] == values[i] ) {
+            ++j;
+        }
+        auto const t = static_cast<double>( j - i );
+        result += t * ( t - 1.0 ) / 2.0;
+        i = j;
+    }
+    return result;
+}
+
+/**
+ * @brief Sort the values by a bottom-up merge sort, and return the number of swaps
+ * (inversions) that a bubble sort would need, that is, the number of discordant pairs.
+ */
+uint64_t merge_sort_count_swaps( std::vector<double>& values, std::vector<double>& tmp )
+{
+    auto const n = values.size();
+    tmp.resize( n );
+    uint64_t swaps = 0;
+
+    double* src = values.data();
+    double* dst = tmp.data();
+    for( size_t width = 1; width < n; width *= 2 ) {
+        for( size_t lo = 0; lo < n; lo += 2 * width ) {
+            auto const mid = std::min( lo + width, n );
+            auto const hi  = std::min( lo + 2 * width, n );
+            size_t i = lo;
+            size_t j = mid;
+            size_t k = lo;
+
+            // Take from the left on ties, so that tied values do not count as swaps.
+            while( i < mid && j < hi ) {
+                if( src[i] <= src[j] ) {
+                    dst[k++] = src[i++];
+                } else {
+                    swaps += mid - i;
+                    dst[k++] = src[j++];
+                }
+            }
+            while( i < mid ) {
+                dst[k++] = src[i++];
+            }
+            while( j < hi ) {
+                dst[k++] = src[j++];
+            }
+        }
+        std::swap( src, dst );
+    }
+    if( src != values.data() ) {
+        std::copy( src, src + n, values.data() );
+    }
+    return swaps;
+}
+
+/**
+ * @brief Kendall's tau-b, computed with Knight's O(n log n) algorithm.
+ *
+ * The first variable is given by its precomputed sort order and ties in @p meta,
+ * the second by the values @p y, which are in the original (unsorted) order.
+ */
+double kendall_tau_b( CorrelationMeta const& meta, double const* y, CorrelationBuffers& buffers )
+{
+    auto const n = meta.order.size();
+    if( n < 2 ) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    // Bring the second variable into the order of the first one,
+    // and within ties of the first one, sort by the second one.
+    auto& sorted = buffers.merge;
+    sorted.resize( n );
+    for( size_t i = 0; i < n; ++i ) {
+        sorted[i] = y[ meta.order[i] ];
+    }
+    double joint_tie_pairs = 0.0;
+    size_t begin = 0;
+    for( auto const end : meta.tie_ends ) {
+        if( end - begin > 1 ) {
+            std::sort( sorted.begin() + begin, sorted.begin() + end );
+            joint_tie_pairs += sorted_tie_pairs( sorted.data() + begin, end - begin );
+        }
+        begin = end;
+    }
+
+    // Count the discordant pairs while sorting the second variable, which then gives its ties.
+    auto const swaps = static_cast<double>( merge_sort_count_swaps( sorted, buffers.merge_tmp ));
+    auto const y_tie_pairs = sorted_tie_pairs( sorted.data(), n );
+
+    auto const nd = static_cast<double>( n );
+    auto const n0 = nd * ( nd - 1.0 ) / 2.0;
+    auto const num = n0 - meta.tie_pairs - y_tie_pairs + joint_tie_pairs - 2.0 * swaps;
+    auto const den = std::sqrt( n0 - meta.tie_pairs ) * std::sqrt( n0 - y_tie_pairs );
+    if( den == 0.0 ) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return num / den;
+}
+
+/**
+ * @brief Prepare the metadata of a column for the correlation computation.
+ *
+ * Only the parts needed for the @p methods are computed.
+ */
+CorrelationMeta prepare_correlation_meta(
+    std::vector<double> const& meta_values,
+    std::vector<bool> const& methods
+) {
+    CorrelationMeta result;
+
+    // Compact to the finite values.
+    std::vector<double> values;
+    for( size_t r = 0; r < meta_values.size(); ++r ) {
+        if( std::isfinite( meta_values[r] )) {
+            result.rows.push_back( r );
+            values.push_back( meta_values[r] );
+        }
+    }
+    auto const n = values.size();
+
+    if( methods[ CorrelationVariant::kPearson ] ) {
+        result.sum_sq = center_values( values.data(), n, result.centered );
+    }
+    if( methods[ CorrelationVariant::kSpearman ] ) {
+        std::vector<double> ranks;
+        std::vector<size_t> order;
+        fractional_ranks( values.data(), n, ranks, order );
+        result.rank_sum_sq = center_values( ranks.data(), n, result.rank_centered );
+    }
+    if( methods[ CorrelationVariant::kKendall ] ) {
+        result.order.resize( n );
+        std::iota( result.order.begin(), result.order.end(), 0 );
+        std::sort( result.order.begin(), result.order.end(), [&]( size_t a, size_t b ){
+            return values[a] < values[b];
+        });
+
+        size_t i = 0;
+        while( i < n ) {
+            size_t j = i + 1;
+            while( j < n && values[ result.order[j] ] == values[ result.order[i] ] ) {
+                ++j;
+            }
+            auto const t = static_cast<double>( j - i );
+            result.tie_pairs += t * ( t - 1.0 ) / 2.0;
+            result.tie_ends.push_back( j );
+            i = j;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Values of one edge, prepared for correlation with one metadata column.
+ *
+ * The values are compacted to the rows of the metadata column, and preprocessed as needed by the
+ * methods, so that they can be correlated with the original and all permuted metadata columns.
+ */
+struct CorrelationEdge
+{
+    bool                finite = true;
+    std::vector<double> values;
+    std::vector<double> centered;
+    double              sum_sq = 0.0;
+    std::vector<double> rank_centered;
+    double              rank_sum_sq = 0.0;
+};
+
+/**
+ * @brief Prepare the values of an edge for correlation with a metadata column.
+ *
+ * The @p edge_col contains the values of the edge for all rows (samples). If any of the values
+ * that are paired with a finite metadata value is not finite, the edge is marked as such, and
+ * no further preprocessing is done.
+ */
+void prepare_correlation_edge(
+    CorrelationMeta const& meta,
+    double const* edge_col,
+    std::vector<bool> const& methods,
+    CorrelationEdge& edge,
+    CorrelationBuffers& buffers
+) {
+    // Compact the edge values to the rows with finite metadata.
+    auto const n = meta.rows.size();
+    edge.values.resize( n );
+    edge.finite = true;
+    for( size_t i = 0; i < n; ++i ) {
+        edge.values[i] = edge_col[ meta.rows[i] ];
+        edge.finite &= std::isfinite( edge.values[i] );
+    }
+    if( ! edge.finite ) {
+        return;
+    }
+
+    if( methods[ CorrelationVariant::kPearson ] ) {
+        edge.sum_sq = center_values( edge.values.data(), n, edge.centered );
+    }
+    if( methods[ CorrelationVariant::kSpearman ] ) {
+        fractional_ranks( edge.values.data(), n, buffers.ranks, buffers.order );
+        edge.rank_sum_sq = center_values( buffers.ranks.data(), n, edge.rank_centered );
+    }
+}
+
+/**
+ * @brief Compute the correlation of a prepared (finite) edge and a metadata column.
+ */
+double prepared_correlation(
+    CorrelationVariant::CorrelationMethod method,
+    CorrelationMeta const& meta,
+    CorrelationEdge const& edge,
+    CorrelationBuffers& buffers
+) {
+    auto const n = meta.rows.size();
+    switch( method ) {
+        case CorrelationVariant::kPearson: {
+            return centered_pearson(
+                meta.centered.data(), meta.sum_sq, edge.centered.data(), edge.sum_sq, n
+            );
+        }
+        case CorrelationVariant::kSpearman: {
+            return centered_pearson(
+                meta.rank_centered.data(), meta.rank_sum_sq,
+                edge.rank_centered.data(), edge.rank_sum_sq, n
+            );
+        }
+        case CorrelationVariant::kKendall: {
+            return kendall_tau_b( meta, edge.values.data(), buffers );
+        }
+        default: {
+            throw std::runtime_error( "Internal Error: Invalid correlation variant." );
+        }
+    }
+}
+
+/**
+ * @brief Compute the correlation of an edge with non-finite values, using the genesis functions,
+ * which skip pairs with non-finite values.
+ */
+double fallback_correlation(
+    CorrelationVariant::CorrelationMethod method,
+    std::vector<double> const& meta_values,
+    double const* edge_col,
+    size_t rows
+) {
+    using namespace genesis::utils;
+
+    switch( method ) {
+        case CorrelationVariant::kPearson: {
+            return pearson_correlation_coefficient(
+                meta_values.begin(), meta_values.end(), edge_col, edge_col + rows
+            );
+        }
+        case CorrelationVariant::kSpearman: {
+            return spearmans_rank_correlation_coefficient(
+                meta_values.begin(), meta_values.end(), edge_col, edge_col + rows
+            );
+        }
+        case CorrelationVariant::kKendall: {
+            return kendalls_tau_correlation_coefficient(
+                meta_values.begin(), meta_values.end(), edge_col, edge_col + rows
+            );
+        }
+        default: {
+            throw std::runtime_error( "Internal Error: Invalid correlation variant." );
+        }
+    }
+}
+
+// =================================================================================================
+//      Permutation Test
+// =================================================================================================
+
+/**
+ * @brief Benjamini-Hochberg adjustment of p-values to q-values. NaN values are ignored.
+ */
+std::vector<double> benjamini_hochberg( std::vector<double> const& p_values )
+{
+    auto result = std::vector<double>( p_values.size(), std::numeric_limits<double>::quiet_NaN() );
+
+    // Sort the finite p-values.
+    std::vector<size_t> order;
+    for( size_t i = 0; i < p_values.size(); ++i ) {
+        if( std::isfinite( p_values[i] )) {
+            order.push_back( i );
+        }
+    }
+    std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        return p_values[a] < p_values[b];
+    });
+
+    // Go from largest to smallest, keeping the running minimum to make the q-values monotone.
+    auto const m = static_cast<double>( order.size() );
+    double running_min = 1.0;
+    for( size_t k = order.size(); k > 0; --k ) {
+        auto const idx = order[ k - 1 ];
+        auto const q = p_values[ idx ] * m / static_cast<double>( k );
+        running_min = std::min( running_min, q );
+        result[ idx ] = running_min;
+    }
+    return result;
+}
+
+/**
+ * @brief Number of columns of the @p edge_values matrix that are read per pass.
+ *
+ * The matrix is stored by rows, and might be mapped from a file that is larger than the memory.
+ * Each pass reads all rows of a range of columns, so that every page of the file is read once
+ * per pass. Hence, we use as few and wide passes as the memory budget for the transposed pass
+ * buffer allows, but with at least a page of contiguous values of each row per pass.
+ */
+size_t correlation_pass_cols( ProfileMatrix const& edge_values )
+{
+    size_t const page_bytes   = 4096;
+    size_t const budget_bytes = static_cast<size_t>( 1 ) << 28;
+
+    auto const width = static_cast<size_t>( edge_values.value_type() );
+    auto const rows  = std::max<size_t>( 1, edge_values.rows() );
+    auto const pass_cols = std::max( page_bytes / width, budget_bytes / ( rows * sizeof( double )));
+    return std::max<size_t>( 1, std::min( pass_cols, edge_values.cols() ));
+}
+
+/**
+ * @brief Read a pass of @p count columns, starting at @p first_col, into @p buffer,
+ * with the values of each column being contiguous, as ProfileMatrix::read_col_block() does.
+ *
+ * The rows are read in parallel slabs, each of which is a sequential run over the file.
+ */
+void read_correlation_pass(
+    ProfileMatrix const& edge_values, size_t first_col, size_t count, std::vector<double>& buffer
+) {
+    auto const rows = edge_values.rows();
+    buffer.resize( count * rows );
+    parallel_for_chunks(
+        rows, parallel_chunk_count( rows ), [&]( size_t, size_t first_row, size_t last_row ){
+            edge_values.read_col_block( first_col, count, first_row, last_row, buffer.data() );
+        }
     );
 }
 
+/**
+ * @brief Compute empirical p-values of the correlations of all edges with one metadata column.
+ *
+ * The metadata values (of the finite rows) are permuted, and the permuted columns are shared
+ * by all edges. The edge values are read in wide passes of columns, see correlation_pass_cols(),
+ * so that the matrix is read only once. For each pass, the permutations are generated and prepared
+ * in blocks, so that only the permuted metadata of one block is kept in memory at a time. Each
+ * pass starts again from the same state of the random @p engine, so that all edges are tested
+ * against the same permutations. For each permutation block, the edges of the pass are processed
+ * in small groups, and within those, permutations are processed in chunks, so that the permuted
+ * metadata of a chunk stays in cache while being correlated with all edges of the group.
+ * The p-value is two-sided, `( 1 + count ) / ( permutations + 1 )`, where `count` is the number
+ * of permutations with an absolute correlation at least as large as the observed one.
+ */
+std::vector<std::vector<double>> permutation_p_values(
+    CorrelationOptions const& options,
+    std::vector<CorrelationVariant const*> const& active,
+    std::vector<bool> const& methods,
+    ProfileMatrix const& edge_values,
+    std::vector<double> const& meta_values,
+    CorrelationMeta const& meta,
+    std::vector<std::vector<double>> const& observed,
+    std::mt19937_64& engine
+) {
+    auto const rows = edge_values.rows();
+    auto const cols = edge_values.cols();
+    auto const perms = options.permutations;
+
+    // Values that are permuted, in the order of the finite rows of the metadata.
+    auto finite_values = std::vector<double>();
+    for( auto const r : meta.rows ) {
+        finite_values.push_back( meta_values[r] );
+    }
+
+    // Count, per variant and edge, how many permutations reach the observed correlation.
+    // We use a small tolerance, so that permutations that only differ by rounding count as well.
+    auto counts = std::vector<std::vector<size_t>>( active.size(), std::vector<size_t>( cols, 0 ));
+    auto edge_finite = std::vector<char>( cols, 0 );
+    auto const tolerance = 1e-12;
+
+    // Edges are processed in groups that are small enough for their prepared values to stay
+    // in cache while correlating them with a chunk of permutations.
+    auto const pass_cols  = correlation_pass_cols( edge_values );
+    auto const group_cols = std::max<size_t>(
+        1, std::min<size_t>( 64, ( 1 << 19 ) / std::max<size_t>( 1, rows ))
+    );
+    size_t const perm_chunk = 64;
+
+    // Number of permutations that are prepared at a time. We aim for a few million values,
+    // but at least one chunk.
+    auto const perm_block = perm_chunk * std::max<size_t>(
+        1, ( 1 << 22 ) / ( perm_chunk * std::max<size_t>( 1, finite_values.size() ))
+    );
+
+    auto const start_engine = engine;
+    auto pass = std::vector<double>();
+    auto shuffled = std::vector<std::vector<double>>();
+    auto perm_metas = std::vector<CorrelationMeta>();
+    for( size_t pass_first = 0; pass_first < cols; pass_first += pass_cols ) {
+        auto const pass_count  = std::min( pass_cols, cols - pass_first );
+        auto const group_count = ( pass_count + group_cols - 1 ) / group_cols;
+        read_correlation_pass( edge_values, pass_first, pass_count, pass );
+
+        // Every pass uses the same permutations. After the last pass, the engine is thus in the
+        // same state as if we had generated all permutations once.
+        engine = start_engine;
+        for( size_t pb = 0; pb < perms; pb += perm_block ) {
+            auto const pb_count = std::min( perm_block, perms - pb );
+
+            // Create the permuted metadata columns of this block. The shuffling is done
+            // sequentially from one random engine, so that results are reproducible for a given
+            // seed, independently of the block size; the preparation is parallel.
+            shuffled.assign( pb_count, finite_values );
+            for( auto& values : shuffled ) {
+                std::shuffle( values.begin(), values.end(), engine );
+            }
+            perm_metas.resize( pb_count );
+            #pragma omp parallel for schedule(dynamic)
+            for( size_t p = 0; p < pb_count; ++p ) {
+                perm_metas[p] = prepare_correlation_meta( shuffled[p], methods );
+            }
+
+            #pragma omp parallel
+            {
+                std::vector<CorrelationEdge> edges( group_cols );
+                CorrelationBuffers buffers;
+
+                #pragma omp for schedule(dynamic)
+                for( size_t g = 0; g < group_count; ++g ) {
+                    auto const group_first = g * group_cols;
+                    auto const count = std::min( group_cols, pass_count - group_first );
+                    auto const first = pass_first + group_first;
+                    for( size_t c = 0; c < count; ++c ) {
+                        auto const edge_col = pass.data() + ( group_first + c ) * rows;
+                        prepare_correlation_edge( meta, edge_col, methods, edges[c], buffers );
+                        edge_finite[ first + c ] = edges[c].finite;
+                    }
+
+                    for( size_t p0 = 0; p0 < pb_count; p0 += perm_chunk ) {
+                        auto const p1 = std::min( p0 + perm_chunk, pb_count );
+                        for( size_t c = 0; c < count; ++c ) {
+                            if( ! edges[c].finite ) {
+                                continue;
+                            }
+                            for( size_t v = 0; v < active.size(); ++v ) {
+                                auto const obs = observed[v][ first + c ];
+                                if( ! std::isfinite( obs )) {
+                                    continue;
+                                }
+                                auto const threshold = std::abs( obs ) - tolerance;
+                                auto const method = active[v]->correlation_value;
+                                size_t hits = 0;
+                                for( size_t p = p0; p < p1; ++p ) {
+                                    auto const r = prepared_correlation(
+                                        method, perm_metas[p], edges[c], buffers
+                                    );
+                                    hits += ( std::abs( r ) >= threshold );
+                                }
+                                counts[v][ first + c ] += hits;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Turn the counts into p-values. Edges without a valid observed correlation, and edges with
+    // non-finite values (for which we cannot use the prepared permutations) get NaN.
+    auto result = std::vector<std::vector<double>>(
+        active.size(), std::vector<double>( cols, std::numeric_limits<double>::quiet_NaN() )
+    );
+    for( size_t e = 0; e < cols; ++e ) {
+        if( ! edge_finite[e] ) {
+            continue;
+        }
+        for( size_t v = 0; v < active.size(); ++v ) {
+            if( std::isfinite( observed[v][e] )) {
+                result[v][e] = static_cast<double>( 1 + counts[v][e] ) / static_cast<double>( perms + 1 );
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Write a table with the correlation, p-value, and q-value of each edge.
+ */
+void write_correlation_table(
+    CorrelationOptions const&  options,
+    genesis::tree::Tree const& tree,
+    std::vector<double> const& correlations,
+    std::vector<double> const& p_values,
+    std::string const&         infix
+) {
+    using namespace genesis::placement;
+
+    auto const q_values = benjamini_hochberg( p_values );
+
+    auto target = options.file_output.get_output_target( infix, "csv" );
+    (*target) << "edge_num,correlation,p_value,q_value\n";
+    for( auto const& edge : tree.edges() ) {
+        auto const e = edge.index();
+        (*target) << edge.data<PlacementEdgeData>().edge_num() << ",";
+        (*target) << correlations[e] << "," << p_values[e] << "," << q_values[e] << "\n";
+    }
+}
+
 // =================================================================================================
 //      Run with Matrix
 // =================================================================================================
@@ -295,14 +969,16 @@ void make_correlation_color_tree(
 void run_with_matrix(
     CorrelationOptions const&                options,
     std::vector<CorrelationVariant> const&   variants,
-    genesis::utils::Matrix<double> const&    edge_values,
+    ProfileMatrix const&                     edge_values,
     genesis::utils::Dataframe const&         df,
     CorrelationVariant::EdgeValues           edge_value_type,
-    genesis::tree::Tree const&               tree
+    TreeOutputOptions::PreparedLayout const& layout,
+    std::mt19937_64&                         engine
 ) {
     using namespace genesis;
     using namespace genesis::utils;
 
+    auto const& tree = layout.tree;
     if( edge_values.cols() != tree.edge_count() ) {
         throw std::runtime_error( "Internal Error: Edge values does not have corrent length." );
     }
@@ -310,79 +986,128 @@ void run_with_matrix(
         throw std::runtime_error( "Internal Error: Jplace files and Dataframe have differing lengths." );
     }
 
-    // Loop over all variants that have been set.
+    // Collect the variants that use the current input matrix.
+    // This is ugly, I know. But the distinction has to be made somewhere...
+    std::vector<CorrelationVariant const*> active;
+    auto methods = std::vector<bool>( 3, false );
     for( auto const& variant : variants ) {
-
-        // Only process the variants that have the current input metrix.
-        // This is ugly, I know. But the distinction has to be made somewhere...
-        if( variant.edge_values != edge_value_type ) {
-            continue;
+        if( variant.edge_values == edge_value_type ) {
+            active.push_back( &variant );
+            methods[ variant.correlation_value ] = true;
         }
+    }
+    if( active.empty() ) {
+        return;
+    }
 
-        // Calculate correlation for each metadata field.
-        for( auto const& meta_col : df ) {
-            auto const& meta_dbl = meta_col.as<double>();
+    // Prepare the metadata columns once, instead of for every edge.
+    std::vector<std::vector<double>> meta_values;
+    std::vector<CorrelationMeta> metas;
+    for( auto const& meta_col : df ) {
+        auto const& meta_dbl = meta_col.as<double>();
+        meta_values.emplace_back( meta_dbl.begin(), meta_dbl.end() );
+        metas.push_back( prepare_correlation_meta( meta_values.back(), methods ));
+    }
 
-            // User output
-            std::string corrname;
-            switch( variant.correlation_value ) {
-                case CorrelationVariant::kPearson: {
-                    corrname = "Pearson";
-                    break;
-                }
-                case CorrelationVariant::kSpearman: {
-                    corrname = "Spearman";
-                    break;
-                }
-                case CorrelationVariant::kKendall: {
-                    corrname = "Kendall";
-                    break;
-                }
-                default: {
-                    throw std::runtime_error( "Internal Error: Invalid correlation variant." );
-                }
-            }
-            LOG_MSG1 << "Writing " << corrname << " correlation with meta-data column "
-                     << meta_col.name() << ".";
-
-            // Prepare a vector for the correlation coefficients of all edges.
-            auto corr_vec = std::vector<double>( tree.edge_count() );
-
-            // Fill the vector by calculating correlation of each edge of the tree.
-            #pragma omp parallel for
-            for( size_t e = 0; e < tree.edge_count(); ++e ) {
-                switch( variant.correlation_value ) {
-                    case CorrelationVariant::kPearson: {
-                        corr_vec[e] = pearson_correlation_coefficient(
-                            meta_dbl.begin(), meta_dbl.end(),
-                            edge_values.col( e ).begin(), edge_values.col( e ).end()
-                        );
-                        break;
-                    }
-                    case CorrelationVariant::kSpearman: {
-                        corr_vec[e] = spearmans_rank_correlation_coefficient(
-                            meta_dbl.begin(), meta_dbl.end(),
-                            edge_values.col( e ).begin(), edge_values.col( e ).end()
-                        );
-                        break;
-                    }
-                    case CorrelationVariant::kKendall: {
-                        corr_vec[e] = kendalls_tau_correlation_coefficient(
-                            meta_dbl.begin(), meta_dbl.end(),
-                            edge_values.col( e ).begin(), edge_values.col( e ).end()
-                        );
-                        break;
-                    }
-                    default: {
-                        throw std::runtime_error( "Internal Error: Invalid correlation variant." );
+    // Result vectors, per metadata column and active variant.
+    auto const rows = edge_values.rows();
+    auto const cols = edge_values.cols();
+    auto results = std::vector<std::vector<std::vector<double>>>(
+        metas.size(), std::vector<std::vector<double>>(
+            active.size(), std::vector<double>( cols )
+        )
+    );
+
+    // Process the edges in wide passes of consecutive columns, which are read into a transposed
+    // buffer, so that the values of each edge are contiguous. This reads the (possibly mapped)
+    // matrix only once, for all variants and metadata columns.
+    auto const pass_cols = correlation_pass_cols( edge_values );
+    std::vector<double> pass;
+    for( size_t pass_first = 0; pass_first < cols; pass_first += pass_cols ) {
+        auto const pass_count = std::min( pass_cols, cols - pass_first );
+        read_correlation_pass( edge_values, pass_first, pass_count, pass );
+
+        #pragma omp parallel
+        {
+            CorrelationEdge edge;
+            CorrelationBuffers buffers;
+
+            #pragma omp for schedule(dynamic)
+            for( size_t c = 0; c < pass_count; ++c ) {
+                auto const edge_col = pass.data() + c * rows;
+                for( size_t m = 0; m < metas.size(); ++m ) {
+                    prepare_correlation_edge( metas[m], edge_col, methods, edge, buffers );
+                    for( size_t v = 0; v < active.size(); ++v ) {
+                        auto const method = active[v]->correlation_value;
+                        results[m][v][ pass_first + c ] = edge.finite
+                            ? prepared_correlation( method, metas[m], edge, buffers )
+                            : fallback_correlation( method, meta_values[m], edge_col, rows )
+                        ;
                     }
                 }
             }
+        }
+    }
+
+    // Write the trees. They all use the same layout, so we can write them in parallel.
+    // They also all use the same color scale, so we only print its legend once.
+    auto const col_names = df.col_names();
+    options.tree_output.print_color_legend(
+        options.color_map.color_map(), genesis::utils::ColorNormalizationDiverging( -1.0, 1.0 )
+    );
+    parallel_for_items( metas.size() * active.size(), [&]( size_t mv ){
+        auto const m = mv / active.size();
+        auto const v = mv % active.size();
+        auto const& col_name = col_names[m];
+        auto const& variant = *active[v];
 
-            // Make a tree using the data vector and name of the variant and field.
-            make_correlation_color_tree(
-                options, corr_vec, tree,  meta_col.name() + "_" + variant.name
+        std::string corrname;
+        switch( variant.correlation_value ) {
+            case CorrelationVariant::kPearson: {
+                corrname = "Pearson";
+                break;
+            }
+            case CorrelationVariant::kSpearman: {
+                corrname = "Spearman";
+                break;
+            }
+            case CorrelationVariant::kKendall: {
+                corrname = "Kendall";
+                break;
+            }
+            default: {
+                throw std::runtime_error( "Internal Error: Invalid correlation variant." );
+            }
+        }
+
+        // User output
+        #pragma omp critical(GAPPA_CORRELATION_PRINT)
+        {
+            LOG_MSG1 << "Writing " << corrname << " correlation with meta-data column "
+                     << col_name << ".";
+        }
+
+        // Make a tree using the data vector and name of the variant and field.
+        make_correlation_color_tree(
+            options, results[m][v], layout, col_name + "_" + variant.name
+        );
+    });
+
+    // If needed, run the permutation test and write the tables.
+    for( size_t m = 0; m < metas.size(); ++m ) {
+        auto const& col_name = col_names[m];
+        if( options.permutations > 0 ) {
+            LOG_MSG1 << "Running " << options.permutations << " permutations for meta-data column "
+                     << col_name << ".";
+
+            auto const p_values = permutation_p_values(
+                options, active, methods, edge_values, meta_values[m], metas[m], results[m], engine
             );
+            for( size_t v = 0; v < active.size(); ++v ) {
+                write_correlation_table(
+                    options, tree, results[m][v], p_values[v], col_name + "_" + active[v]->name
+                );
+            }
         }
     }
 }
@@ -425,6 +1150,9 @@ void run_correlation( CorrelationOptions const& options )
             for( auto const& e : options.tree_output.get_extensions() ) {
                 infixes_and_extensions.emplace_back( f + "_" + m.name, e );
             }
+            if( options.permutations > 0 ) {
+                infixes_and_extensions.emplace_back( f + "_" + m.name, "csv" );
+            }
         }
     }
     options.file_output.check_output_files_nonexistence( infixes_and_extensions );
@@ -444,21 +1172,35 @@ void run_correlation( CorrelationOptions const& options )
         );
     }
 
+    // Random engine for the permutations. Report the seed, so that runs can be reproduced.
+    auto seed = options.permutation_seed;
+    if( options.permutations > 0 && seed == 0 ) {
+        seed = std::random_device{}();
+    }
+    if( options.permutations > 0 ) {
+        LOG_MSG1 << "Using seed " << seed << " for the permutations.";
+    }
+    auto engine = std::mt19937_64( seed );
+
     LOG_MSG1 << "Calculating correlations and writing files.";
 
+    // All trees that we write have the same topology, so we compute their layout only once.
+    auto const layout = options.tree_output.prepare_layout( profile.tree );
+
     // Calculate things as needed.
     if(( options.edge_values == "both" ) || ( options.edge_values == "masses" )) {
         LOG_BOLD;
         LOG_MSG1 << "Calculating corrlation with masses.";
         run_with_matrix(
-            options, variants, profile.edge_masses, df, CorrelationVariant::kMasses, profile.tree
+            options, variants, profile.edge_masses, df, CorrelationVariant::kMasses, layout, engine
         );
     }
     if(( options.edge_values == "both" ) || ( options.edge_values == "imbalances" )) {
         LOG_BOLD;
         LOG_MSG1 << "Calculating corrlation with imbalances.";
         run_with_matrix(
-            options, variants, profile.edge_imbalances, df, CorrelationVariant::kImbalances, profile.tree
+            options, variants, profile.edge_imbalances, df, CorrelationVariant::kImbalances, layout,
+            engine
         );
     }
 }
@@ -47,6 +47,9 @@ public:
     std::string edge_values = "both";
     std::string method      = "all";
 
+    size_t        permutations     = 0;
+    unsigned long permutation_seed = 0;
+
     JplaceInputOptions   jplace_input;
     TableInputOptions    metadata_input{ "metadata", "Metadata Table Input" };
     ColorMapOptions      color_map;
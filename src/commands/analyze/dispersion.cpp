@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -35,9 +36,14 @@
 #include "genesis/placement/function/sample_set.hpp"
 #include "genesis/utils/containers/matrix.hpp"
 #include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/options.hpp"
 #include "genesis/utils/math/matrix.hpp"
+#include "genesis/utils/math/statistics.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <vector>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -100,6 +106,7 @@ void setup_dispersion( CLI::App& app )
     options->jplace_input.add_mass_norm_opt_to_app( sub, true );
     options->jplace_input.add_point_mass_opt_to_app( sub );
     options->jplace_input.add_ignore_multiplicities_opt_to_app( sub );
+    options->jplace_input.add_profile_file_opt_to_app( sub );
 
     // Edge value representation
     sub->add_option(
@@ -230,16 +237,16 @@ std::vector<DispersionVariant> get_variants( DispersionOptions const& options )
 // =================================================================================================
 
 void make_dispersion_color_tree(
-    DispersionOptions const&   options,
-    std::vector<double> const& values,
-    bool                       log_scaling,
-    genesis::tree::Tree const& tree,
-    std::string const&         infix
+    DispersionOptions const&                 options,
+    std::vector<double> const&               values,
+    bool                                     log_scaling,
+    TreeOutputOptions::PreparedLayout const& layout,
+    std::string const&                       infix
 ) {
     using namespace genesis::utils;
 
     // Just in case...
-    if( values.size() != tree.edge_count() ) {
+    if( values.size() != layout.tree.edge_count() ) {
         throw std::runtime_error( "Internal error: Trees and matrices do not fit to each other." );
     }
 
@@ -268,7 +275,7 @@ void make_dispersion_color_tree(
     // Now, make a color vector and write to files.
     auto const colors = color_map( *color_norm, values );
     options.tree_output.write_tree_to_files(
-        tree,
+        layout,
         colors,
         color_map,
         *color_norm,
@@ -278,46 +285,162 @@ void make_dispersion_color_tree(
 }
 
 // =================================================================================================
-//      Run with Matrix
+//      Column Statistics
 // =================================================================================================
 
 /**
- * @brief Run with either the masses or the imbalances matrix.
+ * @brief Running count, mean, and sum of squared differences from the mean for each column
+ * of a matrix, as used in Welford's algorithm.
  */
-void run_with_matrix(
-    DispersionOptions const&              options,
-    std::vector<DispersionVariant> const& variants,
-    genesis::utils::Matrix<double> const& values,
-    DispersionVariant::EdgeValues         edge_values,
-    genesis::tree::Tree const&            tree
-) {
-    using namespace genesis::utils;
+struct ColumnMoments
+{
+    explicit ColumnMoments( size_t cols = 0 )
+        : counts( cols, 0.0 )
+        , means(  cols, 0.0 )
+        , m2s(    cols, 0.0 )
+    {}
 
-    if( values.cols() != tree.edge_count() ) {
-        throw std::runtime_error( "Internal Error: Edge values does not have corrent length." );
+    std::vector<double> counts;
+    std::vector<double> means;
+    std::vector<double> m2s;
+};
+
+/**
+ * @brief Add a row of values to the moments. Non-finite values are skipped, as in genesis.
+ */
+void add_row_to_moments( ColumnMoments& moments, std::vector<double> const& row )
+{
+    auto const cols = row.size();
+    auto const x  = row.data();
+    auto const n  = moments.counts.data();
+    auto const mu = moments.means.data();
+    auto const m2 = moments.m2s.data();
+
+    bool all_finite = true;
+    for( size_t c = 0; c < cols; ++c ) {
+        all_finite &= std::isfinite( x[c] );
     }
 
-    auto matrix_col_mean_stddev = []( Matrix<double> const& data ){
-        auto ret = std::vector<MeanStddevPair>( data.cols(), { 0.0, 0.0 } );
+    // Fast path without branches, which the compiler can vectorize.
+    if( all_finite ) {
+        #pragma omp simd
+        for( size_t c = 0; c < cols; ++c ) {
+            n[c] += 1.0;
+            double const delta = x[c] - mu[c];
+            mu[c] += delta / n[c];
+            m2[c] += delta * ( x[c] - mu[c] );
+        }
+        return;
+    }
 
-        // Nothing to do. Better stop here or we risk dividing by zero.
-        if( data.rows() == 0 ) {
-            return ret;
+    for( size_t c = 0; c < cols; ++c ) {
+        if( ! std::isfinite( x[c] )) {
+            continue;
         }
+        n[c] += 1.0;
+        double const delta = x[c] - mu[c];
+        mu[c] += delta / n[c];
+        m2[c] += delta * ( x[c] - mu[c] );
+    }
+}
 
-        // Iterate columns.
-        #pragma omp parallel for
-        for( size_t c = 0; c < data.cols(); ++c ) {
-            ret[c] = mean_stddev( data.col(c).begin(), data.col(c).end() );
+/**
+ * @brief Merge the moments of two disjoint sets of rows, using the formula of Chan et al.
+ */
+void merge_moments( ColumnMoments& target, ColumnMoments const& other )
+{
+    auto const cols = target.counts.size();
+    for( size_t c = 0; c < cols; ++c ) {
+        auto const na = target.counts[c];
+        auto const nb = other.counts[c];
+        if( nb == 0.0 ) {
+            continue;
         }
+        auto const n = na + nb;
+        auto const delta = other.means[c] - target.means[c];
+        target.means[c] += delta * nb / n;
+        target.m2s[c]   += other.m2s[c] + delta * delta * na * nb / n;
+        target.counts[c] = n;
+    }
+}
 
-        return ret;
-    };
+/**
+ * @brief Compute the mean and (population) standard deviation of each column of the matrix,
+ * equivalent to calling genesis `mean_stddev()` on each column.
+ *
+ * Instead of iterating the columns, we read each row once, and update running (Welford) moments
+ * of all columns. The rows are split into contiguous ranges that are processed in parallel,
+ * and whose moments are merged at the end. This streams over the matrix in storage order,
+ * so that a memory-mapped profile never needs to be fully resident in memory.
+ */
+std::vector<genesis::utils::MeanStddevPair> column_mean_stddev( ProfileMatrix const& data )
+{
+    using namespace genesis::utils;
+
+    auto const rows = data.rows();
+    auto const cols = data.cols();
+    auto result = std::vector<MeanStddevPair>( cols, { 0.0, 0.0 } );
+
+    // Nothing to do. Better stop here or we risk dividing by zero.
+    if( rows == 0 ) {
+        return result;
+    }
+    if( data.is_mapped() ) {
+        data.file()->advise_sequential();
+    }
+
+    // Use a fixed number of ranges of rows, so that the result does not depend on scheduling.
+    auto const threads = std::max<size_t>( 1, Options::get().number_of_threads() );
+    auto const chunks = std::min( rows, threads );
+    auto partials = std::vector<ColumnMoments>( chunks );
+
+    #pragma omp parallel for schedule(static)
+    for( size_t i = 0; i < chunks; ++i ) {
+        partials[i] = ColumnMoments( cols );
+        auto row = std::vector<double>( cols );
+        for( size_t r = rows * i / chunks; r < rows * ( i + 1 ) / chunks; ++r ) {
+            data.read_row( r, row.data() );
+            add_row_to_moments( partials[i], row );
+        }
+    }
+    for( size_t i = 1; i < chunks; ++i ) {
+        merge_moments( partials[0], partials[i] );
+    }
+
+    auto const& total = partials[0];
+    for( size_t c = 0; c < cols; ++c ) {
+        if( total.counts[c] > 0.0 ) {
+            result[c].mean   = total.means[c];
+            result[c].stddev = std::sqrt( std::max( 0.0, total.m2s[c] / total.counts[c] ));
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//      Run with Matrix
+// =================================================================================================
+
+/**
+ * @brief Run with either the masses or the imbalances matrix.
+ */
+void run_with_matrix(
+    DispersionOptions const&                 options,
+    std::vector<DispersionVariant> const&    variants,
+    ProfileMatrix const&                     values,
+    DispersionVariant::EdgeValues            edge_values,
+    TreeOutputOptions::PreparedLayout const& layout
+) {
+    using namespace genesis::utils;
+
+    if( values.cols() != layout.tree.edge_count() ) {
+        throw std::runtime_error( "Internal Error: Edge values does not have corrent length." );
+    }
 
     // Calculate things. We calculate everyting, which might be a bit wasteful if the "all" option
     // is not used. But these are really cheap calculations, and in the standard "all" case,
     // we need all of them twice (linear and log scaling).
-    auto const mean_stddev = matrix_col_mean_stddev( values );
+    auto const mean_stddev = column_mean_stddev( values );
     auto sd_vec  = std::vector<double>( mean_stddev.size(), 0.0 );
     auto var_vec = std::vector<double>( mean_stddev.size(), 0.0 );
     auto cv_vec  = std::vector<double>( mean_stddev.size(), 0.0 );
@@ -329,13 +452,15 @@ void run_with_matrix(
         vmr_vec[ i ] = mean_stddev[ i ].stddev * mean_stddev[ i ].stddev / mean_stddev[ i ].mean;
     }
 
-    // Loop over all variants that have been set.
-    for( auto const& variant : variants ) {
+    // Loop over all variants that have been set. The trees all use the same layout,
+    // so we can write them in parallel.
+    parallel_for_items( variants.size(), [&]( size_t vi ){
+        auto const& variant = variants[vi];
 
         // Only process the variants that have the current input metrix.
         // This is ugly, I know. But the distinction has to be made somewhere...
         if( variant.edge_values != edge_values ) {
-            continue;
+            return;
         }
 
         // Get the data vector that we want to use for this variant.
@@ -364,8 +489,8 @@ void run_with_matrix(
         assert( vec );
 
         // Make a tree using the data vector and name of the variant.
-        make_dispersion_color_tree( options, *vec, variant.log_scaling, tree, variant.name );
-    }
+        make_dispersion_color_tree( options, *vec, variant.log_scaling, layout, variant.name );
+    });
 }
 
 // =================================================================================================
@@ -416,15 +541,18 @@ void run_dispersion( DispersionOptions const& options )
 
     LOG_MSG2 << "Calculating dispersions and writing files.";
 
+    // All trees that we write have the same topology, so we compute their layout only once.
+    auto const layout = options.tree_output.prepare_layout( profile.tree );
+
     // Calculate things as needed.
     if(( options.edge_values == "both" ) || ( options.edge_values == "masses" )) {
         run_with_matrix(
-            options, variants, profile.edge_masses, DispersionVariant::kMasses, profile.tree
+            options, variants, profile.edge_masses, DispersionVariant::kMasses, layout
         );
     }
     if(( options.edge_values == "both" ) || ( options.edge_values == "imbalances" )) {
         run_with_matrix(
-            options, variants, profile.edge_imbalances, DispersionVariant::kImbalances, profile.tree
+            options, variants, profile.edge_imbalances, DispersionVariant::kImbalances, layout
         );
     }
 }
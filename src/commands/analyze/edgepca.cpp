@@ -26,6 +26,7 @@
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
 #include "tools/misc.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -267,22 +268,31 @@ void run_edgepca( EdgepcaOptions const& options )
     auto nw = genesis::tree::CommonTreeNewickWriter();
     nw.write( edge_index_tree, options.file_output.get_output_target( "edge_indices", "newick" ));
 
-    // Trees
-    for( size_t c = 0; c < epca_data.projection.cols(); ++c ) {
+    // Trees. They all have the same topology, so we compute their layout only once,
+    // and can then write them in parallel.
+    auto const layout = options.tree_output.prepare_layout( tree );
+    parallel_for_items( epca_data.projection.cols(), [&]( size_t c ){
         // LOG_BOLD;
-        LOG_MSG1 << "Writing tree for component " << c;
+        #pragma omp critical(GAPPA_EDGEPCA_PRINT)
+        {
+            LOG_MSG1 << "Writing tree for component " << c;
+        }
 
-        // Prepare a list of all eigenvector componentes, for the whole tree, using 0 when that
-        // edge has not been used in the PCA (filtered out, or leaf edge).
+        // Prepare a list of all eigenvector componentes, for the whole tree, using 0 when
+        // that edge has not been used in the PCA (filtered out, or leaf edge).
         auto eigenvector_comps = std::vector<double>( tree.edge_count(), 0.0);
         for( size_t r = 0; r < epca_data.edge_indices.size(); ++r ) {
-            eigenvector_comps.at( epca_data.edge_indices[r] ) = epca_data.eigenvectors.at( r, c );
+            auto const edge_index = epca_data.edge_indices[r];
+            eigenvector_comps.at( edge_index ) = epca_data.eigenvectors.at( r, c );
         }
 
         // Write a tree with those values annotated in NHX-style at the edges.
         auto nw = genesis::tree::CommonTreeNewickWriter();
         nw.edge_to_element_plugins.push_back(
-            [&]( genesis::tree::TreeEdge const& edge, genesis::tree::NewickBrokerElement& element ){
+            [&](
+                genesis::tree::TreeEdge const& edge,
+                genesis::tree::NewickBrokerElement& element
+            ){
                 element.comments.push_back(
                     "&&NHX:eigen=" + std::to_string( eigenvector_comps[ edge.index() ])
                 );
@@ -299,14 +309,18 @@ void run_edgepca( EdgepcaOptions const& options )
         color_norm.make_centric();
 
         // Get the colors for the column we are interested in.
-        auto const eigen_color_vector = color_map( color_norm, epca_data.eigenvectors.col( c ));
+        auto const eigen_color_vector = color_map(
+            color_norm, epca_data.eigenvectors.col( c )
+        );
 
         // Init colors with the mask color, signifying that these edges do not have a value.
         std::vector<utils::Color> color_vector( tree.edge_count(), color_map.mask_color() );
-        // std::vector<utils::Color> color_vector( tree.edge_count(), color_map( color_norm, 0.0 ));
+        // std::vector<utils::Color> color_vector(
+        //     tree.edge_count(), color_map( color_norm, 0.0 )
+        // );
 
-        // For each edge that has an eigenvector, get its color and store it.
-        // We need to do this because the filtering of const columns might have removed some.
+        // For each edge that has an eigenvector, get its color and store it. We need to do
+        // this because the filtering of const columns might have removed some.
         for( size_t i = 0; i < epca_data.edge_indices.size(); ++i ) {
             auto const edge_index = epca_data.edge_indices[i];
             color_vector[ edge_index ] = eigen_color_vector[i];
@@ -315,12 +329,12 @@ void run_edgepca( EdgepcaOptions const& options )
         // Write tree
         auto const tree_infix = "tree_" + std::to_string( c );
         options.tree_output.write_tree_to_files(
-            tree,
+            layout,
             color_vector,
             color_map,
             color_norm,
             options.file_output,
             tree_infix
         );
-    }
+    });
 }
@@ -26,6 +26,7 @@
 #include "commands/analyze/kmeans.hpp"
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -41,7 +42,9 @@
 #include "genesis/utils/math/matrix.hpp"
 #include "genesis/utils/text/string.hpp"
 
+#include <algorithm>
 #include <fstream>
+#include <limits>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -62,6 +65,7 @@ void setup_ikmeans( CLI::App& app )
 
     // Setup common kmeans options.
     setup_kmeans( opt.get(), sub, "ikmeans_" );
+    opt->jplace_input.add_profile_file_opt_to_app( sub );
 
     // Set the run function as callback to be called when this subcommand is issued.
     // Hand over the options by copy, so that their shared ptr stays alive in the lambda.
@@ -97,9 +101,8 @@ void write_ikmeans_cluster_trees(
         );
     }
 
-    // Get color map and norm.
+    // Get color map. The norm is autoscaled per tree, so each tree gets its own below.
     auto color_map  = options.color_map.color_map();
-    auto color_norm = options.color_norm.get_sequential_norm();
 
     // As we used the imbalances for the actual clustering, there is no mass tree that
     // we can use here yet. So, we need to add up masses for each cluster.
@@ -125,24 +128,26 @@ void write_ikmeans_cluster_trees(
     }
 
     // Now, each centroid contains the masses of all samples assigned to it.
-    // Write them to tree files.
-    for( size_t ci = 0; ci < k; ++ci ) {
-
+    // Write them to tree files. All trees share the reference tree topology, so we compute
+    // the layout only once, and can then write them in parallel.
+    auto const layout = options.tree_output.prepare_layout( profile.tree );
+    parallel_for_items( k, [&]( size_t ci ){
         // Prepare colors
         auto const& masses = centroid_masses[ci];
+        auto color_norm = options.color_norm.get_sequential_norm();
         color_norm->autoscale_max( masses );
 
         // Now, make a color vector and write to files.
         auto const colors = color_map( *color_norm, masses );
         options.tree_output.write_tree_to_files(
-            profile.tree,
+            layout,
             colors,
             color_map,
             *color_norm,
             options.file_output,
             cluster_tree_infix( k, ci )
         );
-    }
+    });
 }
 
 // =================================================================================================
@@ -167,23 +172,44 @@ void run_ikmeans( IkmeansOptions const& options )
     // Check for existing files.
     check_kmeans_output_files( options );
 
-    // Read input data into imbalances matrix. Filter columns.
-    auto profile = options.jplace_input.placement_profile( true, true );
-    auto const columns = filter_constant_columns( profile.edge_imbalances, 0.001 );
+    // Read input data into imbalances matrix.
+    auto const profile = options.jplace_input.placement_profile( true, true );
+    auto const& edge_imbalances = profile.edge_imbalances;
+    auto row_buffer = std::vector<double>( edge_imbalances.cols() );
+
+    // Find the columns that are not (nearly) constant, in the same way that
+    // filter_constant_columns() does it, but streaming over the rows of the profile matrix,
+    // so that a memory-mapped profile is not copied into memory as a whole.
+    auto const inf = std::numeric_limits<double>::infinity();
+    auto col_min = std::vector<double>( edge_imbalances.cols(),  inf );
+    auto col_max = std::vector<double>( edge_imbalances.cols(), -inf );
+    for( size_t i = 0; i < edge_imbalances.rows(); ++i ) {
+        edge_imbalances.read_row( i, row_buffer.data() );
+        for( size_t j = 0; j < edge_imbalances.cols(); ++j ) {
+            col_min[j] = std::min( col_min[j], row_buffer[j] );
+            col_max[j] = std::max( col_max[j], row_buffer[j] );
+        }
+    }
+    auto columns = std::vector<size_t>();
+    for( size_t j = 0; j < edge_imbalances.cols(); ++j ) {
+        if( col_max[j] - col_min[j] >= 0.001 ) {
+            columns.push_back( j );
+        }
+    }
 
-    // Move data into vectors, as this is what the kmeans needs.
-    // It is a bit stupid, but otherweise the const column filtering would be weird...
+    // Move the filtered data into vectors, as this is what the kmeans needs.
     auto edge_imb_vec = std::vector<std::vector<double>>();
-    edge_imb_vec.resize( profile.edge_imbalances.rows() );
-    for( size_t i = 0; i < profile.edge_imbalances.rows(); ++i ) {
-        edge_imb_vec[i].resize( profile.edge_imbalances.cols() );
-        for( size_t j = 0; j < profile.edge_imbalances.cols(); ++j ) {
-            edge_imb_vec[i][j] = profile.edge_imbalances(i, j);
+    edge_imb_vec.resize( edge_imbalances.rows() );
+    for( size_t i = 0; i < edge_imbalances.rows(); ++i ) {
+        edge_imbalances.read_row( i, row_buffer.data() );
+        edge_imb_vec[i].resize( columns.size() );
+        for( size_t j = 0; j < columns.size(); ++j ) {
+            edge_imb_vec[i][j] = row_buffer[ columns[j] ];
         }
     }
 
     // Set up kmeans.
-    auto ikmeans = EuclideanKmeans( profile.edge_imbalances.cols() );
+    auto ikmeans = EuclideanKmeans( columns.size() );
     ikmeans.report_iteration = [&]( size_t iteration ){
         LOG_MSG2 << " - Iteration " << iteration;
     };
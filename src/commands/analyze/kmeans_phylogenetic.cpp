@@ -26,6 +26,7 @@
 #include "commands/analyze/kmeans.hpp"
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -102,29 +103,34 @@ void write_pkmeans_cluster_trees(
         );
     }
 
-    // Get color map and norm.
+    // Get color map. The norm is autoscaled per tree, so each tree gets its own below.
     auto color_map  = options.color_map.color_map();
-    auto color_norm = options.color_norm.get_sequential_norm();
 
-    // Write all centroid trees
-    for( size_t ci = 0; ci < centroids.size(); ++ci ) {
+    // Write all centroid trees. They all have the topology of the reference tree,
+    // so we compute the layout only once, and can then write them in parallel.
+    if( centroids.empty() ) {
+        return;
+    }
+    auto const layout = options.tree_output.prepare_layout( centroids[0] );
+    parallel_for_items( centroids.size(), [&]( size_t ci ){
         auto const& centroid = centroids[ci];
 
         // Prepare colors
         auto const masses = mass_tree_mass_per_edge( centroid );
+        auto color_norm = options.color_norm.get_sequential_norm();
         color_norm->autoscale_max( masses );
 
         // Now, make a color vector and write to files.
         auto const colors = color_map( *color_norm, masses );
         options.tree_output.write_tree_to_files(
-            centroid,
+            layout,
             colors,
             color_map,
             *color_norm,
             options.file_output,
             cluster_tree_infix( k, ci )
         );
-    }
+    });
 }
 
 // =================================================================================================
@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -326,14 +327,16 @@ void write_factor_edges(
     std::vector<genesis::tree::PhyloFactor> const& factors,
     genesis::tree::Tree const& tree
 ) {
-    for( size_t i = 0; i < factors.size(); ++i ) {
+    // Same topology for all factors, so we compute the layout only once.
+    auto const layout = options.tree_output.prepare_layout( tree );
+    parallel_for_items( factors.size(), [&]( size_t i ){
         // Make a tree with the edges of that factor.
         auto edge_cols = phylo_factor_single_factor_colors( tree, factors, i );
 
         options.tree_output.write_tree_to_files(
-            tree, edge_cols, options.file_output, "factor_edges_" + std::to_string( i+1 )
+            layout, edge_cols, options.file_output, "factor_edges_" + std::to_string( i+1 )
         );
-    }
+    });
 }
 
 void write_factor_objective_values(
@@ -343,7 +346,9 @@ void write_factor_objective_values(
 ) {
     using namespace genesis::utils;
 
-    for( size_t i = 0; i < factors.size(); ++i ) {
+    // Same topology for all factors, so we compute the layout only once.
+    auto const layout = options.tree_output.prepare_layout( tree );
+    parallel_for_items( factors.size(), [&]( size_t i ){
         auto const& factor = factors[i];
 
         // write objective value trees
@@ -354,10 +359,10 @@ void write_factor_objective_values(
         auto const edge_cols = cm( cn, factor.all_objective_values );
 
         options.tree_output.write_tree_to_files(
-            tree, edge_cols, cm, cn,
+            layout, edge_cols, cm, cn,
             options.file_output, "objective_values_" + std::to_string( i+1 )
         );
-    }
+    });
 }
 
 void write_factor_taxa(
@@ -132,7 +132,16 @@ void run_squash( SquashOptions const& options )
     sc.report_step = [&]( size_t i, size_t total ){
         LOG_MSG2 << " - Step " << i << " of " << total;
     };
+    // All cluster trees have the topology of the reference tree, so we only compute
+    // their layout once, for the first tree that is written.
+    TreeOutputOptions::PreparedLayout layout;
+    bool layout_ready = false;
     sc.write_cluster_tree = [&]( tree::MassTree const& cluster_tree, size_t index ){
+        if( ! layout_ready ) {
+            layout = options.tree_output.prepare_layout( cluster_tree );
+            layout_ready = true;
+        }
+
         // Prepare colors
         auto const masses = tree::mass_tree_mass_per_edge( cluster_tree );
         color_norm->autoscale_max( masses );
@@ -140,7 +149,7 @@ void run_squash( SquashOptions const& options )
         // Now, make a color vector and write to files.
         auto const colors = color_map( *color_norm, masses );
         options.tree_output.write_tree_to_files(
-            cluster_tree,
+            layout,
             colors,
             color_map,
             *color_norm,
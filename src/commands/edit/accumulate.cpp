@@ -25,10 +25,10 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/function/functions.hpp"
 #include "genesis/placement/function/masses.hpp"
 #include "genesis/tree/function/functions.hpp"
@@ -229,8 +229,5 @@ void run_accumulate( AccumulateOptions const& options )
     }
 
     // Write the new sample to a file.
-    JplaceWriter().write(
-        sample,
-        options.jplace_output.get_output_target( "accumulated", "jplace" )
-    );
+    ParallelJplaceWriter().write( sample, options.jplace_output, "accumulated" );
 }
@@ -25,10 +25,10 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/function/functions.hpp"
 #include "genesis/tree/function/functions.hpp"
 #include "genesis/utils/core/fs.hpp"
@@ -118,8 +118,5 @@ void run_merge( MergeOptions const& options )
     auto sample = options.jplace_input.merged_samples();
 
     // Write the new sample to a file.
-    JplaceWriter().write(
-        sample,
-        options.jplace_output.get_output_target( "merge", "jplace" )
-    );
+    ParallelJplaceWriter().write( sample, options.jplace_output, "merge" );
 }
@@ -25,10 +25,10 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/sequence/formats/fasta_input_iterator.hpp"
 #include "genesis/sequence/formats/fasta_reader.hpp"
 #include "genesis/sequence/functions/labels.hpp"
@@ -38,6 +38,8 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <map>
 #include <unordered_map>
@@ -216,6 +218,80 @@ std::pair<MultiplicityMap, std::vector<std::string>> get_multiplicities_csv_file
     return { result, duplicates };
 }
 
+/**
+ * @brief Get the pquery name and multiplicity from a sequence @p label with attributes,
+ * such as `name;size=123;weight=0.5`, without throwing.
+ *
+ * This is a single pass version of using `label_attributes()` and converting the `size` and
+ * `weight` attributes with `std::stod()`: The label is split at semicolons, the first part is the
+ * name, and all further parts are `key=value` attributes. A trailing semicolon is allowed.
+ * The multiplicity is the product of the `size` and `weight` attributes, if present.
+ * Returns `false` if the label has no attributes, if they are malformed, or if the numbers
+ * cannot be converted. In these cases, @p name and @p value are not changed.
+ */
+static bool parse_label_attributes_multiplicity(
+    std::string const& label, std::string& name, double& value
+) {
+    auto const first = label.find( ';' );
+    if( first == std::string::npos ) {
+        return false;
+    }
+
+    // Convert a number starting at a position of the label, as std::stod() does. The number ends
+    // at the semicolon of the next attribute at the latest, as semicolons cannot be part of it.
+    auto parse_number = [&]( size_t pos, double& result ){
+        errno = 0;
+        auto const begin = label.c_str() + pos;
+        char* end = nullptr;
+        result = std::strtod( begin, &end );
+        return end != begin && errno != ERANGE;
+    };
+
+    // Go through all attributes. If a key is used multiple times, the last value is used.
+    double size   = 1.0;
+    double weight = 1.0;
+    bool has_attributes = false;
+    size_t pos = first + 1;
+    while( pos < label.size() ) {
+        auto end = label.find( ';', pos );
+        if( end == std::string::npos ) {
+            end = label.size();
+        }
+
+        // Each attribute needs exactly one '='.
+        auto const eq = label.find( '=', pos );
+        if( eq >= end ) {
+            return false;
+        }
+        auto const eq2 = label.find( '=', eq + 1 );
+        if( eq2 < end ) {
+            return false;
+        }
+
+        // Convert the values that we are interested in.
+        auto const key_len = eq - pos;
+        if( key_len == 4 && label.compare( pos, key_len, "size" ) == 0 ) {
+            if( ! parse_number( eq + 1, size )) {
+                return false;
+            }
+        } else if( key_len == 6 && label.compare( pos, key_len, "weight" ) == 0 ) {
+            if( ! parse_number( eq + 1, weight )) {
+                return false;
+            }
+        }
+
+        has_attributes = true;
+        pos = end + 1;
+    }
+    if( ! has_attributes ) {
+        return false;
+    }
+
+    name = label.substr( 0, first );
+    value = size * weight;
+    return true;
+}
+
 std::pair<MultiplicityMap, std::vector<std::string>> get_multiplicities_fasta_files(
     MultiplicityOptions const& options
 ) {
@@ -229,45 +305,28 @@ std::pair<MultiplicityMap, std::vector<std::string>> get_multiplicities_fasta_fi
     MultiplicityMap result;
     std::vector<std::string> duplicates;
 
-    // Read fasta files in parallel.
+    // Read fasta files in parallel. Each file is read into a map of its own,
+    // which is merged into the result once the file is done.
     #pragma omp parallel for schedule(dynamic)
     for( size_t file_idx = 0; file_idx < options.sequence_input.file_count(); ++file_idx ) {
         auto const file_path = options.sequence_input.file_path( file_idx );
         auto const sample = options.sequence_input.base_file_name( file_idx );
 
+        std::unordered_map<std::string, double> file_result;
+        std::vector<std::string> file_duplicates;
+
         // Iterate the file and read all sequence labels.
         auto seq_it = sequence::FastaInputIterator( utils::from_file( file_path ));
         while( seq_it ) {
             std::string pquery;
             double      value;
 
-            // First try to simply use the abundance.
+            // First try to use the attributes of the label, "name;size=123;weight=0.5".
+            // If there are none, simply use the abundance.
             // This accepts both formats "size=123" and "_123".
             auto const& label = seq_it->label();
-            auto const abun = sequence::guess_sequence_abundance( label );
-            pquery = abun.first;
-            value = abun.second;
-
-            // Also try the more elaborate way of using attributes directly.
-            // A bit redundant, but okay for now. Those values might overwrite the previous ones.
-            // The try clause catches all kinds of erros: label_attributes might throw,
-            // or any of the string to number conversions.
-            // In each such case, we simply reset to what we had before.
-            try{
-                auto const la = sequence::label_attributes( label );
-                if( ! la.attributes.empty() ) {
-                    pquery = la.label;
-                    double mult = 1.0;
-                    if( la.attributes.count("size") > 0 ) {
-                        mult *= std::stod( la.attributes.at( "size" ));
-                    }
-                    if( la.attributes.count("weight") > 0 ) {
-                        mult *= std::stod( la.attributes.at( "weight" ));
-                    }
-                    value = mult;
-                }
-            } catch(...) {
-                // Reset to previous values.
+            if( ! parse_label_attributes_multiplicity( label, pquery, value )) {
+                auto const abun = sequence::guess_sequence_abundance( label );
                 pquery = abun.first;
                 value = abun.second;
             }
@@ -277,23 +336,38 @@ std::pair<MultiplicityMap, std::vector<std::string>> get_multiplicities_fasta_fi
                 pquery = label;
             }
 
-            // Set the value in the result.
-            #pragma omp critical(GAPPA_MULTIPLICITY_ADD_MULTIPLICITY)
-            {
-                // Check if it is a duplicate.
-                if( result[ sample ].count( pquery ) > 0 ) {
-                    duplicates.push_back(
-                        sample + ( sample.empty() ? "" : " " ) + pquery
-                    );
-                }
-
-                // Store in result.
-                result[ sample ][ pquery ] = value;
+            // Set the value in the result of the file, and check if it is a duplicate.
+            auto const ins = file_result.emplace( std::move( pquery ), value );
+            if( ! ins.second ) {
+                file_duplicates.push_back(
+                    sample + ( sample.empty() ? "" : " " ) + ins.first->first
+                );
+                ins.first->second = value;
             }
 
             // Next sequence;
             ++seq_it;
         }
+
+        // Merge into the result. Different files usually belong to different samples,
+        // in which case we can simply move the map. Otherwise, we need to check for duplicates.
+        #pragma omp critical(GAPPA_MULTIPLICITY_ADD_MULTIPLICITY)
+        {
+            auto& sample_result = result[ sample ];
+            if( sample_result.empty() ) {
+                sample_result = std::move( file_result );
+            } else {
+                for( auto& entry : file_result ) {
+                    if( sample_result.count( entry.first ) > 0 ) {
+                        duplicates.push_back(
+                            sample + ( sample.empty() ? "" : " " ) + entry.first
+                        );
+                    }
+                    sample_result[ entry.first ] = entry.second;
+                }
+            }
+            duplicates.insert( duplicates.end(), file_duplicates.begin(), file_duplicates.end() );
+        }
     }
 
     return { result, duplicates };
@@ -399,10 +473,7 @@ void change_multiplicities( MultiplicityOptions const& options )
         }
 
         // Write sample back to file.
-        genesis::placement::JplaceWriter().write(
-            sample,
-            options.file_output.get_output_target( basename, "jplace" )
-        );
+        ParallelJplaceWriter().write( sample, options.file_output, basename );
     }
 
     if( not_found > 0 ) {
@@ -25,14 +25,18 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/function/functions.hpp"
-#include "genesis/placement/function/sample_set.hpp"
+#include "genesis/placement/function/helper.hpp"
 #include "genesis/utils/containers/matrix.hpp"
 #include "genesis/utils/core/algorithm.hpp"
+#include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/options.hpp"
+#include "genesis/utils/core/std.hpp"
 #include "genesis/utils/formats/csv/reader.hpp"
 #include "genesis/utils/io/input_source.hpp"
 #include "genesis/utils/io/input_stream.hpp"
@@ -41,9 +45,11 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -54,38 +60,30 @@
 // =================================================================================================
 
 /**
- * @brief Describes a sample by its name and a list of its pqueries and their abundances.
+ * @brief Structure that holds an entiere OTU table. This is the internal format used here.
+ *
+ * Instead of storing the table per sample, we store it per pquery name, that is, for each name,
+ * we store the samples that it goes to, so that the names of the pqueries in the jplace files
+ * can directly be looked up. We use this form instead of a full OTU table, because those are
+ * often quite sparse, and we do not want to waste memory.
  */
-struct SampleContent
+struct OtuTable
 {
     /**
-     * @brief Name of the sample.
+     * @brief Names of the samples. Indices in the vector are used in the pquery targets.
      */
-    std::string name;
+    std::vector<std::string> sample_names;
 
     /**
-     * @brief Map from a pquery (index in the pquery_names vector) to its abundance.
-     *
-     * We use this form instead of a full OTU table, because those are often quite spare,
-     * and we do not want to waste memory.
+     * @brief Map from pquery names to their index in the pquery_targets.
      */
-    std::unordered_map<size_t, double> pqueries;
-};
+    std::unordered_map<std::string, size_t> pquery_indices;
 
-/**
- * @brief Structure that holds an entiere OTU table. This is the internal format used here.
- */
-struct OtuTable
-{
     /**
-     * @brief Names of the pqueries. Indices in the vector are used for lookup.
+     * @brief For each pquery, the list of samples (index in the sample_names) that it goes to,
+     * with its abundance in that sample.
      */
-    std::vector<std::string> pquery_names;
-
-    /**
-     * @brief Keep the content of each sample.
-     */
-    std::vector<SampleContent> samples;
+    std::vector<std::vector<std::pair<size_t, double>>> pquery_targets;
 };
 
 // =================================================================================================
@@ -181,11 +179,8 @@ OtuTable read_split_file( SplitOptions const& options )
     auto const table = reader.read( utils::from_file( options.split_file ));
 
     // The list in the file is not expected to be sorted. Thus, use lookups to find entries.
-    std::unordered_map<std::string, size_t> pquery_to_index;
     std::unordered_map<std::string, size_t> sample_to_index;
 
-    // Iterate it once to get all pquery names and sample in a fixed order.
-    // Unfortunate, but the price we pay for a smaller data structure.
     for( auto const& line : table ) {
 
         // Some consistency check. We do not allow to mix line sizes in one file.
@@ -202,32 +197,6 @@ OtuTable read_split_file( SplitOptions const& options )
         }
         assert( line.size() == 2 || line.size() == 3 );
 
-        // If the pquery name does not already have an index, give it one, and add it to the list.
-        auto const& pquery_name = line[0];
-        if( pquery_to_index.count( pquery_name ) == 0 ) {
-            pquery_to_index[ pquery_name ] = result.pquery_names.size();
-            result.pquery_names.push_back( pquery_name );
-        }
-
-        // Assert that it worked.
-        assert( pquery_to_index.count( pquery_name ) > 0 );
-        assert( pquery_to_index.at( pquery_name ) < result.pquery_names.size() );
-        assert( result.pquery_names.at( pquery_to_index.at( pquery_name )) == pquery_name );
-
-        // Same for the sample name.
-        auto const& sample_name = line[1];
-        if( sample_to_index.count( sample_name ) == 0 ) {
-            sample_to_index[ sample_name ] = result.samples.size();
-            result.samples.emplace_back();
-            result.samples.back().name = sample_name;
-        }
-    }
-
-    // Iterate it again, this time to fill the samples.
-    for( auto const& line : table ) {
-        assert(( line.size() == 2 && line_size == 2 ) || ( line.size() == 3 && line_size == 3 ));
-        assert( line.size() == 2 || line.size() == 3 );
-
         // Get the parts of the line.
         auto const& pquery_name = line[0];
         auto const& sample_name = line[1];
@@ -245,17 +214,37 @@ OtuTable read_split_file( SplitOptions const& options )
             }
         }
 
-        // Add it to the result.
-        assert( sample_to_index.count( sample_name ) > 0 );
-        assert( pquery_to_index.count( pquery_name ) > 0 );
-        assert( sample_to_index.at( sample_name ) < result.samples.size() );
-        auto& sample_entry = result.samples.at( sample_to_index.at( sample_name ));
-        auto const pquery_idx = pquery_to_index.at( pquery_name );
-        if( sample_entry.pqueries.count( pquery_idx ) > 0 ) {
+        // If the pquery name or the sample name does not already have an index, give it one.
+        auto const pquery_ins = result.pquery_indices.emplace(
+            pquery_name, result.pquery_targets.size()
+        );
+        if( pquery_ins.second ) {
+            result.pquery_targets.emplace_back();
+        }
+        auto const sample_ins = sample_to_index.emplace( sample_name, result.sample_names.size() );
+        if( sample_ins.second ) {
+            result.sample_names.push_back( sample_name );
+        }
+        assert( pquery_ins.first->second < result.pquery_targets.size() );
+        assert( sample_ins.first->second < result.sample_names.size() );
+
+        // Add it to the result. Pqueries usually go to a few samples only,
+        // so we can simply scan them for duplicate entries.
+        auto& targets = result.pquery_targets[ pquery_ins.first->second ];
+        auto const sample_idx = sample_ins.first->second;
+        auto target_it = std::find_if(
+            targets.begin(), targets.end(),
+            [&]( std::pair<size_t, double> const& target ){
+                return target.first == sample_idx;
+            }
+        );
+        if( target_it != targets.end() ) {
             LOG_WARN << "Duplicate entry for pquery '" << pquery_name << "' and sample "
                      << sample_name << ". Adding up their multiplicities.";
+            target_it->second += multip;
+        } else {
+            targets.emplace_back( sample_idx, multip );
         }
-        sample_entry.pqueries[ pquery_idx ] += multip;
     }
 
     return result;
@@ -295,24 +284,21 @@ OtuTable read_otu_table_file( SplitOptions const& options )
 
     // Add a sample for each element in the header (except the first, which is the header for
     // the pquery names column).
+    std::unordered_set<std::string> unique_check;
     for( size_t i = 1; i < header.size(); ++i ) {
         // Check for duplicate sample names.
-        for( auto const& sc : result.samples ) {
-            if( sc.name == header[i] ) {
-                throw std::runtime_error(
-                    "Duplicate sample name '" + header[i] + "' in OTU table."
-                );
-            }
+        if( ! unique_check.insert( header[i] ).second ) {
+            throw std::runtime_error(
+                "Duplicate sample name '" + header[i] + "' in OTU table."
+            );
         }
 
         // Add sample name
-        result.samples.emplace_back();
-        result.samples.back().name = header[i];
-        assert( result.samples.size() == i );
+        result.sample_names.push_back( header[i] );
+        assert( result.sample_names.size() == i );
     }
 
     // Read the table and fill the rest of our result.
-    std::unordered_set<std::string> unique_check;
     while( otu_is ) {
         auto const line = reader.parse_line( otu_is );
         if( line.size() != header.size() ) {
@@ -320,16 +306,13 @@ OtuTable read_otu_table_file( SplitOptions const& options )
         }
         assert( line.size() >= 2 );
 
-        // Get the pquery name (first column), and check for duplicates.
+        // Get the pquery name (first column), check for duplicates, and add it.
         auto const& pquery_name = line[0];
-        if( unique_check.count( pquery_name ) > 0 ) {
+        auto const pquery_idx = result.pquery_targets.size();
+        if( ! result.pquery_indices.emplace( pquery_name, pquery_idx ).second ) {
             throw std::runtime_error( "Duplicate pquery name '" + pquery_name + "' in OTU table." );
         }
-        unique_check.insert( pquery_name );
-
-        // Add pquery name.
-        auto const pquery_idx = result.pquery_names.size();
-        result.pquery_names.push_back( pquery_name );
+        result.pquery_targets.emplace_back();
 
         // Add the per-sample entries (other columns).
         for( size_t i = 1; i < line.size(); ++i ) {
@@ -349,7 +332,7 @@ OtuTable read_otu_table_file( SplitOptions const& options )
             // We get the sample at i-1, because this is where it was added
             // when the header line was processed.
             if( std::isfinite(multip) && multip > 0.0 ) {
-                result.samples.at( i-1 ).pqueries[ pquery_idx ] = multip;
+                result.pquery_targets[ pquery_idx ].emplace_back( i-1, multip );
             }
         }
     }
@@ -381,95 +364,122 @@ void run_split( SplitOptions const& options )
 
     // Check if any of the files we are going to produce already exists. If so, fail early.
     std::vector<std::pair<std::string, std::string>> check_files;
-    for( auto const& sample : otu_table.samples ) {
-        check_files.push_back({ sample.name, "jplace" });
+    for( auto const& sample_name : otu_table.sample_names ) {
+        check_files.push_back({ sample_name, "jplace" });
     }
     options.file_output.check_output_files_nonexistence( check_files );
 
     // Print some user output.
     options.jplace_input.print();
 
-    // User output.
-    LOG_MSG1 << "Reading sample" << ( options.jplace_input.file_count() > 1 ? "s" : "" );
+    // Prepare the writers of the split target samples. They are created once we know the tree.
+    std::vector<std::unique_ptr<JplaceStreamWriter>> writers;
+    std::shared_ptr<PlacementTree const> ref_tree;
 
-    // Read all jplace files at once. Typically, this command is run with one file anyway.
-    auto const sample_set = options.jplace_input.sample_set();
-    if( sample_set.size() == 0 ) {
-        // The jplace input is required, so we should have at least one sample!
-        throw std::runtime_error( "Internal error: Expecting multiple samples." );
-    }
+    // Keep track of which pquery names of the table were found in the input samples.
+    // If a name occurs multiple times in the input, we use the first pquery with that name,
+    // in the order of the input files and the pqueries in them.
+    std::vector<char> found_pqueries( otu_table.pquery_targets.size(), false );
 
-    // Get the reference tree from the samples.
-    if( ! all_identical_trees( sample_set )) {
-        throw std::runtime_error(
-            "Cannot process multiple jplace samples if they have different reference trees."
-        );
-    }
-    auto const& ref_tree = sample_set[0].tree();
-    // TODO make average branch length?!
-
-    // Create a mapping from pquery names to the pquery that contains the name.
-    std::unordered_map<std::string, Pquery const*> name_map;
-    for( auto const& sample : sample_set ) {
-        for( auto const& pquery : sample ) {
-            for( auto const& pname : pquery.names() ) {
-                if( name_map.count( pname.name ) > 0 ) {
-                    LOG_WARN << "Duplicate pquery name '" << pname.name
-                             << "' in the input jplace file(s)";
-                }
-                name_map[ pname.name ] = &pquery;
+    // We process one jplace file at a time, and append its pqueries to all their target samples.
+    // Typically, this command is run with one file anyway, so we parallelize within the file.
+    for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
+
+        // User output.
+        LOG_MSG1 << "Processing file " << ( fi + 1 ) << " of " << options.jplace_input.file_count()
+                 << ": " << options.jplace_input.file_path( fi );
+
+        // Read the sample, and check that the reference trees are all the same.
+        std::shared_ptr<PlacementTree const> sample_tree;
+        auto const sample = options.jplace_input.sample( fi, sample_tree );
+        if( ! ref_tree ) {
+            ref_tree = sample_tree;
+            utils::dir_create( options.file_output.out_dir(), true );
+            for( auto const& sample_name : otu_table.sample_names ) {
+                writers.push_back( utils::make_unique<JplaceStreamWriter>(
+                    options.file_output.get_output_filename( sample_name, "jplace" ),
+                    *ref_tree, options.file_output.compress()
+                ));
             }
+        } else if( sample_tree != ref_tree && ! compatible_trees( *ref_tree, sample.tree() )) {
+            throw std::runtime_error(
+                "Cannot process multiple jplace samples if they have different reference trees."
+            );
         }
-    }
 
-    // User output.
-    LOG_MSG1 << "Writing split samples.";
-
-    // Create and write the split target samples.
-    size_t file_count = 0;
-    #pragma omp parallel for schedule(dynamic)
-    for( size_t si = 0; si < otu_table.samples.size(); ++si ) {
-        auto const& sample_entry = otu_table.samples[si];
+        // Look up the names of the pqueries in the table, in chunks of pqueries. Each chunk
+        // collects the table index, pquery index, and name of each match, in the pquery order.
+        struct NameMatch
+        {
+            size_t             table_index;
+            size_t             pquery_index;
+            std::string const* name;
+        };
+        auto const num_chunks = parallel_chunk_count( sample.size() );
+        auto chunk_matches = std::vector<std::vector<NameMatch>>( num_chunks );
+        parallel_for_chunks( sample.size(), num_chunks, [&]( size_t ci, size_t first, size_t last ){
+            for( size_t qi = first; qi < last; ++qi ) {
+                for( auto const& pname : sample.at( qi ).names() ) {
+                    auto const idx_it = otu_table.pquery_indices.find( pname.name );
+                    if( idx_it != otu_table.pquery_indices.end() ) {
+                        chunk_matches[ci].push_back({ idx_it->second, qi, &pname.name });
+                    }
+                }
+            }
+        });
+
+        // Go through the matches in chunk order, that is, in the order of the pqueries in the
+        // file, and collect the pqueries per target sample, each with the name and multiplicity
+        // that it has in that sample. Duplicates are skipped, so that the first one is used.
+        using TargetPqueries = std::vector<std::pair<size_t, PqueryName>>;
+        auto targets = std::vector<TargetPqueries>( writers.size() );
+        for( auto& matches : chunk_matches ) {
+            for( auto const& match : matches ) {
+                if( found_pqueries[ match.table_index ] ) {
+                    LOG_WARN << "Duplicate pquery name '" << *match.name
+                             << "' in the input jplace file(s). Using the first one.";
+                    continue;
+                }
+                found_pqueries[ match.table_index ] = true;
+                for( auto const& target : otu_table.pquery_targets[ match.table_index ] ) {
+                    targets[ target.first ].emplace_back(
+                        match.pquery_index, PqueryName( *match.name, target.second )
+                    );
+                }
+            }
+            std::vector<NameMatch>().swap( matches );
+        }
 
-        // User output.
-        ++file_count;
-        LOG_MSG2 << "Writing file " << file_count << " of " << otu_table.samples.size()
-                 << ": " << options.file_output.get_output_filename( sample_entry.name, "jplace" );
-
-        // Create a new sample and fill it with the needed pqueries.
-        auto target = Sample( ref_tree );
-        for( auto const& pqry_entry : sample_entry.pqueries ) {
-            auto const& pquery_name = otu_table.pquery_names.at( pqry_entry.first );
-            auto const& multip = pqry_entry.second;
-
-            // See if we find the pquery in the jplace input files.
-            if( name_map.count( pquery_name ) == 0 ) {
-                #pragma omp critical(GAPPA_SPLIT_PRINT)
-                {
-                    LOG_WARN << "Warning: No pquery with name '" << pquery_name
-                             << "' found in input samples.";
+        // Append the pqueries to their target samples. Each writer gets exactly one append
+        // per file, so that the order of the output does not depend on the threads.
+        parallel_for_chunks(
+            targets.size(), parallel_chunk_count( targets.size() ),
+            [&]( size_t, size_t first, size_t last ){
+                for( size_t si = first; si < last; ++si ) {
+                    if( ! targets[si].empty() ) {
+                        writers[si]->append( sample, targets[si] );
+                    }
+                    TargetPqueries().swap( targets[si] );
                 }
-                continue;
             }
+        );
+    }
 
-            // Add to the target sample. We keep it simple here and first copy everything,
-            // including names, then delete them again and add just the one that we want.
-            // This way, we can use the copy mechanism of Sample.add(), which adjusts all
-            // pointers etc for us!
-            auto& new_pqry = target.add( *( name_map.at( pquery_name )));
-            new_pqry.clear_names();
-            new_pqry.add_name( pquery_name, multip );
+    // Warn about names of the table that were not in the input.
+    for( auto const& pquery_index : otu_table.pquery_indices ) {
+        if( ! found_pqueries[ pquery_index.second ] ) {
+            LOG_WARN << "Warning: No pquery with name '" << pquery_index.first
+                     << "' found in input samples.";
         }
+    }
 
-        if( target.size() == 0 ) {
-            LOG_WARN << "Warning: Sample '" << sample_entry.name << "' does not contain any pqueries. "
-                     << "This leads to an empty file being written.";
+    // Finish the files of the split target samples.
+    LOG_MSG1 << "Writing split samples.";
+    for( size_t si = 0; si < writers.size(); ++si ) {
+        writers[si]->finish();
+        if( writers[si]->pquery_count() == 0 ) {
+            LOG_WARN << "Warning: Sample '" << otu_table.sample_names[si] << "' does not contain "
+                     << "any pqueries. This leads to an empty file being written.";
         }
-
-        // Write the new sample to a file.
-        JplaceWriter().write(
-            target,
-            options.file_output.get_output_target( sample_entry.name, "jplace" )
-        );
     }
 }
@@ -426,6 +426,18 @@ std::vector<Taxopath> assign_leaf_taxopaths(PlacementTree const& tree,
     csv_reader.separator_chars( "\t" );
     std::vector<Taxopath> node_labels( tree.node_count() );
 
+    // Index the nodes by name, instead of searching the tree for each line of the file.
+    // As find_node() does, we use the first node with a given name.
+    std::unordered_map<std::string, PlacementTreeNode const*> nodes_by_name;
+    for( size_t i = 0; i < tree.node_count(); ++i ) {
+        auto const& node = tree.node_at( i );
+        nodes_by_name.emplace( node.data<CommonNodeData>().name, &node );
+    }
+
+    // Many reference sequences share the same taxopath,
+    // so we only parse each distinct taxopath string once.
+    std::unordered_map<std::string, Taxopath> taxopath_cache;
+
     size_t leafs_assigned = 0;
     utils::InputStream it( utils::make_unique< utils::FileInputSource >( taxon_file ));
     while (it) {
@@ -438,11 +450,16 @@ std::vector<Taxopath> assign_leaf_taxopaths(PlacementTree const& tree,
         auto name = fields[0];
         std::string tax_string = fields[1];
 
-        auto node_ptr = find_node( tree, name );
+        auto const node_it = nodes_by_name.find( name );
 
         // only set this taxon label into the tree if we actually found a corresponding leaf
-        if ( node_ptr ) {
-            node_labels[ node_ptr->index() ] = tpp.parse( tax_string );
+        if ( node_it != nodes_by_name.end() ) {
+            auto const node_ptr = node_it->second;
+            auto taxopath_it = taxopath_cache.find( tax_string );
+            if( taxopath_it == taxopath_cache.end() ) {
+                taxopath_it = taxopath_cache.emplace( tax_string, tpp.parse( tax_string )).first;
+            }
+            node_labels[ node_ptr->index() ] = taxopath_it->second;
             if ( is_leaf( *node_ptr ) ) {
                 ++leafs_assigned;
             }
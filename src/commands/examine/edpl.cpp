@@ -132,6 +132,7 @@ void run_edpl( EdplOptions const& options )
 
     // Prepare intermediate data.
     Tree tree;
+    std::shared_ptr<PlacementTree const> tree_ptr;
     utils::Matrix<double> node_distances;
     size_t file_count = 0;
     double max_edpl = - std::numeric_limits<double>::infinity();
@@ -161,7 +162,8 @@ void run_edpl( EdplOptions const& options )
                  << ": " << options.jplace_input.file_path( fi );
 
         // Read in file.
-        auto const sample = options.jplace_input.sample( fi );
+        std::shared_ptr<PlacementTree const> sample_tree;
+        auto const sample = options.jplace_input.sample( fi, sample_tree );
 
         // Check whether the tree is the same, and get its distance matrix.
         #pragma omp critical(GAPPA_EDPL_TREE)
@@ -170,8 +172,12 @@ void run_edpl( EdplOptions const& options )
             if( tree.empty() ) {
                 assert( node_distances.empty() );
                 tree = sample.tree();
+                tree_ptr = sample_tree;
                 node_distances = node_branch_length_distance_matrix( tree );
-            } else if( ! genesis::placement::compatible_trees( tree, sample.tree() ) ) {
+            } else if(
+                sample_tree != tree_ptr &&
+                ! genesis::placement::compatible_trees( tree, sample.tree() )
+            ) {
                 throw std::runtime_error( "Input jplace files have differing reference trees." );
             }
             assert( ! node_distances.empty() );
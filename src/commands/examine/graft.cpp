@@ -1,6 +1,6 @@
 /*
     gappa - Genesis Applications for Phylogenetic Placement Analysis
-    Copyright (C) 2017-2022 Lucas Czech
+    Copyright (C) 2017-2024 Lucas Czech
 
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -25,15 +25,30 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_scanner.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_reader.hpp"
-#include "genesis/placement/function/tree.hpp"
+#include "genesis/placement/placement_tree.hpp"
+#include "genesis/placement/sample.hpp"
+#include "genesis/tree/common_tree/newick_reader.hpp"
 #include "genesis/tree/common_tree/newick_writer.hpp"
+#include "genesis/tree/common_tree/tree.hpp"
 #include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/io/input_source.hpp"
 #include "genesis/utils/io/output_target.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
 #endif
@@ -83,6 +98,440 @@ void setup_graft( CLI::App& app )
     ));
 }
 
+// =================================================================================================
+//      Graft Placements
+// =================================================================================================
+
+/**
+ * @brief Query to be grafted onto an edge of the reference tree.
+ *
+ * Pqueries with multiple names get one entry per name, all with the same lengths.
+ * The name is stored as a range in GraftPlacements::names.
+ */
+struct GraftQuery
+{
+    size_t edge_index;
+    double proximal_length;
+    double pendant_length;
+    size_t name_offset;
+    size_t name_length;
+};
+
+/**
+ * @brief All queries of a sample, sorted by the edge that they are grafted onto.
+ *
+ * The queries of the edge with index `i` are found in the range
+ * `[ edge_offsets[i], edge_offsets[i+1] )`.
+ */
+struct GraftPlacements
+{
+    std::vector<GraftQuery> queries;
+    std::vector<size_t>     edge_offsets;
+    std::string             names;
+};
+
+/**
+ * @brief Sort the queries by edge, and within each edge in the order in which they are grafted.
+ *
+ * With @p fully_resolve, the queries are attached along the edge by their proximal length.
+ * Otherwise, they are collected in a subtree, sorted by their pendant length. Edges with a
+ * single query are the same in both cases.
+ */
+static void sort_graft_placements(
+    GraftPlacements& grafts,
+    size_t edge_count,
+    bool fully_resolve
+) {
+    // Stable, so that queries with the same lengths stay in the order of the input.
+    std::stable_sort(
+        grafts.queries.begin(), grafts.queries.end(),
+        [fully_resolve]( GraftQuery const& lhs, GraftQuery const& rhs ){
+            if( lhs.edge_index != rhs.edge_index ) {
+                return lhs.edge_index < rhs.edge_index;
+            }
+            if( fully_resolve ) {
+                return lhs.proximal_length < rhs.proximal_length;
+            }
+            return lhs.pendant_length < rhs.pendant_length;
+        }
+    );
+
+    grafts.edge_offsets.assign( edge_count + 1, 0 );
+    for( auto const& query : grafts.queries ) {
+        ++grafts.edge_offsets[ query.edge_index + 1 ];
+    }
+    for( size_t i = 0; i < edge_count; ++i ) {
+        grafts.edge_offsets[ i + 1 ] += grafts.edge_offsets[ i ];
+    }
+}
+
+/**
+ * @brief Get the queries to graft from a JplaceScan, using the most likely placement
+ * of each pquery, as genesis::placement::labelled_tree() does.
+ *
+ * The names are moved out of the @p scan, and the rest of it is released afterwards, so that
+ * only the compact list of queries is kept while writing the tree. This is why the @p scan is
+ * taken by rvalue.
+ */
+static GraftPlacements graft_placements(
+    JplaceScan&& scan,
+    genesis::placement::PlacementTree const& tree,
+    std::string const& file_path
+) {
+    using namespace genesis::placement;
+
+    auto const edge_num_idx = scan.field_index( "edge_num" );
+    auto const lwr_idx      = scan.field_index( "like_weight_ratio" );
+    auto const distal_idx   = scan.field_index( "distal_length" );
+    auto const proximal_idx = scan.field_index( "proximal_length" );
+    auto const pendant_idx  = scan.field_index( "pendant_length" );
+    if( scan.placement_count() > 0 && edge_num_idx == JplaceScan::npos ) {
+        throw std::runtime_error(
+            "Invalid jplace file " + file_path + ": Field edge_num is missing."
+        );
+    }
+
+    GraftPlacements result;
+    result.queries.reserve( scan.name_count() );
+    auto const edge_map = edge_num_to_index_map( tree );
+    for( size_t pqi = 0; pqi < scan.pquery_count(); ++pqi ) {
+        auto const first = scan.placement_offsets[ pqi ];
+        auto const last  = scan.placement_offsets[ pqi + 1 ];
+        if( first == last ) {
+            continue;
+        }
+
+        // Find the most likely placement. Without weights, all are equal, and we use the first.
+        size_t pi = first;
+        if( lwr_idx != JplaceScan::npos ) {
+            for( size_t i = first + 1; i < last; ++i ) {
+                if( scan.value( i, lwr_idx ) > scan.value( pi, lwr_idx )) {
+                    pi = i;
+                }
+            }
+        }
+
+        auto const edge_num = scan.value( pi, edge_num_idx );
+        auto const edge_index = jplace_edge_index( edge_num, edge_map );
+        if( edge_index == JplaceScan::npos ) {
+            throw std::runtime_error(
+                "Invalid jplace file " + file_path + ": Placement with invalid edge_num " +
+                std::to_string( edge_num ) + "."
+            );
+        }
+
+        GraftQuery query;
+        query.edge_index      = edge_index;
+        query.proximal_length = 0.0;
+        query.pendant_length  = 0.0;
+        if( proximal_idx != JplaceScan::npos ) {
+            query.proximal_length = scan.value( pi, proximal_idx );
+        } else if( distal_idx != JplaceScan::npos ) {
+            auto const& edge_data = tree.edge_at( edge_index ).data<PlacementEdgeData>();
+            query.proximal_length = edge_data.branch_length - scan.value( pi, distal_idx );
+        }
+        if( pendant_idx != JplaceScan::npos ) {
+            query.pendant_length = scan.value( pi, pendant_idx );
+        }
+
+        for( size_t ni = scan.name_offsets[ pqi ]; ni < scan.name_offsets[ pqi + 1 ]; ++ni ) {
+            query.name_offset = scan.name_char_offsets[ ni ];
+            query.name_length = scan.name_char_offsets[ ni + 1 ] - scan.name_char_offsets[ ni ];
+            result.queries.push_back( query );
+        }
+    }
+
+    result.names = std::move( scan.name_chars );
+    scan = JplaceScan();
+    return result;
+}
+
+/**
+ * @brief Get the queries to graft from a Sample, for files that cannot be scanned.
+ */
+static GraftPlacements graft_placements( genesis::placement::Sample const& sample )
+{
+    GraftPlacements result;
+    for( auto const& pquery : sample ) {
+        if( pquery.placement_size() == 0 ) {
+            continue;
+        }
+
+        // Find the most likely placement.
+        auto const* best = &pquery.placement_at( 0 );
+        for( auto const& placement : pquery.placements() ) {
+            if( placement.like_weight_ratio > best->like_weight_ratio ) {
+                best = &placement;
+            }
+        }
+
+        for( auto const& name : pquery.names() ) {
+            GraftQuery query;
+            query.edge_index      = best->edge().index();
+            query.proximal_length = best->proximal_length;
+            query.pendant_length  = best->pendant_length;
+            query.name_offset     = result.names.size();
+            query.name_length     = name.name.size();
+            result.names += name.name;
+            result.queries.push_back( query );
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//      Graft Newick Writer
+// =================================================================================================
+
+/**
+ * @brief Write node labels of the grafted tree the same way as the genesis Newick writer does.
+ *
+ * Labels that only consist of chars that never need quoting are used as they are. For all others,
+ * we write a minimal tree with that label using the genesis writer with the user settings,
+ * and take the label from there, so that quoting and replacing invalid chars stays the same as
+ * for all other Newick trees that we write.
+ */
+class GraftLabelWriter
+{
+public:
+
+    explicit GraftLabelWriter( NewickTreeOutputOptions const& options )
+        : tree_( genesis::tree::CommonTreeNewickReader().read(
+            genesis::utils::from_string( "(label:1);" )
+        ))
+    {
+        writer_.replace_invalid_chars( ! options.quote_invalid_chars() );
+        for( auto& node : tree_.nodes() ) {
+            if( node.data<genesis::tree::CommonNodeData>().name == "label" ) {
+                label_ = &node.data<genesis::tree::CommonNodeData>().name;
+            }
+        }
+        if( ! label_ ) {
+            throw std::runtime_error( "Internal Error: Cannot prepare Newick label writer." );
+        }
+    }
+
+    // We keep a pointer into our own tree, so copies would point to the wrong tree.
+    GraftLabelWriter( GraftLabelWriter const& ) = delete;
+    GraftLabelWriter& operator= ( GraftLabelWriter const& ) = delete;
+
+    /**
+     * @brief Append the label for the node @p name to the @p buffer.
+     */
+    void append( std::string const& name, std::string& buffer )
+    {
+        auto const plain = std::all_of( name.begin(), name.end(), []( char c ){
+            auto const u = static_cast<unsigned char>( c );
+            return std::isalnum( u ) || c == '_' || c == '-' || c == '.' || c == '|';
+        });
+        if( plain ) {
+            buffer += name;
+            return;
+        }
+
+        // The tree is written as "(label:length);", so the label ends at the last colon.
+        *label_ = name;
+        auto const newick = writer_.to_string( tree_ );
+        auto const first = newick.find( '(' );
+        auto const last  = newick.rfind( ':' );
+        if( first == std::string::npos || last == std::string::npos || last <= first ) {
+            throw std::runtime_error( "Internal Error: Cannot write Newick label " + name );
+        }
+        buffer.append( newick, first + 1, last - first - 1 );
+    }
+
+private:
+
+    genesis::tree::CommonTree             tree_;
+    genesis::tree::CommonTreeNewickWriter writer_;
+    std::string*                          label_ = nullptr;
+};
+
+/**
+ * @brief Write the reference @p tree with the @p grafts attached to it in Newick format.
+ *
+ * This produces the same tree as genesis::placement::labelled_tree(), but instead of copying
+ * the reference tree and adding nodes to it, we traverse the tree once, and splice the grafted
+ * queries into the Newick string while writing their edges. The output is buffered and written
+ * to the @p target in chunks, so that large trees do not need to be kept as a string.
+ *
+ * Memory is thus the reference tree plus the @p grafts, which hold a small entry for each name of
+ * each pquery. Jplace files are not ordered by edge, and might even list their fields after the
+ * placements, so we cannot write the first edge before the whole file has been read, and hence
+ * cannot get down to only keeping the queries of one edge at a time.
+ */
+static void write_grafted_tree(
+    GraftOptions const& options,
+    genesis::placement::PlacementTree const& tree,
+    GraftPlacements const& grafts,
+    std::shared_ptr<genesis::utils::BaseOutputTarget> target
+) {
+    using namespace genesis::placement;
+    using namespace genesis::tree;
+
+    auto const precision = options.newick_tree_output.branch_length_precision();
+    size_t const flush_size = 1 << 20;
+    std::string buffer;
+
+    // Node names, with invalid chars either replaced or quoted, as the Newick writer does.
+    GraftLabelWriter label_writer( options.newick_tree_output );
+    auto write_name = [&]( std::string const& name ){
+        label_writer.append( name, buffer );
+    };
+
+    // Reuse the same string for the query names, to avoid allocations.
+    std::string query_name;
+    auto write_query_name = [&]( GraftQuery const& query ){
+        query_name.assign( options.name_prefix );
+        query_name.append( grafts.names, query.name_offset, query.name_length );
+        write_name( query_name );
+    };
+    // Branch lengths are rounded to the precision, without trailing zeros, as the Newick writer does.
+    auto write_length = [&]( double value ){
+        char chars[64];
+        auto const n = std::snprintf( chars, sizeof( chars ), ":%.*f", precision, value );
+        if( n <= 0 || static_cast<size_t>( n ) >= sizeof( chars )) {
+            buffer += ':' + std::to_string( value );
+            return;
+        }
+        auto len = static_cast<size_t>( n );
+        if( std::memchr( chars, '.', len )) {
+            while( chars[ len - 1 ] == '0' ) {
+                --len;
+            }
+            if( chars[ len - 1 ] == '.' ) {
+                --len;
+            }
+        }
+        buffer.append( chars, len );
+    };
+
+    // Before the subtree below an edge, open the parentheses of the nodes that we graft
+    // onto the edge: one per query when resolving them, or one for the base node otherwise.
+    auto open_edge = [&]( size_t edge_index ){
+        auto const count = grafts.edge_offsets[ edge_index + 1 ] - grafts.edge_offsets[ edge_index ];
+        if( count == 0 ) {
+            return;
+        }
+        auto const opens = ( options.fully_resolve || count == 1 ) ? count : 1;
+        buffer.append( opens, '(' );
+    };
+
+    // After the subtree below an edge, write the rest of the edge, including the grafted queries.
+    auto close_edge = [&]( TreeEdge const& edge ){
+        auto const  branch_length = edge.data<PlacementEdgeData>().branch_length;
+        auto const* first = grafts.queries.data() + grafts.edge_offsets[ edge.index() ];
+        auto const* last  = grafts.queries.data() + grafts.edge_offsets[ edge.index() + 1 ];
+        auto const  count = static_cast<size_t>( last - first );
+
+        if( count == 0 ) {
+            write_length( branch_length );
+
+        } else if( options.fully_resolve || count == 1 ) {
+            // Each query splits the edge at its proximal length. We are at the distal end of the
+            // edge, so we go backwards, each time closing the node of the query.
+            for( size_t i = count; i > 0; --i ) {
+                auto const& query = first[ i - 1 ];
+                auto const  next  = ( i == count ) ? branch_length : first[ i ].proximal_length;
+                write_length( next - query.proximal_length );
+                buffer += ',';
+                write_query_name( query );
+                write_length( query.pendant_length );
+                buffer += ')';
+            }
+            write_length( first->proximal_length );
+
+        } else {
+            // The base node sits at the average proximal length, and the queries branch off from
+            // a base edge whose length is the smallest pendant length, which is the first one.
+            double avg_proximal = 0.0;
+            for( auto it = first; it != last; ++it ) {
+                avg_proximal += it->proximal_length;
+            }
+            avg_proximal /= static_cast<double>( count );
+            auto const min_pendant = first->pendant_length;
+
+            write_length( branch_length - avg_proximal );
+            buffer += ",(";
+            for( auto it = first; it != last; ++it ) {
+                if( it != first ) {
+                    buffer += ',';
+                }
+                write_query_name( *it );
+                write_length( it->pendant_length - min_pendant );
+            }
+            buffer += ')';
+            write_length( min_pendant );
+            buffer += ')';
+            write_length( avg_proximal );
+        }
+    };
+
+    // Traverse the tree without recursion, as trees can be deep. Each frame is an inner node,
+    // with the link via which we reached it, and the next of its links to descend into.
+    struct Frame
+    {
+        TreeLink const* up;
+        TreeLink const* next;
+        bool            first;
+    };
+    std::vector<Frame> stack;
+
+    auto const& root_link = tree.root_link();
+    if( &root_link.next() == &root_link ) {
+        // Single node tree. Nothing to graft onto.
+        write_name( root_link.node().data<PlacementNodeData>().name );
+    } else {
+        buffer += '(';
+        stack.push_back({ nullptr, &root_link, true });
+    }
+
+    while( ! stack.empty() ) {
+        auto& frame = stack.back();
+
+        // Are we done with all children of the node? For the root, the children are all its
+        // links, for other nodes, all but the one pointing upwards.
+        auto const end = frame.up ? frame.up : &root_link;
+        if( ! frame.first && frame.next == end ) {
+            buffer += ')';
+            write_name( frame.next->node().data<PlacementNodeData>().name );
+            auto const up = frame.up;
+            stack.pop_back();
+            if( up ) {
+                close_edge( up->edge() );
+            }
+            continue;
+        }
+
+        // Descend into the next child.
+        if( ! frame.first ) {
+            buffer += ',';
+        }
+        frame.first = false;
+        auto const& child_up = frame.next->outer();
+        frame.next = &frame.next->next();
+        open_edge( child_up.edge().index() );
+
+        if( &child_up.next() == &child_up ) {
+            // Leaf node: write it directly.
+            write_name( child_up.node().data<PlacementNodeData>().name );
+            close_edge( child_up.edge() );
+        } else {
+            // Inner node: start with its first child, which is the link after the upwards one.
+            buffer += '(';
+            stack.push_back({ &child_up, &child_up.next(), true });
+        }
+
+        if( buffer.size() >= flush_size ) {
+            (*target) << buffer;
+            buffer.clear();
+        }
+    }
+
+    buffer += ";\n";
+    (*target) << buffer;
+}
+
 // =================================================================================================
 //      Run
 // =================================================================================================
@@ -116,20 +565,25 @@ void run_graft( GraftOptions const& options )
         LOG_MSG2 << "Reading file " << ( ++file_counter ) << " of " << options.jplace_input.file_count()
                  << ": " << options.jplace_input.file_path( i );
 
-        // Read the sample and make the tree.
-        auto const sample = options.jplace_input.sample( i );
-        auto const tog    = labelled_tree( sample, options.fully_resolve, options.name_prefix );
-
-        // Write output to file.
-        options.newick_tree_output.write_tree(
-            tog, options.file_output.get_output_target(
-                out_tree_files[i].first, out_tree_files[i].second
-            )
+        // Scan the file, using the shared reference tree. We do not build a Sample, or a copy of
+        // the tree with the queries; instead, the queries are directly written while writing
+        // the tree. Old jplace files need the genesis reader, so for them, we use the Sample.
+        std::shared_ptr<PlacementTree const> tree;
+        auto scan = options.jplace_input.scan( i, tree );
+        auto const target = options.file_output.get_output_target(
+            out_tree_files[i].first, out_tree_files[i].second
         );
-        // tree::CommonTreeNewickWriter().write(
-        //     tog, options.file_output.get_output_target(
-        //         out_tree_files[i].first, out_tree_files[i].second
-        //     )
-        // );
+        if( tree ) {
+            auto grafts = graft_placements(
+                std::move( scan ), *tree, options.jplace_input.file_path( i )
+            );
+            sort_graft_placements( grafts, tree->edge_count(), options.fully_resolve );
+            write_grafted_tree( options, *tree, grafts, target );
+        } else {
+            auto const sample = options.jplace_input.sample( i );
+            auto grafts = graft_placements( sample );
+            sort_graft_placements( grafts, sample.tree().edge_count(), options.fully_resolve );
+            write_grafted_tree( options, sample.tree(), grafts, target );
+        }
     }
 }
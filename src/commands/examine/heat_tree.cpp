@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -35,8 +36,13 @@
 #include "genesis/placement/function/tree.hpp"
 #include "genesis/tree/common_tree/newick_writer.hpp"
 #include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/options.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <numeric>
 #include <stdexcept>
 
 #ifdef GENESIS_OPENMP
@@ -72,6 +78,15 @@ void setup_heat_tree( CLI::App& app )
     options->color_norm.add_max_value_opt_to_app( sub );
     options->color_norm.add_mask_value_opt_to_app( sub );
 
+    // Per sample mode.
+    sub->add_flag(
+        "--per-sample",
+        options->per_sample,
+        "If set, instead of one tree with the accumulated masses of all samples, one tree per sample "
+        "is written, named after the sample. Each tree uses its own color scale, unless "
+        "--min-value and --max-value are provided."
+    )->group( "Settings" );
+
     // Output files.
     options->file_output.add_default_output_opts_to_app( sub );
     options->tree_output.add_tree_output_opts_to_app( sub );
@@ -87,6 +102,166 @@ void setup_heat_tree( CLI::App& app )
     ));
 }
 
+// =================================================================================================
+//      Helper Functions
+// =================================================================================================
+
+/**
+ * @brief Set up the color norm for the given masses, and return the resulting branch colors.
+ *
+ * If @p report is set, a warning is issued for masses that cannot be shown with log scaling.
+ */
+static std::vector<genesis::utils::Color> heat_tree_colors(
+    HeatTreeOptions const& options,
+    genesis::utils::ColorMap const& color_map,
+    genesis::utils::ColorNormalizationLinear& color_norm,
+    std::vector<double> masses,
+    bool report
+) {
+    // First, autoscale to get the max.
+    // Finally, apply the user settings that might have been provided.
+    color_norm.autoscale( masses );
+    auto const auto_min = color_norm.min_value();
+    if( options.color_norm.log_scaling() ) {
+
+        // Some user friendly safety. Min of 0 does not work with log scaling.
+        // Instead, if we have a max > 1, we set min to 1, which is a good case for absolute abundances.
+        // For relative abundances (normalized samples), the max is < 1, so we set the min to some
+        // value below that that spans some orders of magnitude. This is all used as default anyway,
+        // as users can overwrite this via --min-value.
+        if( color_norm.min_value() <= 0.0 ) {
+            if( color_norm.max_value() > 1.0 ) {
+                color_norm.min_value( 1.0 );
+            } else {
+                color_norm.min_value( color_norm.max_value() / 10e4 );
+            }
+            // color_map.clip_under( true );
+        }
+
+    } else {
+        color_norm.min_value( 0.0 );
+    }
+
+    // Now overwrite the above "default" settings with what the user specified
+    // (in case that they actually did specify certain values).
+    options.color_norm.apply_options( color_norm );
+
+    // Issue a warning if we needed to set the min due to log, but there was no manual overwrite,
+    // and if this leads to having under values.
+    if( options.color_norm.log_scaling() && auto_min <= 0.0 ) {
+        if( ! *options.color_norm.min_value_option && ! *options.color_map.clip_under_option ) {
+            if( report ) {
+                LOG_WARN << "Warning: Some branches have mass 0, which cannot be shown using --log-scaling. "
+                         << "Hence, the minimum was set to " << color_norm.min_value() << " instead.\n"
+                         << "This will lead to those branches being shown in the color specified by "
+                         << "--mask-color. Use --clip-under and --min-value to change this.";
+            }
+        } else {
+
+            // The log color norm yields -inf for 0 values.
+            // But if we have clip under or a min value, this is not what we want.
+            // So, set 0 values to something that is not invalid.
+            for( auto& v : masses ) {
+                if( v <= 0.0 ) {
+                    v = color_norm.min_value() / 2.0;
+                }
+            }
+        }
+    }
+
+    return color_map( color_norm, masses );
+}
+
+/**
+ * @brief Write one heat tree per sample, see the --per-sample option.
+ */
+static void run_heat_tree_per_sample( HeatTreeOptions const& options )
+{
+    using namespace genesis;
+    using namespace genesis::placement;
+
+    // Read the first file to get the reference tree, and compute its layout once.
+    // All trees are then written using that layout, with only the colors differing.
+    auto const file_total = options.jplace_input.file_count();
+    std::shared_ptr<PlacementTree const> first_tree;
+    auto first_masses = options.jplace_input.edge_masses( 0, first_tree );
+    auto const layout = options.tree_output.prepare_layout( *first_tree );
+    auto const color_map = options.color_map.color_map();
+    std::atomic<size_t> file_count{ 0 };
+
+    // If the user fixed the color scale, all trees share it, so we print its legend only once.
+    // Otherwise, each tree has its own scale, and we print the legend of each of them.
+    auto const shared_scale = static_cast<bool>( *options.color_norm.min_value_option ) &&
+                              static_cast<bool>( *options.color_norm.max_value_option );
+    if( shared_scale ) {
+        auto color_norm = options.color_norm.get_sequential_norm();
+        options.color_norm.apply_options( *color_norm );
+        options.tree_output.print_color_legend( color_map, *color_norm );
+    }
+
+    // Each sample gets its own color norm, so that all trees can be written in parallel.
+    // Exceptions cannot leave the parallel region, so we keep the first one for later.
+    std::exception_ptr error;
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t fi = 0; fi < file_total; ++fi ) {
+        try {
+
+            // User output
+            LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << file_total
+                     << ": " << options.jplace_input.file_path( fi );
+
+            // Get the masses, and check the tree.
+            std::vector<double> masses;
+            if( fi == 0 ) {
+                masses = std::move( first_masses );
+            } else {
+                std::shared_ptr<PlacementTree const> sample_tree;
+                masses = options.jplace_input.edge_masses( fi, sample_tree );
+                if(
+                    sample_tree != first_tree &&
+                    ! genesis::placement::compatible_trees( *first_tree, *sample_tree )
+                ) {
+                    throw std::runtime_error(
+                        "Input jplace files have differing reference trees."
+                    );
+                }
+            }
+
+            // Make the colors and write the tree.
+            auto color_norm = options.color_norm.get_sequential_norm();
+            auto const colors = heat_tree_colors(
+                options, color_map, *color_norm, std::move( masses ), false
+            );
+            options.tree_output.write_tree_to_files(
+                layout,
+                colors,
+                color_map,
+                *color_norm,
+                options.file_output,
+                options.jplace_input.base_file_name( fi ),
+                false
+            );
+
+            // Print the legend of the sample, if it has its own scale.
+            if( ! shared_scale ) {
+                options.tree_output.print_color_legend(
+                    color_map, *color_norm, "sample " + options.jplace_input.base_file_name( fi )
+                );
+            }
+        } catch( ... ) {
+            #pragma omp critical(GAPPA_HEAT_TREE_ERROR)
+            {
+                if( ! error ) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+    if( error ) {
+        std::rethrow_exception( error );
+    }
+}
+
 // =================================================================================================
 //      Run
 // =================================================================================================
@@ -98,9 +273,28 @@ void run_heat_tree( HeatTreeOptions const& options )
     using namespace genesis::tree;
 
     // Prepare output file names and check if any of them already exists. If so, fail early.
+    // In per-sample mode, the files are named after the samples. They hence need unique names,
+    // as otherwise, several samples would be written to the same files at the same time.
+    if( options.per_sample ) {
+        auto fns = options.jplace_input.base_file_names();
+        std::sort( fns.begin(), fns.end() );
+        if( std::adjacent_find( fns.begin(), fns.end() ) != fns.end() ) {
+            throw std::runtime_error(
+                "The file names of the input jplace files (without the extension .jplace[.gz]) "
+                "are not unique and can thus not be used as names for the per-sample output "
+                "files. Make sure that you use unique sample names."
+            );
+        }
+    }
     std::vector<std::pair<std::string, std::string>> files_to_check;
     for( auto const& e : options.tree_output.get_extensions() ) {
-        files_to_check.push_back({ "tree", e });
+        if( options.per_sample ) {
+            for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
+                files_to_check.push_back({ options.jplace_input.base_file_name( fi ), e });
+            }
+        } else {
+            files_to_check.push_back({ "tree", e });
+        }
     }
     options.file_output.check_output_files_nonexistence( files_to_check );
 
@@ -110,48 +304,91 @@ void run_heat_tree( HeatTreeOptions const& options )
     // User output.
     options.jplace_input.print();
 
-    // Prepare results.
-    Tree tree;
-    std::vector<double> total_masses;
-    size_t file_count = 0;
+    // Per-sample mode has its own loop.
+    if( options.per_sample ) {
+        run_heat_tree_per_sample( options );
+        return;
+    }
+
+    // Prepare results. We accumulate the masses in chunks of files, each with its own mass vector,
+    // so that no locking is needed. The chunks are combined afterwards.
+    auto const file_total = options.jplace_input.file_count();
+    auto const num_chunks = parallel_chunk_count( file_total );
+    auto chunk_masses = std::vector<std::vector<double>>( num_chunks );
+    auto chunk_trees  = std::vector<std::shared_ptr<PlacementTree const>>( num_chunks );
+    std::atomic<size_t> file_count{ 0 };
 
     // Read all jplace files and accumulate their masses.
-    #pragma omp parallel for schedule(dynamic)
-    for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
-
-        // User output
-        LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << options.jplace_input.file_count()
-                 << ": " << options.jplace_input.file_path( fi );
-
-        // Read in file. This also already applies all normalizations.
-        auto const sample = options.jplace_input.sample( fi );
-
-        // Get masses per edge.
-        auto const masses = placement_mass_per_edges_with_multiplicities( sample );
-
-        // The main accumulation is single threaded.
-        // We could optimize more, but seriously, it is fast enough already.
-        #pragma omp critical(GAPPA_VISUALIZE_ACCUMULATE)
-        {
-            // Tree
-            if( tree.empty() ) {
-                tree = sample.tree();
-            } else if( ! genesis::placement::compatible_trees( tree, sample.tree() ) ) {
+    parallel_for_chunks( file_total, num_chunks, [&]( size_t ci, size_t first, size_t last ){
+        auto& masses = chunk_masses[ci];
+        auto& tree   = chunk_trees[ci];
+
+        for( size_t fi = first; fi < last; ++fi ) {
+
+            // User output
+            LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << file_total
+                     << ": " << options.jplace_input.file_path( fi );
+
+            // Get masses per edge, without building a sample.
+            // This also already applies all normalizations.
+            std::shared_ptr<PlacementTree const> sample_tree;
+            auto const sample_masses = options.jplace_input.edge_masses( fi, sample_tree );
+
+            // Tree. Files with the same reference tree share it, so that we only need to check
+            // for compatibility if they differ.
+            if( ! tree ) {
+                tree = sample_tree;
+            } else if(
+                sample_tree != tree &&
+                ! genesis::placement::compatible_trees( *tree, *sample_tree )
+            ) {
                 throw std::runtime_error( "Input jplace files have differing reference trees." );
             }
 
             // Masses
-            if( total_masses.empty() ) {
-                total_masses = masses;
-            } else if( total_masses.size() != masses.size() ) {
+            if( masses.empty() ) {
+                masses = sample_masses;
+            } else if( masses.size() != sample_masses.size() ) {
                 throw std::runtime_error( "Input jplace files have differing reference trees." );
             } else {
+                #pragma omp simd
                 for( size_t i = 0; i < masses.size(); ++i ) {
-                    total_masses[i] += masses[i];
+                    masses[i] += sample_masses[i];
                 }
             }
         }
+    });
+
+    // Check that the chunks used the same tree. This is usually just a pointer comparison.
+    if( ! chunk_trees[0] ) {
+        throw std::runtime_error( "No input jplace files." );
+    }
+    for( size_t ci = 1; ci < num_chunks; ++ci ) {
+        if(
+            chunk_trees[ci] != chunk_trees[0] && (
+                ! chunk_trees[ci] ||
+                ! genesis::placement::compatible_trees( *chunk_trees[0], *chunk_trees[ci] ) ||
+                chunk_masses[ci].size() != chunk_masses[0].size()
+            )
+        ) {
+            throw std::runtime_error( "Input jplace files have differing reference trees." );
+        }
+    }
+
+    // Combine the chunks pairwise, which needs log(chunks) rounds that each run in parallel.
+    for( size_t stride = 1; stride < num_chunks; stride *= 2 ) {
+        #pragma omp parallel for schedule(static)
+        for( size_t ci = 0; ci < num_chunks - stride; ci += 2 * stride ) {
+            auto& target = chunk_masses[ ci ];
+            auto const& source = chunk_masses[ ci + stride ];
+            #pragma omp simd
+            for( size_t i = 0; i < target.size(); ++i ) {
+                target[i] += source[i];
+            }
+        }
     }
+    auto const& tree = *chunk_trees[0];
+    auto total_masses = std::move( chunk_masses[0] );
 
     // If we use relative masses, we normalize the whole mass set once more, so that the sum is 1.
     if( options.jplace_input.mass_norm_relative() ) {
@@ -161,61 +398,12 @@ void run_heat_tree( HeatTreeOptions const& options )
         }
     }
 
-    // Get color map and norm.
-    auto color_map  = options.color_map.color_map();
+    // Get color map and norm, and make a color vector.
+    auto const color_map = options.color_map.color_map();
     auto color_norm = options.color_norm.get_sequential_norm();
+    auto const colors = heat_tree_colors( options, color_map, *color_norm, total_masses, true );
 
-    // First, autoscale to get the max.
-    // Finally, apply the user settings that might have been provided.
-    color_norm->autoscale( total_masses );
-    auto const auto_min = color_norm->min_value();
-    if( options.color_norm.log_scaling() ) {
-
-        // Some user friendly safety. Min of 0 does not work with log scaling.
-        // Instead, if we have a max > 1, we set min to 1, which is a good case for absolute abundances.
-        // For relative abundances (normalized samples), the max is < 1, so we set the min to some
-        // value below that that spans some orders of magnitude. This is all used as default anyway,
-        // as users can overwrite this via --min-value.
-        if( color_norm->min_value() <= 0.0 ) {
-            if( color_norm->max_value() > 1.0 ) {
-                color_norm->min_value( 1.0 );
-            } else {
-                color_norm->min_value( color_norm->max_value() / 10e4 );
-            }
-            // color_map.clip_under( true );
-        }
-
-    } else {
-        color_norm->min_value( 0.0 );
-    }
-
-    // Now overwrite the above "default" settings with what the user specified
-    // (in case that they actually did specify certain values).
-    options.color_norm.apply_options( *color_norm );
-
-    // Issue a warning if we needed to set the min due to log, but there was no manual overwrite,
-    // and if this leads to having under values.
-    if( options.color_norm.log_scaling() && auto_min <= 0.0 ) {
-        if( ! *options.color_norm.min_value_option && ! *options.color_map.clip_under_option ) {
-            LOG_WARN << "Warning: Some branches have mass 0, which cannot be shown using --log-scaling. "
-                     << "Hence, the minimum was set to " << color_norm->min_value() << " instead.\n"
-                     << "This will lead to those branches being shown in the color specified by "
-                     << "--mask-color. Use --clip-under and --min-value to change this.";
-        } else {
-
-            // The log color norm yields -inf for 0 values.
-            // But if we have clip under or a min value, this is not what we want.
-            // So, set 0 values to something that is not invalid.
-            for( auto& v : total_masses ) {
-                if( v <= 0.0 ) {
-                    v = color_norm->min_value() / 2.0;
-                }
-            }
-        }
-    }
-
-    // Now, make a color vector and write to files.
-    auto const colors = color_map( *color_norm, total_masses );
+    // Write to files.
     options.tree_output.write_tree_to_files(
         tree,
         colors,
@@ -49,6 +49,8 @@ public:
     JplaceInputOptions jplace_input;
     FileOutputOptions  file_output;
     TreeOutputOptions  tree_output;
+
+    bool per_sample = false;
 };
 
 // =================================================================================================
@@ -25,13 +25,16 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_scanner.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/tree/function/functions.hpp"
+#include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/io/input_source.hpp"
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <ios>
 #include <iomanip>
 
@@ -55,6 +58,15 @@ void setup_info( CLI::App& app )
     // File input
     opt->jplace_input.add_jplace_input_opt_to_app( sub );
 
+    // Statistics
+    sub->add_flag(
+        "--statistics",
+        opt->statistics,
+        "Print additional statistics for each sample: the number of placements, "
+        "the total multiplicity of the pqueries, the average number of placements per pquery, "
+        "the file size, and the reading throughput."
+    )->group( "Settings" );
+
     // Set the run function as callback to be called when this subcommand is issued.
     // Hand over the options by copy, so that their shared ptr stays alive in the lambda.
     sub->callback( gappa_cli_callback(
@@ -87,8 +99,17 @@ void run_info( InfoOptions const& options )
         size_t      branches;
         size_t      leaves;
         size_t      pqueries;
+        size_t      placements;
+        double      multiplicity;
+        size_t      file_size;
+        double      seconds;
     };
 
+    // We only need counts, so we do not build the samples, and do not even keep the placements.
+    // The tree is not parsed either, we only count its edges and leaves in the newick string.
+    auto scanner = JplaceScanner();
+    scanner.store_placements( false );
+
     // Prepare result. The vector is indexed by samples.
     auto sample_infos = std::vector<SampleInfo>( options.jplace_input.file_count() );
     size_t name_width = 0;
@@ -102,26 +123,65 @@ void run_info( InfoOptions const& options )
         LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << options.jplace_input.file_count()
                  << ": " << options.jplace_input.file_path( fi );
 
-        // Read in file.
-        auto sample = options.jplace_input.sample( fi );
+        // Scan the file.
+        auto const start = std::chrono::steady_clock::now();
+        auto const scan = scanner.scan( from_file( options.jplace_input.file_path( fi )));
+        auto const tree_counts = newick_counts( scan.tree );
+        auto const duration = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start
+        );
 
         // Store result.
         assert( fi < sample_infos.size() );
         sample_infos[fi].name = options.jplace_input.base_file_name( fi );
-        sample_infos[fi].branches = sample.tree().edge_count();
-        sample_infos[fi].leaves = genesis::tree::leaf_node_count( sample.tree() );
-        sample_infos[fi].pqueries = sample.size();
+        sample_infos[fi].branches = tree_counts.edges;
+        sample_infos[fi].leaves = tree_counts.leaves;
+        sample_infos[fi].pqueries = scan.pquery_count();
+        sample_infos[fi].placements = scan.placement_count();
+        sample_infos[fi].multiplicity = scan.multiplicity_sum;
+        sample_infos[fi].file_size = options.statistics
+            ? file_size( options.jplace_input.file_path( fi ))
+            : 0
+        ;
+        sample_infos[fi].seconds = duration.count();
 
         name_width = std::max( name_width, sample_infos[fi].name.size() );
     }
 
     LOG_BOLD;
+    if( ! options.statistics ) {
+        LOG_MSG1 << std::left << std::setw( name_width + 1 ) << "Sample"
+                 << "    Branches      Leaves    Pqueries";
+        for( auto const& info : sample_infos ) {
+            LOG_MSG1 << std::left << std::setw( name_width + 1 ) << info.name
+                     << std::right << std::setw( 12 ) << info.branches
+                     << std::right << std::setw( 12 ) << info.leaves
+                     << std::right << std::setw( 12 ) << info.pqueries;
+        }
+        return;
+    }
+
+    // Print the table with statistics. Throughput is in MB/s of the (possibly compressed) file.
     LOG_MSG1 << std::left << std::setw( name_width + 1 ) << "Sample"
-             << "    Branches      Leaves    Pqueries";
+             << "    Branches      Leaves    Pqueries  Placements  Multiplicity"
+             << "  Plcm/Pquery     Size (MB)    MB/s";
     for( auto const& info : sample_infos ) {
+        auto const mb = static_cast<double>( info.file_size ) / ( 1024.0 * 1024.0 );
+        auto const per_pquery = info.pqueries > 0
+            ? static_cast<double>( info.placements ) / static_cast<double>( info.pqueries )
+            : 0.0
+        ;
+        auto const throughput = info.seconds > 0.0 ? mb / info.seconds : 0.0;
+
         LOG_MSG1 << std::left << std::setw( name_width + 1 ) << info.name
                  << std::right << std::setw( 12 ) << info.branches
                  << std::right << std::setw( 12 ) << info.leaves
-                 << std::right << std::setw( 12 ) << info.pqueries;
+                 << std::right << std::setw( 12 ) << info.pqueries
+                 << std::right << std::setw( 12 ) << info.placements
+                 << std::right << std::setw( 14 ) << info.multiplicity
+                 << std::fixed << std::setprecision( 2 )
+                 << std::right << std::setw( 13 ) << per_pquery
+                 << std::right << std::setw( 14 ) << mb
+                 << std::right << std::setw( 8 ) << throughput;
     }
 }
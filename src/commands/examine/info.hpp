@@ -40,6 +40,7 @@ class InfoOptions
 public:
 
     JplaceInputOptions jplace_input;
+    bool statistics = false;
 };
 
 // =================================================================================================
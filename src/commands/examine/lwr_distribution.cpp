@@ -1,6 +1,6 @@
 /*
     gappa - Genesis Applications for Phylogenetic Placement Analysis
-    Copyright (C) 2017-2021 Lucas Czech
+    Copyright (C) 2017-2024 Lucas Czech
 
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -32,13 +33,20 @@
 #include "genesis/placement/function/masses.hpp"
 #include "genesis/placement/function/operators.hpp"
 
+#include "genesis/utils/core/options.hpp"
 #include "genesis/utils/io/output_stream.hpp"
 #include "genesis/utils/math/histogram.hpp"
 #include "genesis/utils/math/histogram/stats.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
 #include <utility>
 #include <vector>
 
@@ -98,6 +106,33 @@ void setup_lwr_distribution( CLI::App& app )
         "likely LWR, and so forth."
     )->group( "Settings" );
 
+    // Subsampling, to keep the memory bounded for large inputs.
+    auto subsample_size_opt = sub->add_option(
+        "--subsample-size",
+        opt->subsample_size,
+        "If set to a value greater than 0, only a uniform random subsample of this many pqueries "
+        "is kept in memory and used for the output table, instead of all pqueries. "
+        "This bounds the memory needed for large inputs, at the cost of the sorting order "
+        "(and hence the Index column) of the table being an approximation.",
+        true
+    )->group( "Settings" );
+    sub->add_flag(
+        "--stratified-subsample",
+        opt->stratified_subsample,
+        "If set, the subsample is stratified by sample, that is, each input file gets an equal "
+        "share of the subsample size, so that small samples are represented as well as large ones. "
+        "With more input files than the subsample size, only some of the files get a share."
+    )->group( "Settings" )
+    ->needs( subsample_size_opt );
+    sub->add_option(
+        "--subsample-seed",
+        opt->subsample_seed,
+        "Seed for the random subsample. If set to 0 (default), a random seed is used, "
+        "which is printed, so that the run can be reproduced.",
+        true
+    )->group( "Settings" )
+    ->needs( subsample_size_opt );
+
     // // Offer to ignore the check for tree compatibility
     // sub->add_flag(
     //     "--no-compatibility-check",
@@ -120,6 +155,69 @@ void setup_lwr_distribution( CLI::App& app )
     ));
 }
 
+// =================================================================================================
+//      Helper Functions
+// =================================================================================================
+
+/**
+ * @brief Entry of the collection of pqueries, with their LWRs.
+ */
+struct LwrEntry
+{
+    // Index of the sample, so that we can print its name.
+    size_t              sample_index;
+    std::string         pquery_name;
+
+    // Store the weighted sum sort value. Only used for sorting if numerical_sort is false.
+    double              sort_value;
+
+    // The actual list of LWRs of this pquery, containing the n most likely LWRs and the
+    // accumulated remainder of all LWRs above n as an additional last entry.
+    std::vector<double> lwrs;
+
+    // Random key for subsampling. We keep the entries with the smallest keys.
+    uint64_t            key;
+};
+
+/**
+ * @brief Hash function to get the random keys for subsampling (SplitMix64).
+ *
+ * We compute the key of each pquery from the seed, its sample, and its position in the sample,
+ * so that the subsample does not depend on the order in which threads process the files.
+ */
+static uint64_t lwr_subsample_key( uint64_t seed, uint64_t sample_index, uint64_t entry_index )
+{
+    auto mix = []( uint64_t x ){
+        x += 0x9E3779B97F4A7C15ULL;
+        x = ( x ^ ( x >> 30 )) * 0xBF58476D1CE4E5B9ULL;
+        x = ( x ^ ( x >> 27 )) * 0x94D049BB133111EBULL;
+        return x ^ ( x >> 31 );
+    };
+    return mix( mix( mix( seed ) ^ sample_index ) ^ entry_index );
+}
+
+/**
+ * @brief Add an entry to a collection, which, if @p capacity is not 0, is kept as a max heap
+ * of the entries with the smallest keys, that is, a uniform random subsample of that size.
+ */
+static void add_lwr_entry( std::vector<LwrEntry>& collection, LwrEntry&& entry, size_t capacity )
+{
+    auto const key_less = []( LwrEntry const& lhs, LwrEntry const& rhs ){
+        return lhs.key < rhs.key;
+    };
+
+    if( capacity == 0 ) {
+        collection.push_back( std::move( entry ));
+    } else if( collection.size() < capacity ) {
+        collection.push_back( std::move( entry ));
+        std::push_heap( collection.begin(), collection.end(), key_less );
+    } else if( entry.key < collection.front().key ) {
+        std::pop_heap( collection.begin(), collection.end(), key_less );
+        collection.back() = std::move( entry );
+        std::push_heap( collection.begin(), collection.end(), key_less );
+    }
+}
+
 // =================================================================================================
 //      Run
 // =================================================================================================
@@ -137,112 +235,198 @@ void run_lwr_distribution( LwrDistributionOptions const& options )
     // Print some user output.
     options.jplace_input.print();
 
-    // Prepare intermediate data.
-    Tree tree;
-    size_t file_count = 0;
-
-    // Prepare collection of all LWRs, for each pquery.
-    struct LwrEntry
-    {
-        // We only store the index to the name,
-        // in order to not have repeated string allocations all over the place.
-        size_t              sample_index;
-        std::string         pquery_name;
-
-        // Store the weighted sum sort value. Only used for sorting if numerical_sort is false.
-        double              sort_value;
-
-        // The actual list of LWRs of this pquery, containing the n most likely LWRs and the
-        // accumulated remainder of all LWRs above n as an additional last entry.
-        std::vector<double> lwrs;
+    // Subsampling settings. We either keep a subsample of the whole input, or, if stratified,
+    // of each sample individually, with an equal share of the size. If the size is not divisible
+    // by the number of files, the remainder is spread evenly over the files, so that the shares
+    // sum up to the size. With more files than the size, some files hence do not get a share.
+    auto const file_total = options.jplace_input.file_count();
+    auto const subsample = options.subsample_size > 0;
+    auto const stratified = subsample && options.stratified_subsample;
+    auto const sample_capacity = [&]( size_t fi ){
+        return parallel_chunk_begin( fi + 1, file_total, options.subsample_size ) -
+               parallel_chunk_begin( fi,     file_total, options.subsample_size );
     };
-    auto collection = std::vector<LwrEntry>();
+    auto const chunk_capacity
+        = ( subsample && ! stratified )
+        ? options.subsample_size
+        : 0
+    ;
+    uint64_t seed = options.subsample_seed;
+    if( subsample && seed == 0 ) {
+        seed = std::random_device{}();
+    }
+    if( subsample ) {
+        LOG_MSG1 << "Using seed " << seed << " for the subsample.";
+    }
+
+    // Prepare intermediate data. We collect the pqueries in chunks of files, each with its own
+    // collection, so that no locking is needed. Besides the (subsampled) collection, we also keep
+    // the sums of the LWRs of all pqueries, so that their means are exact, even when subsampling.
+    auto const num_chunks = parallel_chunk_count( file_total );
+    auto chunk_collections = std::vector<std::vector<LwrEntry>>( num_chunks );
+    auto chunk_lwr_sums    = std::vector<std::vector<double>>(
+        num_chunks, std::vector<double>( options.num_lwrs + 1, 0.0 )
+    );
+    auto chunk_counts      = std::vector<size_t>( num_chunks, 0 );
+    Tree tree;
+    std::shared_ptr<PlacementTree const> tree_ptr;
+    std::atomic<size_t> file_count{ 0 };
 
     // Read all jplace files.
-    #pragma omp parallel for schedule(dynamic)
-    for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
-
-        // User output
-        ++file_count;
-        LOG_MSG2 << "Processing file " << ( file_count ) << " of "
-                 << options.jplace_input.file_count()
-                 << ": " << options.jplace_input.file_path( fi );
-
-        // Read in file.
-        auto sample = options.jplace_input.sample( fi );
-        sort_placements_by_weight( sample );
-
-        // Check whether the tree is the same. This is totally not needed for the calculation,
-        // but the case where we want different trees to be summarized sounds more like and error.
-        if( ! options.no_compat_check ) {
-            #pragma omp critical(GAPPA_LWR_DIST_TREE)
-            {
-                // Tree
-                if( tree.empty() ) {
-                    tree = sample.tree();
-                } else if( ! genesis::placement::compatible_trees( tree, sample.tree() ) ) {
+    parallel_for_chunks( file_total, num_chunks, [&]( size_t ci, size_t first, size_t last ){
+        auto& chunk_collection = chunk_collections[ci];
+        auto& lwr_sums = chunk_lwr_sums[ci];
+
+        for( size_t fi = first; fi < last; ++fi ) {
+
+            // User output
+            LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << file_total
+                     << ": " << options.jplace_input.file_path( fi );
+
+            // Read in file.
+            std::shared_ptr<PlacementTree const> sample_tree;
+            auto sample = options.jplace_input.sample( fi, sample_tree );
+            sort_placements_by_weight( sample );
+
+            // Check whether the tree is the same. This is totally not needed for the calculation,
+            // but the case where we want different trees to be summarized sounds more like and error.
+            // Exceptions cannot leave the critical section, so we only throw after it.
+            if( ! options.no_compat_check ) {
+                bool compatible = true;
+                #pragma omp critical(GAPPA_LWR_DIST_TREE)
+                {
+                    // Tree
+                    if( tree.empty() ) {
+                        tree = sample.tree();
+                        tree_ptr = sample_tree;
+                    } else if( sample_tree != tree_ptr ) {
+                        compatible = genesis::placement::compatible_trees( tree, sample.tree() );
+                    }
+                }
+                if( ! compatible ) {
                     throw std::runtime_error(
                         "Input jplace files have differing reference trees. "
                         // "(Disable this check using --no-compat-check)"
                     );
                 }
             }
-        }
 
-        // Reserve space for the sample. In the standard case of having one input file,
-        // this saves time for repeated reallocations. For multiple files, this still should
-        // yield some speedup. We use the current capacity as a proxy for the current size
-        // (we cannot use actual size, due to the parallel loop). This might cause the vector
-        // to overshoot the needed size, but we can live with that.
-        auto const needed_extra_cap = total_name_count( sample );
-        #pragma omp critical(GAPPA_LWR_DIST_COLLECTION)
-        {
-            collection.reserve( collection.capacity() + needed_extra_cap );
-        }
-
-        // The main accumulation is single threaded.
-        // We could optimize more, but seriously, it is fast enough already.
-        for( auto& pquery : sample ) {
-
-            // Prepare the vector with all top n LWRs, and the remainder.
-            // Also, compute the sort value for our default sort order.
-            auto lwrs = std::vector<double>( options.num_lwrs + 1, 0.0 );
-            double sort_value = 0.0;
-            auto const max_n = std::min( options.num_lwrs, pquery.placement_size() );
-            for( size_t n = 0; n < max_n; ++n ) {
-                auto const lwr = pquery.placement_at( n ).like_weight_ratio;
-                lwrs[n] = lwr;
-                sort_value += lwr / static_cast<double>( n + 1 );
-            }
-            for( size_t n = max_n; n < pquery.placement_size(); ++n ) {
-                auto const lwr = pquery.placement_at( n ).like_weight_ratio;
-                lwrs.back() += lwr;
-                sort_value += lwr / static_cast<double>( n + 1 );
+            // When stratifying, we collect the subsample of the file first, and add it to the
+            // chunk afterwards. Otherwise, we directly add to the chunk. A capacity of 0 means
+            // that all entries are kept, except for files without a share of a stratified
+            // subsample, which do not keep any entries.
+            auto sample_collection = std::vector<LwrEntry>();
+            auto& collection = stratified ? sample_collection : chunk_collection;
+            auto const capacity = stratified ? sample_capacity( fi ) : chunk_capacity;
+            auto const skip_entries = stratified && capacity == 0;
+            if( ! subsample ) {
+                collection.reserve( collection.size() + total_name_count( sample ));
             }
 
-            // Now add the LWRs to the collection.
-            #pragma omp critical(GAPPA_LWR_DIST_COLLECTION)
-            {
+            size_t entry_index = 0;
+            for( auto& pquery : sample ) {
+
+                // Prepare the vector with all top n LWRs, and the remainder.
+                // Also, compute the sort value for our default sort order.
+                auto lwrs = std::vector<double>( options.num_lwrs + 1, 0.0 );
+                double sort_value = 0.0;
+                auto const max_n = std::min( options.num_lwrs, pquery.placement_size() );
+                for( size_t n = 0; n < max_n; ++n ) {
+                    auto const lwr = pquery.placement_at( n ).like_weight_ratio;
+                    lwrs[n] = lwr;
+                    sort_value += lwr / static_cast<double>( n + 1 );
+                }
+                for( size_t n = max_n; n < pquery.placement_size(); ++n ) {
+                    auto const lwr = pquery.placement_at( n ).like_weight_ratio;
+                    lwrs.back() += lwr;
+                    sort_value += lwr / static_cast<double>( n + 1 );
+                }
+
                 // Add the values as often as the pquery has names,
                 // as each of them represents a different pquery.
-                LwrEntry entry;
-                entry.sample_index = fi;
-                entry.sort_value = sort_value;
-                entry.lwrs = std::move(lwrs);
                 for( auto const& name : pquery.names() ) {
-                    entry.pquery_name = name.name;
-                    collection.emplace_back( entry );
+                    for( size_t n = 0; n < lwrs.size(); ++n ) {
+                        lwr_sums[n] += lwrs[n];
+                    }
+                    ++chunk_counts[ci];
+
+                    // If the subsample is full and the entry would not make it in,
+                    // we can skip it without copying its data.
+                    LwrEntry entry;
+                    entry.key = subsample ? lwr_subsample_key( seed, fi, entry_index ) : 0;
+                    ++entry_index;
+                    if( skip_entries || (
+                        capacity > 0 && collection.size() == capacity &&
+                        entry.key >= collection.front().key
+                    )) {
+                        continue;
+                    }
+                    entry.sample_index = fi;
+                    entry.pquery_name  = name.name;
+                    entry.sort_value   = sort_value;
+                    entry.lwrs         = lwrs;
+                    add_lwr_entry( collection, std::move( entry ), capacity );
                 }
+
+                // We are done with this pquery, and will never need it again.
+                // Let's free its memory, because we just did more or less a full copy of its memory
+                // footprint, so let's save that!
+                pquery.clear_placements();
+                pquery.clear_names();
             }
 
-            // We are done with this pquery, and will never need it again.
-            // Let's free its memory, because we just did more or less a full copy of its memory
-            // footprint, so let's save that!
-            pquery.clear_placements();
-            pquery.clear_names();
+            // Move the stratified subsample of the file to the chunk.
+            if( stratified ) {
+                chunk_collection.insert(
+                    chunk_collection.end(),
+                    std::make_move_iterator( sample_collection.begin() ),
+                    std::make_move_iterator( sample_collection.end() )
+                );
+            }
+        }
+    });
+
+    // Combine the chunks. For the non-stratified subsample, each chunk contains the entries
+    // with the smallest keys of its files, so we need to select the smallest keys of all of them.
+    auto collection = std::move( chunk_collections[0] );
+    auto lwr_sums   = std::move( chunk_lwr_sums[0] );
+    size_t total_count = chunk_counts[0];
+    for( size_t ci = 1; ci < num_chunks; ++ci ) {
+        collection.insert(
+            collection.end(),
+            std::make_move_iterator( chunk_collections[ci].begin() ),
+            std::make_move_iterator( chunk_collections[ci].end() )
+        );
+        std::vector<LwrEntry>().swap( chunk_collections[ci] );
+        for( size_t n = 0; n < lwr_sums.size(); ++n ) {
+            lwr_sums[n] += chunk_lwr_sums[ci][n];
+        }
+        total_count += chunk_counts[ci];
+    }
+    if( chunk_capacity > 0 && collection.size() > chunk_capacity ) {
+        std::nth_element(
+            collection.begin(), collection.begin() + chunk_capacity, collection.end(),
+            []( LwrEntry const& lhs, LwrEntry const& rhs ){
+                return lhs.key < rhs.key;
+            }
+        );
+        collection.resize( chunk_capacity );
+    }
+
+    // User output. The means are exact, as they use all pqueries.
+    LOG_MSG1 << "Found " << total_count << " pqueries";
+    if( total_count > 0 ) {
+        std::stringstream ss;
+        for( size_t n = 0; n < lwr_sums.size(); ++n ) {
+            ss << ( n == 0 ? "" : ", " );
+            ss << ( n < options.num_lwrs ? "LWR." + std::to_string( n + 1 ) : "Remainder" );
+            ss << " " << ( lwr_sums[n] / static_cast<double>( total_count ));
         }
+        LOG_MSG1 << "Mean LWRs: " << ss.str();
+    }
+    if( subsample ) {
+        LOG_MSG1 << "Using a subsample of " << collection.size() << " pqueries";
     }
-    LOG_MSG1 << "Found " << collection.size() << " pqueries";
 
     // Sort according to needs
     LOG_MSG1 << "Sorting pqueries by LWR";
@@ -316,8 +500,16 @@ void run_lwr_distribution( LwrDistributionOptions const& options )
         assert( index < collection.size() );
         assert( collection[index].lwrs.size() == options.num_lwrs + 1 );
 
-        // Print the entry with all its LWRs.
-        (*ofs) << (index + 1);
+        // Print the entry with all its LWRs. When subsampling, we print the approximate
+        // position of the entry in the sorted order of all pqueries.
+        auto rank = index;
+        if( collection.size() < total_count ) {
+            rank = static_cast<size_t>( std::round(
+                static_cast<double>( index ) * static_cast<double>( total_count - 1 ) /
+                static_cast<double>( std::max<size_t>( 1, collection.size() - 1 ))
+            ));
+        }
+        (*ofs) << (rank + 1);
         (*ofs) << "," << options.jplace_input.base_file_name( collection[index].sample_index );
         (*ofs) << "," << collection[index].pquery_name;
         for( auto const& v : collection[index].lwrs ) {
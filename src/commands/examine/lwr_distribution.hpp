@@ -45,6 +45,10 @@ public:
     bool   numerical_sort   = false;
     bool   no_compat_check  = false;
 
+    size_t        subsample_size       = 0;
+    bool          stratified_subsample = false;
+    unsigned long subsample_seed       = 0;
+
     JplaceInputOptions jplace_input;
     FileOutputOptions  file_output;
 };
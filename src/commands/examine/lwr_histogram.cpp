@@ -1,6 +1,6 @@
 /*
     gappa - Genesis Applications for Phylogenetic Placement Analysis
-    Copyright (C) 2017-2021 Lucas Czech
+    Copyright (C) 2017-2024 Lucas Czech
 
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -25,6 +25,7 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
@@ -32,12 +33,16 @@
 #include "genesis/placement/function/masses.hpp"
 #include "genesis/placement/function/operators.hpp"
 
+#include "genesis/utils/core/options.hpp"
 #include "genesis/utils/io/output_stream.hpp"
 #include "genesis/utils/math/histogram.hpp"
 #include "genesis/utils/math/histogram/stats.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <fstream>
+#include <functional>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -120,59 +125,102 @@ void run_lwr_histogram( LwrHistogramOptions const& options )
     // Print some user output.
     options.jplace_input.print();
 
-    // Prepare intermediate data.
+    // Prepare intermediate data. We accumulate the histograms in chunks of files, each with its own
+    // histograms and counts, so that no locking is needed. The chunks are combined afterwards.
+    auto const file_total = options.jplace_input.file_count();
+    auto const num_chunks = parallel_chunk_count( file_total );
+    auto const empty_hists = std::vector<Histogram>(
+        options.num_lwrs + 1, { options.histogram_bins, 0.0, 1.0 }
+    );
+    auto chunk_hists = std::vector<std::vector<Histogram>>( num_chunks, empty_hists );
+    auto chunk_pquery_counts = std::vector<size_t>( num_chunks, 0 );
+    auto chunk_name_counts   = std::vector<size_t>( num_chunks, 0 );
     Tree tree;
-    size_t file_count = 0;
-    size_t pquery_count = 0;
-    size_t name_count = 0;
-    auto hists = std::vector<Histogram>( options.num_lwrs + 1, { options.histogram_bins, 0.0, 1.0 });
+    std::shared_ptr<PlacementTree const> tree_ptr;
+    std::atomic<size_t> file_count{ 0 };
 
     // Read all jplace files.
-    #pragma omp parallel for schedule(dynamic)
-    for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
-
-        // User output
-        LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << options.jplace_input.file_count()
-                 << ": " << options.jplace_input.file_path( fi );
-
-        // Read in file.
-        auto sample = options.jplace_input.sample( fi );
-        sort_placements_by_weight( sample );
-
-        // Check whether the tree is the same. This is totally not needed for the calculation,
-        // but the case where we want different trees to be summarized sounds more like and error.
-        if( ! options.no_compat_check ) {
-            #pragma omp critical(GAPPA_LWR_TREE)
-            {
-                // Tree
-                if( tree.empty() ) {
-                    tree = sample.tree();
-                } else if( ! genesis::placement::compatible_trees( tree, sample.tree() ) ) {
+    parallel_for_chunks( file_total, num_chunks, [&]( size_t ci, size_t first, size_t last ){
+        auto& hists = chunk_hists[ci];
+
+        // Buffer for the LWRs of a pquery, reused to avoid allocations.
+        std::vector<double> lwrs;
+
+        for( size_t fi = first; fi < last; ++fi ) {
+
+            // User output
+            LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << file_total
+                     << ": " << options.jplace_input.file_path( fi );
+
+            // Read in file.
+            std::shared_ptr<PlacementTree const> sample_tree;
+            auto const sample = options.jplace_input.sample( fi, sample_tree );
+
+            // Check whether the tree is the same. This is totally not needed for the calculation,
+            // but the case where we want different trees to be summarized sounds more like and error.
+            // Exceptions cannot leave the critical section, so we only throw after it.
+            if( ! options.no_compat_check ) {
+                bool compatible = true;
+                #pragma omp critical(GAPPA_LWR_TREE)
+                {
+                    // Tree
+                    if( tree.empty() ) {
+                        tree = sample.tree();
+                        tree_ptr = sample_tree;
+                    } else if( sample_tree != tree_ptr ) {
+                        compatible = genesis::placement::compatible_trees( tree, sample.tree() );
+                    }
+                }
+                if( ! compatible ) {
                     throw std::runtime_error(
                         "Input jplace files have differing reference trees. "
                         // "(Disable this check using --no-compat-check)"
                     );
                 }
             }
-        }
 
-        // The main accumulation is single threaded.
-        // We could optimize more, but seriously, it is fast enough already.
-        #pragma omp critical(GAPPA_LWR_HIST_ACC)
-        {
+            // Accumulate into the histograms of this chunk. We only need the LWRs in order
+            // for the first ones of each pquery, so instead of sorting all placements,
+            // we only select the largest ones, and put the rest into the remainder.
             for( auto const& pquery : sample ) {
-                ++pquery_count;
-                name_count += pquery.name_size();
+                ++chunk_pquery_counts[ci];
+                chunk_name_counts[ci] += pquery.name_size();
                 auto const mult = total_multiplicity( pquery );
-                auto const max_n = std::min( options.num_lwrs, pquery.placement_size() );
+
+                lwrs.clear();
+                for( auto const& placement : pquery.placements() ) {
+                    lwrs.push_back( placement.like_weight_ratio );
+                }
+                auto const max_n = std::min( options.num_lwrs, lwrs.size() );
+                std::partial_sort(
+                    lwrs.begin(), lwrs.begin() + max_n, lwrs.end(), std::greater<double>()
+                );
+
                 for( size_t n = 0; n < max_n; ++n ) {
-                    hists[n].accumulate( pquery.placement_at( n ).like_weight_ratio, mult );
+                    hists[n].accumulate( lwrs[n], mult );
                 }
-                for( size_t n = max_n; n < pquery.placement_size(); ++n ) {
-                    hists.back().accumulate( pquery.placement_at( n ).like_weight_ratio, mult );
+                for( size_t n = max_n; n < lwrs.size(); ++n ) {
+                    hists.back().accumulate( lwrs[n], mult );
                 }
             }
         }
+    });
+
+    // Combine the chunks. This is cheap, as we only have a few bins per histogram.
+    auto& hists = chunk_hists[0];
+    size_t pquery_count = 0;
+    size_t name_count = 0;
+    for( size_t ci = 0; ci < num_chunks; ++ci ) {
+        pquery_count += chunk_pquery_counts[ci];
+        name_count   += chunk_name_counts[ci];
+        if( ci == 0 ) {
+            continue;
+        }
+        for( size_t n = 0; n < hists.size(); ++n ) {
+            for( size_t b = 0; b < options.histogram_bins; ++b ) {
+                hists[n][b] += chunk_hists[ci][n][b];
+            }
+        }
     }
 
     // User output
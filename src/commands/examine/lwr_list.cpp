@@ -1,6 +1,6 @@
 /*
     gappa - Genesis Applications for Phylogenetic Placement Analysis
-    Copyright (C) 2017-2021 Lucas Czech
+    Copyright (C) 2017-2024 Lucas Czech
 
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -37,7 +37,10 @@
 #include "genesis/utils/math/histogram/stats.hpp"
 
 #include <cassert>
+#include <cstdio>
+#include <exception>
 #include <fstream>
+#include <string>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -91,6 +94,78 @@ void setup_lwr_list( CLI::App& app )
     ));
 }
 
+// =================================================================================================
+//      Helper Functions
+// =================================================================================================
+
+/**
+ * @brief Append a value to the @p buffer, with a leading comma.
+ *
+ * This uses the same format as writing the value to a stream with default settings,
+ * but without the overhead of the stream.
+ */
+static void append_lwr_list_value( std::string& buffer, double value )
+{
+    char chars[32];
+    auto const n = std::snprintf( chars, sizeof( chars ), ",%g", value );
+    if( n > 0 && static_cast<size_t>( n ) < sizeof( chars )) {
+        buffer.append( chars, static_cast<size_t>( n ));
+    }
+}
+
+/**
+ * @brief Append the rows of all pqueries of a @p sample to the @p buffer,
+ * and return the number of names, that is, rows.
+ */
+static size_t append_lwr_list_rows(
+    LwrListOptions const& options,
+    std::string const& file_name,
+    genesis::placement::Sample const& sample,
+    std::string& buffer
+) {
+    // Go through all pqueries and their names that are in the current file.
+    size_t name_count = 0;
+    for( auto const& pquery : sample ) {
+        for( auto const& name : pquery.names() ) {
+            ++name_count;
+            buffer += file_name;
+            buffer += ',';
+            buffer += name.name;
+            append_lwr_list_value( buffer, name.multiplicity );
+
+            // Print the LWRs as needed, and potentially the remainder.
+            if( options.num_lwrs == 0 ) {
+                // Special case: Print all LWRs - not a table any more.
+                for( size_t i = 0; i < pquery.placement_size(); ++i ) {
+                    append_lwr_list_value( buffer, pquery.placement_at( i ).like_weight_ratio );
+                }
+            } else if( options.num_lwrs < pquery.placement_size() ) {
+                // More placements than we want to print - accumuate the rest into the remainder.
+                for( size_t i = 0; i < options.num_lwrs; ++i ) {
+                    append_lwr_list_value( buffer, pquery.placement_at( i ).like_weight_ratio );
+                }
+                double remainder = 0.0;
+                for( size_t i = options.num_lwrs; i < pquery.placement_size(); ++i ) {
+                    remainder += pquery.placement_at( i ).like_weight_ratio;
+                }
+                append_lwr_list_value( buffer, remainder );
+            } else {
+                // Fewer placements than we want to print - fill the rest of the row
+                // up with zeros, and print a zero remainder.
+                for( size_t i = 0; i < pquery.placement_size(); ++i ) {
+                    append_lwr_list_value( buffer, pquery.placement_at( i ).like_weight_ratio );
+                }
+                for( size_t i = pquery.placement_size(); i < options.num_lwrs; ++i ) {
+                    buffer += ",0.0";
+                }
+                buffer += ",0.0";
+            }
+            buffer += '\n';
+        }
+    }
+    return name_count;
+}
+
 // =================================================================================================
 //      Run
 // =================================================================================================
@@ -110,6 +185,7 @@ void run_lwr_list( LwrListOptions const& options )
 
     // Prepare intermediate data.
     Tree tree;
+    std::shared_ptr<PlacementTree const> tree_ptr;
     size_t file_count = 0;
     size_t pquery_count = 0;
     size_t name_count = 0;
@@ -129,69 +205,89 @@ void run_lwr_list( LwrListOptions const& options )
     }
     (*list_ofs) << "\n";
 
-    // Read all jplace files.
-    // Here, we do one at a time, in order to get the correct output order of table rows.
+    // Read all jplace files in parallel. Each file is formatted into its own buffer,
+    // which is then written in the order of the input files, so that the table rows
+    // are in the correct order. Exceptions cannot leave the parallel region, so we keep the first
+    // one, skip the remaining files, and do not write any further rows.
+    std::exception_ptr error;
+    #pragma omp parallel for schedule(dynamic) ordered
     for( size_t fi = 0; fi < options.jplace_input.file_count(); ++fi ) {
-        // User output
-        LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << options.jplace_input.file_count()
-                 << ": " << options.jplace_input.file_path( fi );
-
-        // Read in file.
-        auto sample = options.jplace_input.sample( fi );
-        sort_placements_by_weight( sample );
-
-        // Check whether the tree is the same. This is totally not needed for the calculation,
-        // but the case where we want different trees to be summarized sounds more like an error.
-        if( ! options.no_compat_check ) {
-            // Tree
-            if( tree.empty() ) {
-                tree = sample.tree();
-            } else if( ! genesis::placement::compatible_trees( tree, sample.tree() ) ) {
-                throw std::runtime_error(
-                    "Input jplace files have differing reference trees. "
-                    // "(Disable this check using --no-compat-check)"
-                );
-            }
+        bool failed = false;
+        #pragma omp critical(GAPPA_LWR_LIST_ERROR)
+        {
+            failed = static_cast<bool>( error );
         }
 
-        // Go through all pqueries and their names that are in the current file.
-        for( auto const& pquery : sample ) {
-            ++pquery_count;
-            for( auto const& name : pquery.names() ) {
-                ++name_count;
-                auto const file_name = options.jplace_input.base_file_name( fi );
-                (*list_ofs) << file_name << "," << name.name << "," << name.multiplicity;
+        std::string buffer;
+        size_t file_pquery_count = 0;
+        size_t file_name_count = 0;
+        if( ! failed ) {
+            try {
+                // Read in file.
+                std::shared_ptr<PlacementTree const> sample_tree;
+                auto sample = options.jplace_input.sample( fi, sample_tree );
+                file_pquery_count = sample.size();
+                sort_placements_by_weight( sample );
 
-                // Print the LWRs as needed, and potentially the remainder.
-                if( options.num_lwrs == 0 ) {
-                    // Special case: Print all LWRs - not a table any more.
-                    for( size_t i = 0; i < pquery.placement_size(); ++i ) {
-                        (*list_ofs) << "," << pquery.placement_at( i ).like_weight_ratio;
-                    }
-                } else if( options.num_lwrs < pquery.placement_size() ) {
-                    // More placements than we want to print - accumuate the rest into the remainder.
-                    for( size_t i = 0; i < options.num_lwrs; ++i ) {
-                        (*list_ofs) << "," << pquery.placement_at( i ).like_weight_ratio;
+                // Check whether the tree is the same. This is totally not needed for the
+                // calculation, but the case where we want different trees to be summarized sounds
+                // more like an error. Exceptions cannot leave the critical section, so we only
+                // throw after it.
+                if( ! options.no_compat_check ) {
+                    bool compatible = true;
+                    #pragma omp critical(GAPPA_LWR_LIST_TREE)
+                    {
+                        // Tree
+                        if( tree.empty() ) {
+                            tree = sample.tree();
+                            tree_ptr = sample_tree;
+                        } else if( sample_tree != tree_ptr ) {
+                            compatible = compatible_trees( tree, sample.tree() );
+                        }
                     }
-                    double remainder = 0.0;
-                    for( size_t i = options.num_lwrs; i < pquery.placement_size(); ++i ) {
-                        remainder += pquery.placement_at( i ).like_weight_ratio;
+                    if( ! compatible ) {
+                        throw std::runtime_error(
+                            "Input jplace files have differing reference trees. "
+                            // "(Disable this check using --no-compat-check)"
+                        );
                     }
-                    (*list_ofs) << "," << remainder;
-                } else {
-                    // Fewer placements than we want to print - fill the rest of the row
-                    // up with zeros, and print a zero remainder.
-                    for( size_t i = 0; i < pquery.placement_size(); ++i ) {
-                        (*list_ofs) << "," << pquery.placement_at( i ).like_weight_ratio;
-                    }
-                    for( size_t i = pquery.placement_size(); i < options.num_lwrs; ++i ) {
-                        (*list_ofs) << ",0.0";
+                }
+
+                // Format all pqueries and their names that are in the current file.
+                auto const file_name = options.jplace_input.base_file_name( fi );
+                file_name_count = append_lwr_list_rows( options, file_name, sample, buffer );
+            } catch( ... ) {
+                #pragma omp critical(GAPPA_LWR_LIST_ERROR)
+                {
+                    if( ! error ) {
+                        error = std::current_exception();
                     }
-                    (*list_ofs) << ",0.0";
                 }
-                (*list_ofs) << "\n";
             }
         }
+
+        // Write the buffer, in the order of the files. Once a file failed, we write nothing,
+        // so that we do not produce a table that looks complete, but misses some files.
+        #pragma omp ordered
+        {
+            #pragma omp critical(GAPPA_LWR_LIST_ERROR)
+            {
+                failed = static_cast<bool>( error );
+            }
+            if( ! failed ) {
+                // User output
+                LOG_MSG2 << "Processed file " << ( ++file_count ) << " of "
+                         << options.jplace_input.file_count()
+                         << ": " << options.jplace_input.file_path( fi );
+
+                (*list_ofs) << buffer;
+                pquery_count += file_pquery_count;
+                name_count += file_name_count;
+            }
+        }
+    }
+    if( error ) {
+        std::rethrow_exception( error );
     }
 
     LOG_MSG << "Wrote " << pquery_count << " pqueries with " << name_count << " names";
@@ -25,11 +25,13 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/file_blocks.hpp"
+#include "tools/jplace_writer.hpp"
+#include "tools/parallel_chunks.hpp"
 
 #include "CLI/CLI.hpp"
 
 #include "genesis/placement/formats/jplace_reader.hpp"
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/function/functions.hpp"
 #include "genesis/placement/function/helper.hpp"
 #include "genesis/placement/function/operators.hpp"
@@ -52,13 +54,22 @@
 #include "genesis/utils/io/output_stream.hpp"
 
 #include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/options.hpp"
+#include "genesis/utils/core/std.hpp"
 #include "genesis/utils/formats/csv/reader.hpp"
 #include "genesis/utils/io/input_source.hpp"
 #include "genesis/utils/text/string.hpp"
 #include "genesis/utils/color/list_qualitative.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -83,10 +94,125 @@ using CladeTaxaList = std::unordered_map<std::string, std::vector<std::string>>;
  */
 using CladeEdgeList = std::vector<std::pair<std::string, std::unordered_set<size_t>>>;
 
+// =================================================================================================
+//     Pquery Name Index
+// =================================================================================================
+
 /**
- * @brief Contains a list of clades, each itself contianing all pquery names in that clade.
+ * @brief Index from pquery names to the clade that each of them belongs to.
+ *
+ * The names are stored back to back in one string, with a list of entries that point into it.
+ * Once all names are added, the entries are sorted by name, so that a name can be found by binary
+ * search. This needs much less memory than a hash map of names, so that we can keep the names of
+ * the pqueries of many large jplace files for extracting their sequences.
  */
-using PqueryNamesPerCladeList = std::unordered_map<std::string, std::unordered_set<std::string>>;
+class PqueryNameIndex
+{
+public:
+
+    static size_t const npos = static_cast<size_t>( -1 );
+
+    explicit PqueryNameIndex( std::vector<std::string> clade_names )
+        : clade_names_( std::move( clade_names ))
+    {}
+
+    std::vector<std::string> const& clade_names() const
+    {
+        return clade_names_;
+    }
+
+    size_t size() const
+    {
+        return entries_.size();
+    }
+
+    /**
+     * @brief Add a @p name that belongs to the clade with index @p clade_index.
+     *
+     * Call sort() after adding all names, before finding them.
+     */
+    void add( std::string const& name, size_t clade_index )
+    {
+        assert( clade_index < clade_names_.size() );
+        entries_.push_back({
+            names_.size(),
+            static_cast<uint32_t>( name.size() ),
+            static_cast<uint32_t>( clade_index )
+        });
+        names_ += name;
+    }
+
+    /**
+     * @brief Sort the names, and remove duplicate names, of which only the one with the clade of
+     * the smallest index is kept. Return the number of removed duplicates.
+     */
+    size_t sort()
+    {
+        std::sort( entries_.begin(), entries_.end(), [&]( Entry const& lhs, Entry const& rhs ){
+            auto const cmp = compare_( lhs, rhs );
+            return cmp < 0 || ( cmp == 0 && lhs.clade < rhs.clade );
+        });
+        auto const last = std::unique(
+            entries_.begin(), entries_.end(), [&]( Entry const& lhs, Entry const& rhs ){
+                return compare_( lhs, rhs ) == 0;
+            }
+        );
+        auto const duplicates = static_cast<size_t>( std::distance( last, entries_.end() ));
+        entries_.erase( last, entries_.end() );
+        entries_.shrink_to_fit();
+        names_.shrink_to_fit();
+        return duplicates;
+    }
+
+    /**
+     * @brief Return the index of the clade of a @p name, or `npos` if the name is not in the index.
+     */
+    size_t find( std::string const& name ) const
+    {
+        auto const it = std::lower_bound(
+            entries_.begin(), entries_.end(), name,
+            [&]( Entry const& entry, std::string const& value ){
+                return names_.compare( entry.offset, entry.length, value ) < 0;
+            }
+        );
+        if( it == entries_.end() || names_.compare( it->offset, it->length, name ) != 0 ) {
+            return npos;
+        }
+        return it->clade;
+    }
+
+    /**
+     * @brief Return the number of names per clade.
+     */
+    std::vector<size_t> clade_name_counts() const
+    {
+        std::vector<size_t> result( clade_names_.size(), 0 );
+        for( auto const& entry : entries_ ) {
+            ++result[ entry.clade ];
+        }
+        return result;
+    }
+
+private:
+
+    struct Entry
+    {
+        size_t   offset;
+        uint32_t length;
+        uint32_t clade;
+    };
+
+    int compare_( Entry const& lhs, Entry const& rhs ) const
+    {
+        return names_.compare( lhs.offset, lhs.length, names_, rhs.offset, rhs.length );
+    }
+
+    std::vector<std::string> clade_names_;
+    std::string names_;
+    std::vector<Entry> entries_;
+};
+
+size_t const PqueryNameIndex::npos;
 
 // =================================================================================================
 //      Setup
@@ -130,6 +256,15 @@ void setup_extract( CLI::App& app )
     // Make this a settings option.
     options->jplace_input.add_point_mass_opt_to_app( sub );
 
+    auto low_memory_opt = sub->add_flag(
+        "--low-memory",
+        options->low_memory,
+        "Write the extracted pqueries of each input file to the clade jplace files right away, "
+        "instead of keeping all of them in memory until all input files are processed. "
+        "This is useful for large numbers of input files."
+    );
+    low_memory_opt->group( "Settings" );
+
     auto color_tree_file_opt = sub->add_option(
         "--color-tree-file",
         options->color_tree_file,
@@ -143,6 +278,7 @@ void setup_extract( CLI::App& app )
     options->jplace_output.add_default_output_opts_to_app( sub, "samples" );
     options->sequence_output.set_optionname( "sequences" );
     options->sequence_output.add_default_output_opts_to_app( sub, "sequences" );
+    options->sequence_output.add_file_compress_opt_to_app( sub );
 
     // Set the run function as callback to be called when this subcommand is issued.
     // Hand over the options by copy, so that their shared ptr stays alive in the lambda.
@@ -333,80 +469,160 @@ CladeEdgeList get_clade_edges(
 // =================================================================================================
 
 /**
- * @brief Take a list of edges per clade and a Sample and fill a SampleSet with single samples
- * for all given clades, where each sample contains those pqueries that fell into the clade.
+ * @brief Take a list of edges per clade and a Sample, and return the indices of the pqueries of
+ * the sample that fall into each clade.
  *
- * This is the main extraaction method. The SampleSet also contains an additional Sample
- * "uncertain", where all pqueries of the provided sample end up which do not have more than
- * `threshold` of their placement mass in a certain clade.
+ * This is the main extraction method. The result contains one list of pquery indices per clade,
+ * in the order of the clade_edges, and an additional list for the "uncertain" clade at the end,
+ * with all pqueries that do not have more than `threshold` of their placement mass in a certain
+ * clade. The pquery indices of each clade are in their original order.
  */
-void extract_pqueries(
+std::vector<std::vector<size_t>> assign_pqueries_to_clades(
     ExtractOptions const&             options,
     CladeEdgeList const&              clade_edges,
-    genesis::placement::Sample const& sample,
-    genesis::placement::SampleSet&    sample_set
+    genesis::placement::Sample const& sample
 ) {
     using namespace ::genesis::placement;
+    using namespace ::genesis::utils;
 
-    // Process all pqueries of the given sample.
+    // Make a lookup from edge indices to the clade that each edge belongs to. The clades are
+    // disjoint, and together with the basal branches, contain all edges, see get_clade_edges().
+    auto const no_clade = std::numeric_limits<size_t>::max();
+    std::vector<size_t> edge_clades( sample.tree().edge_count(), no_clade );
+    for( size_t i = 0; i < clade_edges.size(); ++i ) {
+        for( auto const edge_index : clade_edges[i].second ) {
+            assert( edge_index < edge_clades.size() );
+            edge_clades[ edge_index ] = i;
+        }
+    }
+    if( std::count( edge_clades.begin(), edge_clades.end(), no_clade ) > 0 ) {
+        throw std::runtime_error( "Internal error: Edges without clade." );
+    }
+    auto const uncertain_index = clade_edges.size();
+
+    // Process all pqueries of the given sample, in chunks that each collect the indices of the
+    // pqueries that they assign to each clade, so that we do not need to lock for each pquery.
     // We again use openmp here, so that even if only a single file is given, we make use of threads.
-    #pragma omp parallel for
-    for( size_t qi = 0; qi < sample.size(); ++qi ) {
-        auto const& pquery = sample.at( qi );
+    auto const num_chunks = parallel_chunk_count( sample.size() );
+    std::vector<std::vector<std::vector<size_t>>> chunk_pqueries(
+        num_chunks, std::vector<std::vector<size_t>>( clade_edges.size() + 1 )
+    );
 
-        // Prepare an accumulator that collects the mass per clade for this pquery.
+    parallel_for_chunks( sample.size(), num_chunks, [&]( size_t ci, size_t first, size_t last ){
+        auto& clade_pqueries = chunk_pqueries[ci];
+
+        // Prepare an accumulator that collects the mass per clade for a pquery.
         // The indices in the vector are the same as the ones in the clade_edge vector.
-        std::vector<double> mass_per_clade( clade_edges.size(), 0.0 );
+        std::vector<double> mass_per_clade( clade_edges.size() );
 
-        // For each placement, find its edge and the clade that this edge belongs to.
-        // For this clade, accumulate the placement's like weight ratio.
-        for( auto const& placement : pquery.placements() ) {
+        for( size_t qi = first; qi < last; ++qi ) {
+            auto const& pquery = sample.at( qi );
 
-            // Find the correct clade for the edge of this placement by scanning them all
-            // (this is a bit inefficient, but for now, it works).
-            for( size_t i = 0; i < clade_edges.size(); ++i ) {
-                if( clade_edges[i].second.count( placement.edge().index() ) > 0 ) {
+            // For each placement, find the clade that its edge belongs to,
+            // and accumulate the placement's like weight ratio for this clade.
+            std::fill( mass_per_clade.begin(), mass_per_clade.end(), 0.0 );
+            for( auto const& placement : pquery.placements() ) {
+                auto const clade_index = edge_clades[ placement.edge().index() ];
+                mass_per_clade[ clade_index ] += placement.like_weight_ratio;
+            }
 
-                    // If we found the correct clade, accumulate to its mass.
-                    mass_per_clade[i] += placement.like_weight_ratio;
+            // Now check whether there is a clade that has equal or more than `threshold` percent
+            // of the placement's weight ratio. If so, this is the one we assign the pquery to.
+            // If there is no sure assignment ( < threshold ) for this pquery, it goes to the
+            // special `uncertain` clade.
+            bool found_clade = false;
+            for( size_t i = 0; i < mass_per_clade.size(); ++i ) {
+                if( mass_per_clade[i] >= options.threshold ) {
+                    clade_pqueries[i].push_back( qi );
+                    found_clade = true;
                 }
             }
+            if( ! found_clade ) {
+                clade_pqueries[ uncertain_index ].push_back( qi );
+            }
         }
+    });
 
-        // Now check whether there is a clade that has equal or more than `threshold` percent
-        // of the placement's weight ratio. If so, this is the one we assign the pquery to.
-        bool found_clade = false;
-        for( size_t i = 0; i < mass_per_clade.size(); ++i ) {
-            // Only execute the main body of this loop when we found a fitting clade.
-            if( mass_per_clade[i] < options.threshold ) {
-                continue;
-            }
-            found_clade = true;
+    // Concatenate the chunks, so that the pqueries of each clade are in their original order.
+    std::vector<std::vector<size_t>> result( clade_edges.size() + 1 );
+    for( size_t i = 0; i < result.size(); ++i ) {
+        for( auto const& clade_pqueries : chunk_pqueries ) {
+            result[i].insert( result[i].end(), clade_pqueries[i].begin(), clade_pqueries[i].end() );
+        }
+    }
+    return result;
+}
 
-            // Get the sample from the set that has the current clade's name.
-            auto sample_ptr = find_sample( sample_set, clade_edges[i].first );
-            if( sample_ptr == nullptr ) {
-                throw std::runtime_error( "Internal error: Lost sample " + clade_edges[i].first );
-            }
+/**
+ * @brief Take a list of edges per clade and a Sample and fill a SampleSet with single samples
+ * for all given clades, where each sample contains those pqueries that fell into the clade.
+ *
+ * The SampleSet also contains an additional Sample "uncertain", see assign_pqueries_to_clades().
+ */
+void extract_pqueries(
+    ExtractOptions const&             options,
+    CladeEdgeList const&              clade_edges,
+    genesis::placement::Sample const& sample,
+    genesis::placement::SampleSet&    sample_set
+) {
+    using namespace ::genesis::placement;
 
-            // Add a copy of the pquery to the sample.
-            #pragma omp critical(GAPPA_EXTRACT_ADD_SAMPLE)
-            {
-                sample_ptr->add( pquery );
-            }
+    auto const clade_pqueries = assign_pqueries_to_clades( options, clade_edges, sample );
+    assert( clade_pqueries.size() == clade_edges.size() + 1 );
+
+    // Add copies of the pqueries to the samples. The samples are shared between the input files,
+    // which are processed in parallel, so we need to lock here, but only once per clade.
+    for( size_t i = 0; i < clade_pqueries.size(); ++i ) {
+        auto const& clade_name = ( i < clade_edges.size()
+            ? clade_edges[i].first
+            : options.uncertain_clade_name
+        );
+        auto sample_ptr = find_sample( sample_set, clade_name );
+        if( sample_ptr == nullptr ) {
+            throw std::runtime_error( "Internal error: Lost sample " + clade_name );
         }
 
-        // If there is no sure assignment ( < threshold ) for this pquery, we copy it into the
-        // special `uncertain` sample.
-        if( ! found_clade ) {
-            auto sample_ptr = find_sample( sample_set, options.uncertain_clade_name );
-            if( sample_ptr == nullptr ) {
-                throw std::runtime_error( "Internal error: Lost sample " + options.uncertain_clade_name );
+        #pragma omp critical(GAPPA_EXTRACT_ADD_SAMPLE)
+        {
+            for( auto const qi : clade_pqueries[i] ) {
+                sample_ptr->add( sample.at( qi ));
             }
+        }
+    }
+}
 
-            #pragma omp critical(GAPPA_EXTRACT_ADD_SAMPLE)
-            {
-                sample_ptr->add( pquery );
+/**
+ * @brief Take a list of edges per clade and a Sample, and append the pqueries that fell into each
+ * clade to the jplace file of that clade, as the streaming alternative to extract_pqueries().
+ *
+ * The @p clade_writers are in the order of the clade_edges, plus the "uncertain" clade at the end.
+ * If there are input sequences, the names of the pqueries are added to the @p name_index.
+ */
+void stream_pqueries(
+    ExtractOptions const&                             options,
+    CladeEdgeList const&                              clade_edges,
+    genesis::placement::Sample const&                 sample,
+    std::vector<std::unique_ptr<JplaceStreamWriter>>& clade_writers,
+    PqueryNameIndex&                                  name_index
+) {
+    auto const clade_pqueries = assign_pqueries_to_clades( options, clade_edges, sample );
+    assert( clade_pqueries.size() == clade_writers.size() );
+
+    // The writers take care of their own locking.
+    for( size_t i = 0; i < clade_pqueries.size(); ++i ) {
+        clade_writers[i]->append( sample, clade_pqueries[i] );
+    }
+
+    // Keep the names of the pqueries, but nothing else of them.
+    if( options.sequence_input.file_count() > 0 ) {
+        #pragma omp critical(GAPPA_EXTRACT_ADD_NAMES)
+        {
+            for( size_t i = 0; i < clade_pqueries.size(); ++i ) {
+                for( auto const qi : clade_pqueries[i] ) {
+                    for( auto const& pquery_name : sample.at( qi ).names() ) {
+                        name_index.add( pquery_name.name, i );
+                    }
+                }
             }
         }
     }
@@ -435,16 +651,29 @@ void write_sample_set(
     LOG_MSG1 << "Writing " << sample_set.size() << " clade sample files.";
 
     // Write files.
-    auto writer = JplaceWriter();
+    auto const writer = ParallelJplaceWriter();
     #pragma omp parallel for schedule(dynamic)
     for( size_t si = 0; si < sample_set.size(); ++si ) {
-        writer.write(
-            sample_set.at( si ),
-            options.jplace_output.get_output_target( sample_set.name_at( si ), "jplace" )
-        );
+        writer.write( sample_set.at( si ), options.jplace_output, sample_set.name_at( si ));
     }
 }
 
+/**
+ * @brief Finish the jplace files of the clades that were written by stream_pqueries().
+ */
+void finish_clade_writers(
+    std::vector<std::string> const&                   clade_names,
+    std::vector<std::unique_ptr<JplaceStreamWriter>>& clade_writers
+) {
+    assert( clade_names.size() == clade_writers.size() );
+    for( size_t i = 0; i < clade_writers.size(); ++i ) {
+        clade_writers[i]->finish();
+        LOG_MSG1 << "Collected " << clade_writers[i]->pquery_count() << " pqueries (representing "
+                 << clade_writers[i]->name_count() << " names) in clade " << clade_names[i];
+    }
+    LOG_MSG1 << "Wrote " << clade_writers.size() << " clade sample files.";
+}
+
 // =================================================================================================
 //      Write Color Tree
 // =================================================================================================
@@ -535,48 +764,49 @@ void write_color_tree(
 // =================================================================================================
 
 /**
- * @brief Get the names of all pqueries per clade.
+ * @brief Get the clade of the names of all pqueries.
  */
-PqueryNamesPerCladeList get_pqueries_per_clade(
+PqueryNameIndex get_pqueries_per_clade(
     genesis::placement::SampleSet const& sample_set
 ) {
-    PqueryNamesPerCladeList list;
-    size_t duplicate_names = 0;
+    std::vector<std::string> clade_names;
+    for( size_t si = 0; si < sample_set.size(); ++si ) {
+        clade_names.push_back( sample_set.name_at(si) );
+    }
 
+    PqueryNameIndex index( std::move( clade_names ));
     for( size_t si = 0; si < sample_set.size(); ++si ) {
         for( auto const& pquery : sample_set.at(si) ) {
             for( auto const& pquery_name : pquery.names() ) {
-
-                // Check if it is not already there.
-                for( auto const& clade : list ) {
-                    if( clade.second.count( pquery_name.name ) > 0 ) {
-                        ++duplicate_names;
-                    }
-                }
-
-                // Add it to the list.
-                list[ sample_set.name_at(si) ].insert( pquery_name.name );
+                index.add( pquery_name.name, si );
             }
         }
     }
+    return index;
+}
 
+/**
+ * @brief Sort the pquery names of the @p index, so that it can be used to find names,
+ * and warn about duplicate names.
+ */
+void sort_pquery_names( PqueryNameIndex& index )
+{
+    auto const duplicate_names = index.sort();
     if( duplicate_names > 0 ) {
         LOG_WARN << "Warning: Found " << duplicate_names << " pquerie(s) that have the same name. "
                  << "This will cause the extraction of sequences with that name to be "
-                 << "randomly assigned to one of the clades that have a pquery with that name. "
+                 << "assigned to only the first of the clades that have a pquery with that name. "
                  << "Thus, this should better be fixed first!";
     }
-
-    return list;
 }
 
 // =================================================================================================
-//      Clade Names List
+//      Extract Sequences
 // =================================================================================================
 
 void extract_sequences(
     ExtractOptions const& options,
-    PqueryNamesPerCladeList const& list
+    PqueryNameIndex const& index
 ) {
     using namespace ::genesis;
     using namespace ::genesis::sequence;
@@ -585,103 +815,132 @@ void extract_sequences(
     // User output.
     options.sequence_input.print();
 
-    // Lazy prep: We write empty files first, which makes sure (again) that they do not exist,
-    // and that we can later append to them.
-    for( auto const& clade : list ) {
-        file_write( "", options.sequence_output.get_output_filename( clade.first, "fasta" ));
+    // Create the output files of all clades that have pqueries. They are only opened for appending
+    // while writing to them, so that we do not run into the limit of open files of the system
+    // for many clades. Each file gets a mutex, so that sequences from different input files can be
+    // written to it from different threads. With compression, each write is a gzip member.
+    auto const clade_count = index.clade_names().size();
+    auto const clade_name_counts = index.clade_name_counts();
+    auto const compress = options.sequence_output.compress();
+    std::vector<std::string> clade_files( clade_count );
+    size_t used_clades_count = 0;
+    dir_create( options.sequence_output.out_dir(), true );
+    for( size_t ci = 0; ci < clade_count; ++ci ) {
+        if( clade_name_counts[ci] > 0 ) {
+            clade_files[ci] = options.sequence_output.get_output_filename(
+                index.clade_names()[ci], "fasta"
+            );
+            create_block_file( clade_files[ci], "", compress );
+            ++used_clades_count;
+        }
     }
+    std::vector<std::mutex> clade_mutexes( clade_count );
 
     // Helpers.
     auto const set_size = options.sequence_input.file_count();
-    size_t file_count = 0;
+    std::atomic<size_t> file_count{ 0 };
     auto writer = FastaWriter();
 
+    // Total size of the buffers of an input file (and hence of a thread), in bytes,
+    // after which all of them are written to their files.
+    size_t const buffer_size = 16 * 1024 * 1024;
+
     // Count for user output.
     size_t total_seqs_count = 0;
     size_t missing_seqs_count = 0;
 
-    // Cache sequences per clade while extracting.
-    std::unordered_map< std::string, SequenceSet > clade_sequences;
-
-    // Process the input files.
+    // Process the input files. Exceptions cannot leave the parallel region,
+    // so we keep the first one for later, and skip the remaining files.
+    std::exception_ptr error;
     #pragma omp parallel for schedule(dynamic)
     for( size_t fi = 0; fi < set_size; ++fi ) {
+        bool failed = false;
+        #pragma omp critical(GAPPA_EXTRACT_SEQUENCES_ERROR)
+        {
+            failed = static_cast<bool>( error );
+        }
+        if( failed ) {
+            continue;
+        }
+
         auto const& fasta_filename = options.sequence_input.file_path( fi );
 
         // User output.
         LOG_MSG2 << "Processing file " << ( ++file_count ) << " of " << set_size
                  << ": " << options.sequence_input.file_path( fi );
 
-        auto it = FastaInputIterator(
-            from_file( fasta_filename ),
-            options.sequence_input.fasta_reader()
-        );
-        while( it ) {
-            #pragma omp atomic
-            ++total_seqs_count;
-
-            // Try to find the fasta sequence name in a clade.
-            PqueryNamesPerCladeList::const_iterator clade_it = list.end();
-            for( auto lit = list.begin(); lit != list.end(); ++lit ) {
-                if( lit->second.count( it->label() ) > 0 ) {
-                    clade_it = lit;
-                    break;
+        // Buffer the formatted sequences of each clade. The buffers belong to this input file,
+        // and hence to the thread that processes it, so that no locking is needed for filling them.
+        std::vector<std::ostringstream> clade_buffers( clade_count );
+        size_t buffered = 0;
+        auto flush_buffers = [&](){
+            for( size_t ci = 0; ci < clade_count; ++ci ) {
+                if( clade_buffers[ci].tellp() <= 0 ) {
+                    continue;
+                }
+                auto const text = clade_buffers[ci].str();
+                {
+                    std::lock_guard<std::mutex> lock( clade_mutexes[ci] );
+                    append_block_file( clade_files[ci], text, compress );
                 }
+                clade_buffers[ci].str( "" );
             }
-
-            // If not, skip this sequence.
-            if( clade_it == list.end() ) {
-                #pragma omp atomic
-                ++missing_seqs_count;
+            buffered = 0;
+        };
+
+        size_t file_seqs_count = 0;
+        size_t file_missing_count = 0;
+        try {
+            auto it = FastaInputIterator(
+                from_file( fasta_filename ),
+                options.sequence_input.fasta_reader()
+            );
+            while( it ) {
+                ++file_seqs_count;
+
+                // Find the clade of the fasta sequence name. If there is none, skip this sequence.
+                auto const ci = index.find( it->label() );
+                if( ci == PqueryNameIndex::npos ) {
+                    ++file_missing_count;
+                    ++it;
+                    continue;
+                }
+                assert( ! clade_files[ci].empty() );
+
+                // Add the sequence to the buffer of the clade,
+                // and write all buffers if they are full.
+                auto const before = clade_buffers[ci].tellp();
+                writer.write_sequence( *it, clade_buffers[ci] );
+                buffered += static_cast<size_t>( clade_buffers[ci].tellp() - before );
+                if( buffered >= buffer_size ) {
+                    flush_buffers();
+                }
 
                 ++it;
-                continue;
             }
 
-            // Add the sequence to the clade set, and write if cache too big.
-            #pragma omp critical(GAPPA_CHUNKIFY_UPDATE_SEQUENCES)
+            // Write the remaining sequences of this input file.
+            flush_buffers();
+        } catch( ... ) {
+            #pragma omp critical(GAPPA_EXTRACT_SEQUENCES_ERROR)
             {
-                // Get the sequence cache for the clade and add ther sequence to it.
-                auto& clade_seqs = clade_sequences[ clade_it->first ];
-                clade_seqs.add( *it );
-
-                // If the cache is full, flush it.
-                if( clade_seqs.size() >= 1000 ) {
-
-                    // Prepare file for appending.
-                    auto const fn = options.sequence_output.get_output_filename(
-                        clade_it->first, "fasta"
-                    );
-                    std::ofstream out_stream( fn, std::ofstream::app );
-                    if( out_stream.fail() ) {
-                        throw std::runtime_error( "Cannot append sequences to file " + fn + "." );
-                    }
-
-                    // Write and clear.
-                    writer.write( clade_seqs, genesis::utils::to_stream( out_stream ));
-                    clade_seqs.clear();
+                if( ! error ) {
+                    error = std::current_exception();
                 }
             }
-
-            ++it;
-        }
-    }
-
-    // Flush clade caches.
-    for( auto const& clade_seqs : clade_sequences ) {
-
-        // Prepare file for appending.
-        auto const fn = options.sequence_output.get_output_filename( clade_seqs.first, "fasta" );
-        std::ofstream out_stream( fn, std::ofstream::app );
-        if( out_stream.fail() ) {
-            throw std::runtime_error( "Cannot append sequences to file '" + fn + "'." );
         }
 
-        // Write.
-        writer.write( clade_seqs.second, genesis::utils::to_stream( out_stream ));
+        #pragma omp atomic
+        total_seqs_count += file_seqs_count;
+        #pragma omp atomic
+        missing_seqs_count += file_missing_count;
+    }
+    if( error ) {
+        std::rethrow_exception( error );
     }
 
-    LOG_MSG1 << "Collected " << total_seqs_count << " sequences in " << list.size() << " clades.";
+    LOG_MSG1 << "Collected " << total_seqs_count << " sequences in " << used_clades_count
+             << " clades.";
     if( missing_seqs_count > 0 ) {
         LOG_MSG1 << "Thereof, " << missing_seqs_count << " sequences could not be assigned to any "
                  << "clade, because their name does not appear in any jplace file.";
@@ -714,11 +973,25 @@ void run_extract( ExtractOptions const& options )
     // Clade taxa list.
     auto const clade_taxa_list = get_clade_taxa_lists( options );
 
+    // Names of all clades that we write, in the order of get_clade_edges(),
+    // plus the uncertain clade at the end.
+    std::vector<std::string> clade_names;
+    for( auto const& cl : clade_taxa_list ) {
+        clade_names.push_back( cl.first );
+    }
+    clade_names.push_back( options.basal_clade_name );
+    clade_names.push_back( options.uncertain_clade_name );
+
     // We store one tree for the colour output and for checking that all samples have the same one.
     Tree tree;
+    std::shared_ptr<genesis::placement::PlacementTree const> tree_ptr;
 
     // Resulting sample set, gets filled with the extracted pqueries for each clade.
+    // In low memory mode, we instead directly write the pqueries to the clade files,
+    // and only keep their names, in case that we also need to extract sequences.
     SampleSet sample_set;
+    std::vector<std::unique_ptr<JplaceStreamWriter>> clade_writers;
+    PqueryNameIndex name_index( clade_names );
 
     #pragma omp parallel for schedule(dynamic)
     for( size_t fi = 0; fi < set_size; ++fi ) {
@@ -728,7 +1001,8 @@ void run_extract( ExtractOptions const& options )
                  << ": " << options.jplace_input.file_path( fi ) << "\n";
 
         // Read the sample.
-        auto sample = options.jplace_input.sample( fi );
+        std::shared_ptr<genesis::placement::PlacementTree const> sample_tree;
+        auto sample = options.jplace_input.sample( fi, sample_tree );
         auto const fn = options.jplace_input.base_file_name( fi );
         auto const clade_edges = get_clade_edges( options, clade_taxa_list, sample.tree(), fn );
 
@@ -738,17 +1012,29 @@ void run_extract( ExtractOptions const& options )
         {
             if( tree.empty() ) {
                 tree = sample.tree();
+                tree_ptr = sample_tree;
 
                 // Write a tree with clade colors for error checking.
                 write_color_tree( options, clade_edges, tree );
 
-                for( auto const& cl : clade_taxa_list ) {
-                    sample_set.add( Sample( tree ), cl.first );
+                if( options.low_memory ) {
+                    utils::dir_create( options.jplace_output.out_dir(), true );
+                    for( auto const& clade_name : clade_names ) {
+                        clade_writers.push_back( utils::make_unique<JplaceStreamWriter>(
+                            options.jplace_output.get_output_filename( clade_name, "jplace" ),
+                            tree, options.jplace_output.compress()
+                        ));
+                    }
+                } else {
+                    for( auto const& clade_name : clade_names ) {
+                        sample_set.add( Sample( tree ), clade_name );
+                    }
                 }
-                sample_set.add( Sample( tree ), options.basal_clade_name );
-                sample_set.add( Sample( tree ), options.uncertain_clade_name );
 
-            } else if( ! genesis::placement::compatible_trees( tree, sample.tree() )) {
+            } else if(
+                sample_tree != tree_ptr &&
+                ! genesis::placement::compatible_trees( tree, sample.tree() )
+            ) {
                 throw std::runtime_error( "Input jplace files have differing reference trees." );
             }
         }
@@ -760,17 +1046,28 @@ void run_extract( ExtractOptions const& options )
         normalize_weight_ratios( sample );
 
         // Do the work!
-        extract_pqueries( options, clade_edges, sample, sample_set );
+        if( options.low_memory ) {
+            stream_pqueries( options, clade_edges, sample, clade_writers, name_index );
+        } else {
+            extract_pqueries( options, clade_edges, sample, sample_set );
+        }
     }
 
-    // Write everything to jplace files.
-    write_sample_set( sample_set, options );
+    // Write everything to jplace files, or finish them, if we already wrote the pqueries.
+    if( options.low_memory ) {
+        finish_clade_writers( clade_names, clade_writers );
+    } else {
+        write_sample_set( sample_set, options );
+    }
 
     // If there were sequences given as input as well, extract them!
     // We can also delete the samples to save some mem. Not needed any more.
     if( options.sequence_input.file_count() > 0 ) {
-        auto const list = get_pqueries_per_clade( sample_set );
-        sample_set.clear();
-        extract_sequences( options, list );
+        if( ! options.low_memory ) {
+            name_index = get_pqueries_per_clade( sample_set );
+            sample_set.clear();
+        }
+        sort_pquery_names( name_index );
+        extract_sequences( options, name_index );
     }
 }
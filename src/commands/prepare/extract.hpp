@@ -51,6 +51,7 @@ public:
     FileOutputOptions    sequence_output;
 
     double threshold = 0.95;
+    bool   low_memory = false;
 
     // Options that do not have a command line, but might get one
     std::string basal_clade_name = "basal_branches";
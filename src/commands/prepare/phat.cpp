@@ -22,17 +22,17 @@
 */
 
 #include "commands/prepare/phat.hpp"
+#include "commands/prepare/phat_counts.hpp"
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/parallel_chunks.hpp"
+#include "tools/taxopath_cache.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/sequence/counts.hpp"
 #include "genesis/sequence/formats/fasta_input_iterator.hpp"
 #include "genesis/sequence/formats/fasta_writer.hpp"
-#include "genesis/sequence/functions/consensus.hpp"
-#include "genesis/sequence/functions/entropy.hpp"
 #include "genesis/sequence/functions/labels.hpp"
 #include "genesis/sequence/sequence_set.hpp"
 #include "genesis/sequence/sequence.hpp"
@@ -49,6 +49,7 @@
 #include "genesis/taxonomy/taxonomy.hpp"
 #include "genesis/taxonomy/taxopath.hpp"
 
+#include "genesis/utils/core/options.hpp"
 #include "genesis/utils/core/std.hpp"
 #include "genesis/utils/io/input_source.hpp"
 #include "genesis/utils/io/output_stream.hpp"
@@ -58,9 +59,15 @@
 #   include <omp.h>
 #endif
 
+#include <algorithm>
+#include <array>
 #include <cctype>
-#include <map>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
 
 // =================================================================================================
 //      Typedefs
@@ -238,10 +245,6 @@ genesis::taxonomy::Taxonomy read_taxonomy( PhatOptions const& options )
     // User output.
     LOG_MSG1 << "Reading taxonomy and preparing entropy calculations";
 
-    // Get alignment length.
-    auto it = FastaInputIterator( from_file( options.sequence_file ) );
-    auto const seq_len = it->size();
-
     // Read from file.
     auto tax = Taxonomy();
     TaxonomyReader().read( from_file( options.taxonomy_file ), tax );
@@ -267,17 +270,15 @@ genesis::taxonomy::Taxonomy read_taxonomy( PhatOptions const& options )
         // We need to set data for the selected main sub clade taxon,
         // as this is not done in the preorder iterator that comes next.
         subtaxon->reset_data( EntropyTaxonData::create() );
-        subtaxon->data<EntropyTaxonData>().counts = SiteCounts( "ACGT", seq_len );
     }
 
-    // Create a Sequence Count objeect for each taxon below the pointer.
-    // This might allocate quite a lot of memory!
-    auto add_sequence_counts_to_taxonomy = [&]( Taxon& taxon ){
+    // Create the entropy data for each taxon below the pointer.
+    // The site counts are kept separately, see prepare_site_counts().
+    auto add_entropy_data_to_taxonomy = [&]( Taxon& taxon ){
         taxon.reset_data( EntropyTaxonData::create() );
-        taxon.data<EntropyTaxonData>().counts = SiteCounts( "ACGT", seq_len );
     };
     assert( subtax );
-    preorder_for_each( *subtax, add_sequence_counts_to_taxonomy );
+    preorder_for_each( *subtax, add_entropy_data_to_taxonomy );
 
     // User output.
     LOG_MSG1 << "Taxonomy contains a total of " << total_taxa_count( tax ) << " taxa, "
@@ -293,12 +294,69 @@ genesis::taxonomy::Taxonomy read_taxonomy( PhatOptions const& options )
     return tax;
 }
 
+// =================================================================================================
+//      Prepare Site Counts
+// =================================================================================================
+
+/**
+ * @brief Return the subtaxonomy selected by the user, or the whole taxonomy if none was selected.
+ */
+genesis::taxonomy::Taxonomy& get_subtaxonomy(
+    PhatOptions const& options, genesis::taxonomy::Taxonomy& tax
+) {
+    using namespace genesis::taxonomy;
+
+    if( options.sub_taxopath.empty() ) {
+        return tax;
+    }
+
+    auto const taxopath = TaxopathParser().parse( options.sub_taxopath );
+    auto subtax = find_taxon_by_taxopath( tax, taxopath );
+    if( subtax == nullptr ) {
+        throw std::runtime_error(
+            "Taxon " + options.sub_taxopath + " not found in the taxonomy."
+        );
+    }
+    return *subtax;
+}
+
+PhatTaxonCounts prepare_site_counts( PhatOptions const& options, genesis::taxonomy::Taxonomy& tax )
+{
+    using namespace genesis::sequence;
+    using namespace genesis::utils;
+
+    // Get alignment length.
+    auto it = FastaInputIterator( from_file( options.sequence_file ) );
+    auto const seq_len = it->size();
+
+    // Create a site counts object for each taxon of the subtaxonomy. Their memory is only
+    // allocated once they receive sequences, but this might still be quite a lot!
+    return make_phat_taxon_counts( get_subtaxonomy( options, tax ), seq_len );
+}
+
 // =================================================================================================
 //      Fill Site Counts
 // =================================================================================================
 
-void fill_site_counts( PhatOptions const& options, genesis::taxonomy::Taxonomy& tax )
+/**
+ * @brief Statistics for the user output of fill_site_counts(), collected per chunk of sequences,
+ * so that the counting threads do not need to synchronize for them.
+ */
+struct SiteCountsStats
 {
+    std::array<size_t, 256> char_counts = {{}};
+    size_t no_tax_seqs_count = 0;
+    size_t not_subtax_seqs_count = 0;
+
+    // Exceptions cannot leave an OpenMP region, so we store them, and re-throw them afterwards.
+    std::exception_ptr error;
+};
+
+void fill_site_counts(
+    PhatOptions const& options,
+    genesis::taxonomy::Taxonomy& tax,
+    PhatTaxonCounts& taxon_counts
+) {
     using namespace genesis::sequence;
     using namespace genesis::taxonomy;
     using namespace genesis::utils;
@@ -309,79 +367,165 @@ void fill_site_counts( PhatOptions const& options, genesis::taxonomy::Taxonomy&
     // User output prep. We count how often each char occurs in the sequences,
     // how many sequences weree processed in total, how many of those were not found at all in the
     // taxonomy, and how many were not part of the specified subtaxonomy (if specified at all).
-    std::map<char, size_t> char_counts;
+    // Apart from the total, these are counted per chunk, and summed up at the end.
     size_t total_seqs_count = 0;
-    size_t no_tax_seqs_count = 0;
-    size_t not_subtax_seqs_count = 0;
+    auto const num_chunks = parallel_chunk_count();
+    std::vector<SiteCountsStats> chunk_stats( num_chunks );
 
-    // Prepare helpers.
-    auto taxopath_parser = TaxopathParser();
-    auto fasta_reader = FastaReader();
-    fasta_reader.site_casing( FastaReader::SiteCasing::kToUpper );
+    // The counts of a taxon can be updated by several threads at the same time,
+    // so we need a lock for each taxon that has counts, that is, each taxon of the subtaxonomy.
+    std::vector<std::mutex> taxon_locks( taxon_counts.counts.size() );
 
-    // Iterate sequences.
-    auto it = FastaInputIterator( from_file( options.sequence_file ), fasta_reader );
-    while( it ) {
+    // Reference databases use the same taxo paths for many sequences, so instead of parsing them
+    // and searching the taxonomy each time, we look them up in a cache of all taxo paths.
+    auto const taxopath_cache = TaxopathCache( tax );
 
-        // User output.
-        // If we have verbose output, count characters.
-        for( auto const& s : *it ) {
-            ++char_counts[s];
-        }
-        // Also, output a progress. Could be done nicer in the future.
-        if( total_seqs_count % 100000 == 0 ) {
-            LOG_MSG2 << "At sequence " << total_seqs_count;
+    // Process one sequence: Find its taxon, and add it to the counts of that taxon.
+    // This is called concurrently by the counting threads.
+    auto process_sequence = [&]( Sequence const& sequence, SiteCountsStats& stats ){
+
+        // User output. If we have verbose output, count characters.
+        for( auto const& s : sequence ) {
+            ++stats.char_counts[ static_cast<unsigned char>( s ) ];
         }
-        ++total_seqs_count;
 
         // Get taxo path of the sequence.
         // We offer two versions: the sequence label is just the path, or it starts at the first space.
         std::string taxopath_str;
-        auto const delim = it->label().find_first_of( " \t" );
+        auto const delim = sequence.label().find_first_of( " \t" );
         if( delim == std::string::npos ) {
-            taxopath_str = it->label();
+            taxopath_str = sequence.label();
         } else {
-            taxopath_str = it->label().substr( delim + 1 );
+            taxopath_str = sequence.label().substr( delim + 1 );
         }
 
-        // Parse the taxo path and find it in the taxonomy.
+        // Find the taxo path in the taxonomy.
         // If the first attempt fails, remove the last element (assumed to be species level),
         // and try again. If we fail again, we cannot use this sequence.
-        auto taxopath = taxopath_parser.parse( taxopath_str );
-        auto taxp = find_taxon_by_taxopath( tax, taxopath );
+        auto taxp = taxopath_cache.find( taxopath_str );
         if( taxp == nullptr ) {
-            taxopath.pop_back();
-            taxp = find_taxon_by_taxopath( tax, taxopath );
+            taxp = taxopath_cache.find_without_last( taxopath_str );
         }
         if( taxp == nullptr ) {
-            LOG_MSG3 << "Sequence " << it->label() << " not found in the taxonomy!";
-            ++no_tax_seqs_count;
-            ++it;
-            continue;
+            #pragma omp critical(GAPPA_PHAT_LOG)
+            {
+                LOG_MSG3 << "Sequence " << sequence.label() << " not found in the taxonomy!";
+            }
+            ++stats.no_tax_seqs_count;
+            return;
         }
 
         // Now that we have found the taxon of that sequence, check whether it is part of the
         // specified subtaxonomy. If no subtaxonomy was specified, all are valid.
-        // We do this by testing whether the taxon has data, because read_taxonomy() only sets
-        // data entries for the subtaxonomy.
-        if( ! taxp->has_data() ) {
-            LOG_MSG3 << "Sequence " << it->label() << " not part of the subtaxonomy.";
-            ++not_subtax_seqs_count;
+        // We do this by testing whether the taxon has counts, because prepare_site_counts()
+        // only creates them for the subtaxonomy.
+        auto const index = taxon_counts.index_of( *taxp );
+        if( index == PhatTaxonCounts::npos ) {
+            #pragma omp critical(GAPPA_PHAT_LOG)
+            {
+                LOG_MSG3 << "Sequence " << sequence.label() << " not part of the subtaxonomy.";
+            }
+            ++stats.not_subtax_seqs_count;
+            return;
+        }
+
+        // Only accumulate the counts for the taxon itself. The super-clades get their counts
+        // by summing up their children afterwards.
+        std::lock_guard<std::mutex> lock( taxon_locks[ index ] );
+        taxon_counts.counts[ index ].add_sequence( sequence.sites() );
+    };
+
+    // Prepare the reading. We read the sequences in batches. While one batch is counted by
+    // the threads, the next one is read, so that reading and counting overlap.
+    size_t const batch_size = 1024;
+    auto fasta_reader = FastaReader();
+    fasta_reader.site_casing( FastaReader::SiteCasing::kToUpper );
+    auto it = FastaInputIterator( from_file( options.sequence_file ), fasta_reader );
+    auto read_batch = [&]( std::vector<Sequence>& batch ){
+        batch.clear();
+        while( it && batch.size() < batch_size ) {
+
+            // Output a progress. Could be done nicer in the future. The batch is read while
+            // the threads count the previous one, which also log, so we need to synchronize.
+            if( total_seqs_count % 100000 == 0 ) {
+                #pragma omp critical(GAPPA_PHAT_LOG)
+                {
+                    LOG_MSG2 << "At sequence " << total_seqs_count;
+                }
+            }
+            ++total_seqs_count;
+
+            batch.push_back( *it );
             ++it;
-            continue;
         }
+    };
+
+    // Iterate sequences.
+    std::vector<Sequence> batch;
+    std::vector<Sequence> next_batch;
+    read_batch( batch );
+    while( ! batch.empty() ) {
+        std::exception_ptr read_error;
+
+        #pragma omp parallel
+        {
+            // One thread reads the next batch, and then joins the others for counting.
+            #pragma omp single nowait
+            {
+                try {
+                    read_batch( next_batch );
+                } catch( ... ) {
+                    read_error = std::current_exception();
+                }
+            }
+
+            // The other threads count the current batch, split into chunks of sequences.
+            #pragma omp for schedule(dynamic) nowait
+            for( size_t ci = 0; ci < num_chunks; ++ci ) {
+                auto& stats = chunk_stats[ ci ];
+                auto const first = parallel_chunk_begin( ci,     num_chunks, batch.size() );
+                auto const last  = parallel_chunk_begin( ci + 1, num_chunks, batch.size() );
+                try {
+                    for( size_t si = first; si < last; ++si ) {
+                        process_sequence( batch[ si ], stats );
+                    }
+                } catch( ... ) {
+                    if( ! stats.error ) {
+                        stats.error = std::current_exception();
+                    }
+                }
+            }
+        }
+
+        // Report errors from the threads, and move on to the next batch.
+        if( read_error ) {
+            std::rethrow_exception( read_error );
+        }
+        for( auto const& stats : chunk_stats ) {
+            if( stats.error ) {
+                std::rethrow_exception( stats.error );
+            }
+        }
+        std::swap( batch, next_batch );
+    }
 
-        // Accummulate counts for all taxonomic ranks.
-        // We go up in the taxonomy and add counts to all super-clades as well,
-        // until we reach the super taxon that is not part of the selected sub-clade
-        // (if a sub clade was specified. otherweise, it just goes all the way up).
-        auto cur_tax = taxp;
-        do {
-            cur_tax->data<EntropyTaxonData>().counts.add_sequence( *it );
-            cur_tax = cur_tax->parent();
-        } while( cur_tax != nullptr && cur_tax->has_data() );
-
-        ++it;
+    // Accummulate counts for all taxonomic ranks. We go up in the taxonomy and add the counts
+    // of each taxon to its super-clade, until we reach the taxon of the selected sub-clade
+    // (if a sub clade was specified. otherweise, it just goes all the way up).
+    accumulate_phat_taxon_counts( taxon_counts );
+
+    // Sum up the user output counts of all chunks.
+    std::map<char, size_t> char_counts;
+    size_t no_tax_seqs_count = 0;
+    size_t not_subtax_seqs_count = 0;
+    for( auto const& stats : chunk_stats ) {
+        for( size_t c = 0; c < stats.char_counts.size(); ++c ) {
+            if( stats.char_counts[c] > 0 ) {
+                char_counts[ static_cast<char>( c ) ] += stats.char_counts[c];
+            }
+        }
+        no_tax_seqs_count     += stats.no_tax_seqs_count;
+        not_subtax_seqs_count += stats.not_subtax_seqs_count;
     }
 
     // User output.
@@ -423,9 +567,11 @@ void fill_site_counts( PhatOptions const& options, genesis::taxonomy::Taxonomy&
 //      Calculate Entropy
 // =================================================================================================
 
-void calculate_entropy( PhatOptions const& options, genesis::taxonomy::Taxonomy& tax )
-{
-    using namespace genesis::sequence;
+void calculate_entropy(
+    PhatOptions const& options,
+    genesis::taxonomy::Taxonomy& tax,
+    PhatTaxonCounts const& taxon_counts
+) {
     using namespace genesis::taxonomy;
 
     if( options.no_taxa_selection ) {
@@ -436,21 +582,24 @@ void calculate_entropy( PhatOptions const& options, genesis::taxonomy::Taxonomy&
     // User output.
     LOG_MSG1 << "Calculating entropy.";
 
-    // Set the default options.
-    // auto opt = SiteEntropyOptions::kWeighted;
-    auto opt = SiteEntropyOptions::kIncludeGaps;
+    // Calculate! We use the entropy including gaps, see average_site_entropy().
+    // The taxa are independent of each other, so we can do this in parallel.
+    std::vector<double> entropies( taxon_counts.counts.size() );
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < taxon_counts.counts.size(); ++i ) {
+        entropies[i] = average_site_entropy( taxon_counts.counts[i] );
+    }
 
-    // Calculate! Skip those that do not have data, that is, which are not part of the subtaxonomy.
-    // This is a simple way of testing for the subtaxonomy, instead of finding it again here.
-    auto calc_entropies = [&]( Taxon& t ) {
+    // Store the entropies. Skip those that do not have data, that is, which are not part of the
+    // subtaxonomy. This is a simple way of testing for the subtaxonomy, instead of finding it
+    // again here.
+    auto set_entropies = [&]( Taxon& t ) {
         if( ! t.has_data() ) {
             return;
         }
-
-        auto const& counts = t.data<EntropyTaxonData>().counts;
-        t.data<EntropyTaxonData>().entropy = average_entropy( counts, false, opt );
+        t.data<EntropyTaxonData>().entropy = entropies[ taxon_counts.index_of( t ) ];
     };
-    preorder_for_each( tax, calc_entropies );
+    preorder_for_each( tax, set_entropies );
 }
 
 // =================================================================================================
@@ -465,20 +614,8 @@ void select_taxa( PhatOptions const& options, genesis::taxonomy::Taxonomy& tax )
     // User output.
     LOG_MSG1 << "Selecting taxa based on entropy.";
 
-    // Init a pointer to the whole taxonomy.
-    Taxonomy* subtax = &tax;
-
-    // If the user only wants a sub taxon, overwrite the pointer.
-    if( ! options.sub_taxopath.empty() ) {
-        auto const taxopath = TaxopathParser().parse( options.sub_taxopath );
-        subtax = find_taxon_by_taxopath( tax, taxopath );
-
-        if( subtax == nullptr ) {
-            throw std::runtime_error(
-                "Taxon " + options.sub_taxopath + " not found in the taxonomy."
-            );
-        }
-    }
+    // Get the whole taxonomy, or the sub taxon that the user wants.
+    Taxonomy* subtax = &get_subtaxonomy( options, tax );
 
     if( options.no_taxa_selection ) {
 
@@ -516,27 +653,79 @@ void select_taxa( PhatOptions const& options, genesis::taxonomy::Taxonomy& tax )
 }
 
 // =================================================================================================
-//      Generate Consensus Sequences
+//      Release Site Counts
 // =================================================================================================
 
-void generate_consensus_sequences( PhatOptions const& options, genesis::taxonomy::Taxonomy const& tax )
+void release_site_counts( PhatTaxonCounts& taxon_counts )
 {
+    using namespace genesis::taxonomy;
+
+    // Only the counts of the selected taxa are needed for the consensus sequences.
+    // The number of sequences of the other taxa is kept for write_info_files().
+    for( size_t i = 0; i < taxon_counts.counts.size(); ++i ) {
+        auto const& data = taxon_counts.taxa[i]->data<EntropyTaxonData>();
+        if( data.status != EntropyTaxonData::PruneStatus::kBorder ) {
+            taxon_counts.counts[i].release_sites();
+        }
+    }
+}
+
+// =================================================================================================
+//      Generate Consensus Sequences
+// =================================================================================================
+
+void generate_consensus_sequences(
+    PhatOptions const& options,
+    PhatTaxonCounts const& taxon_counts
+) {
     using namespace genesis::sequence;
     using namespace genesis::taxonomy;
 
     // User output.
     LOG_MSG1 << "Generating consensus sequences.";
 
-    // Helper function.
+    // Helper function that writes the sites in lines of 80 characters,
+    // without copying each line into a string of its own first.
     auto write_fasta_sequence = [] (
         std::ostream& out, std::string const& name, std::string const& sites
     ) {
         out << ">" << name << "\n";
-        for (size_t i = 0; i < sites.length(); i += 80) {
-            out << sites.substr(i, 80) << "\n";
+        for( size_t i = 0; i < sites.length(); i += 80 ) {
+            auto const len = std::min<size_t>( 80, sites.length() - i );
+            out.write( sites.data() + i, len );
+            out.put( '\n' );
         }
     };
 
+    // Select the consensus function once, so that we do not need to throw in the parallel region.
+    std::function<std::string( PhatSiteCounts const& )> make_consensus;
+    if( options.consensus_method == "majorities" ) {
+        make_consensus = []( PhatSiteCounts const& counts ){
+            return consensus_with_majorities( counts );
+        };
+    } else if( options.consensus_method == "cavener" ) {
+        make_consensus = []( PhatSiteCounts const& counts ){
+            return consensus_cavener( counts );
+        };
+    } else if( options.consensus_method == "threshold" ) {
+        auto const threshold = options.consensus_threshold;
+        make_consensus = [threshold]( PhatSiteCounts const& counts ){
+            return consensus_with_threshold( counts, threshold );
+        };
+    } else {
+        throw CLI::ConversionError( "Unknown consensus method: " + options.consensus_method );
+    }
+
+    // Collect the border taxa. The taxa of the counts are in preorder, so that the consensus
+    // sequences are written in the same order as when traversing the taxonomy.
+    std::vector<size_t> border_taxa;
+    for( size_t i = 0; i < taxon_counts.taxa.size(); ++i ) {
+        auto const& data = taxon_counts.taxa[i]->data<EntropyTaxonData>();
+        if( data.status == EntropyTaxonData::PruneStatus::kBorder ) {
+            border_taxa.push_back( i );
+        }
+    }
+
     // Prepare output.
     auto cons_target = options.file_output.get_output_target(
          "consensus_sequences", "fasta"
@@ -546,43 +735,43 @@ void generate_consensus_sequences( PhatOptions const& options, genesis::taxonomy
     // Collect taxa that do not have any data
     std::vector<std::string> no_data_taxa;
 
-    // Calculate consensus sequences and write them.
-    auto make_consensus_sequences = [&]( Taxon const& t ) {
-
-        // Skip taxa that are not in the subtaxonomy.
-        if( ! t.has_data() ) {
-            return;
+    // Calculate the consensus sequences in parallel, and write them in order. We process the taxa
+    // in blocks, so that we do not have to keep all consensus sequences in memory at the same time.
+    auto const num_threads = genesis::utils::Options::get().number_of_threads();
+    auto const block_size = 64 * std::max<size_t>( 1, num_threads );
+    std::vector<std::string> block_sites;
+    for( size_t block_begin = 0; block_begin < border_taxa.size(); block_begin += block_size ) {
+        auto const block_end = std::min( block_begin + block_size, border_taxa.size() );
+        block_sites.resize( block_end - block_begin );
+
+        std::exception_ptr error;
+        #pragma omp parallel for schedule(dynamic)
+        for( size_t i = block_begin; i < block_end; ++i ) {
+            try {
+                block_sites[ i - block_begin ] = make_consensus(
+                    taxon_counts.counts[ border_taxa[i] ]
+                );
+            } catch( ... ) {
+                #pragma omp critical(GAPPA_PHAT_CONSENSUS_ERROR)
+                {
+                    error = std::current_exception();
+                }
+            }
         }
-
-        // Only interested in the border taxa.
-        if( t.data<EntropyTaxonData>().status != EntropyTaxonData::PruneStatus::kBorder ) {
-            return;
+        if( error ) {
+            std::rethrow_exception( error );
         }
 
-        // Prep.
-        auto const name = sanitize_label( tax_gen(t) );
-        auto const& counts = t.data<EntropyTaxonData>().counts;
-
-        // Collect taxa with no data. This is reported to the user later.
-        if( counts.added_sequences_count() == 0 ) {
-            no_data_taxa.push_back( name );
-        }
-
-        // Consensus sequence.
-        std::string sites;
-        if( options.consensus_method == "majorities" ) {
-            sites = consensus_sequence_with_majorities( counts );
-        } else if( options.consensus_method == "cavener" ) {
-            sites = consensus_sequence_cavener( counts );
-        } else if( options.consensus_method == "threshold" ) {
-            sites = consensus_sequence_with_threshold( counts, options.consensus_threshold );
-        } else {
-            throw CLI::ConversionError( "Unknown consensus method: " + options.consensus_method );
+        // Write the block, and collect taxa with no data. These are reported to the user later.
+        for( size_t i = block_begin; i < block_end; ++i ) {
+            auto const index = border_taxa[i];
+            auto const name = sanitize_label( tax_gen( *taxon_counts.taxa[ index ] ));
+            if( taxon_counts.counts[ index ].added_sequences_count() == 0 ) {
+                no_data_taxa.push_back( name );
+            }
+            write_fasta_sequence( cons_target->ostream(), name, block_sites[ i - block_begin ] );
         }
-        write_fasta_sequence( cons_target->ostream(), name, sites );
-
-    };
-    preorder_for_each( tax, make_consensus_sequences );
+    }
 
     // User warning for empty taxa
     if( ! no_data_taxa.empty() ) {
@@ -599,8 +788,11 @@ void generate_consensus_sequences( PhatOptions const& options, genesis::taxonomy
 //      Write Taxonomy Info
 // =================================================================================================
 
-void write_info_files( PhatOptions const& options, genesis::taxonomy::Taxonomy const& tax )
-{
+void write_info_files(
+    PhatOptions const& options,
+    genesis::taxonomy::Taxonomy const& tax,
+    PhatTaxonCounts const& taxon_counts
+) {
     using namespace genesis::taxonomy;
 
     if( ! options.write_info_files ) {
@@ -630,7 +822,8 @@ void write_info_files( PhatOptions const& options, genesis::taxonomy::Taxonomy c
         auto const name = gen( t );
         auto const total_chldrn = total_taxa_count( t );
         auto const lowest_chldrn = taxa_count_lowest_levels( t );
-        auto const added_seqs = t.data<EntropyTaxonData>().counts.added_sequences_count();
+        auto const& counts = taxon_counts.counts[ taxon_counts.index_of( t ) ];
+        auto const added_seqs = counts.added_sequences_count();
         auto const entr = t.data<EntropyTaxonData>().entropy;
 
         // Status: was the taxon selected or not.
@@ -686,9 +879,11 @@ void run_phat( PhatOptions const& options )
 
     // Run the whole thing!
     auto taxonomy = read_taxonomy( options );
-    fill_site_counts( options, taxonomy );
-    calculate_entropy( options, taxonomy );
+    auto taxon_counts = prepare_site_counts( options, taxonomy );
+    fill_site_counts( options, taxonomy, taxon_counts );
+    calculate_entropy( options, taxonomy, taxon_counts );
     select_taxa( options, taxonomy );
-    generate_consensus_sequences( options, taxonomy );
-    write_info_files( options, taxonomy );
+    release_site_counts( taxon_counts );
+    generate_consensus_sequences( options, taxon_counts );
+    write_info_files( options, taxonomy, taxon_counts );
 }
@@ -0,0 +1,418 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "commands/prepare/phat_counts.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#ifdef GENESIS_OPENMP
+#   include <omp.h>
+#endif
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Lookup from a character to its index in `ACGT`, with 4 for all other characters.
+ */
+static std::array<unsigned char, 256> make_char_index_lookup()
+{
+    std::array<unsigned char, 256> lookup;
+    lookup.fill( PhatSiteCounts::num_chars );
+    for( size_t i = 0; i < PhatSiteCounts::num_chars; ++i ) {
+        auto const c = PhatSiteCounts::characters()[i];
+        lookup[ static_cast<unsigned char>( c ) ] = static_cast<unsigned char>( i );
+        lookup[ static_cast<unsigned char>( c - 'A' + 'a' ) ] = static_cast<unsigned char>( i );
+    }
+    return lookup;
+}
+
+/**
+ * @brief Nucleic acid ambiguity code for a set of characters, given as bits in `ACGT` order,
+ * that is, `A == 1`, `C == 2`, `G == 4`, and `T == 8`. The empty set yields a gap.
+ */
+static char ambiguity_code( size_t char_bits )
+{
+    assert( char_bits < 16 );
+    return "-ACMGRSVTWYHKDBN"[ char_bits ];
+}
+
+/**
+ * @brief Sort the @p keys of the characters of a site in descending order.
+ *
+ * Each key packs the count of a character and its index as `count << 3 | ( 7 - index )`, so that
+ * characters with the same count keep their order by index. This is an insertion sort, which is
+ * the fastest for the few characters that we have, and does not allocate memory.
+ */
+template<size_t N>
+static void sort_site_keys( std::array<uint64_t, N>& keys )
+{
+    for( size_t i = 1; i < N; ++i ) {
+        auto const key = keys[i];
+        size_t j = i;
+        while( j > 0 && keys[ j - 1 ] < key ) {
+            keys[j] = keys[ j - 1 ];
+            --j;
+        }
+        keys[j] = key;
+    }
+}
+
+static uint64_t site_key( uint64_t count, size_t index )
+{
+    return ( count << 3 ) | ( 7 - index );
+}
+
+static size_t site_key_index( uint64_t key )
+{
+    return 7 - ( key & 7 );
+}
+
+static uint64_t site_key_count( uint64_t key )
+{
+    return key >> 3;
+}
+
+/**
+ * @brief Get the arrays of counts per character, for the kernels below.
+ */
+static std::array<PhatSiteCounts::CountsIntType const*, PhatSiteCounts::num_chars> char_arrays(
+    PhatSiteCounts const& counts
+) {
+    std::array<PhatSiteCounts::CountsIntType const*, PhatSiteCounts::num_chars> result;
+    for( size_t c = 0; c < PhatSiteCounts::num_chars; ++c ) {
+        result[c] = counts.char_counts( c );
+    }
+    return result;
+}
+
+// =================================================================================================
+//      Phat Site Counts
+// =================================================================================================
+
+size_t const PhatSiteCounts::num_chars;
+
+PhatSiteCounts::PhatSiteCounts( size_t length )
+    : length_( length )
+{}
+
+void PhatSiteCounts::add_sequence( std::string const& sites )
+{
+    static auto const lookup = make_char_index_lookup();
+
+    if( sites.size() != length_ ) {
+        throw std::runtime_error(
+            "Cannot add sequence of length " + std::to_string( sites.size() ) +
+            " to site counts of length " + std::to_string( length_ ) + "."
+        );
+    }
+
+    if( counts_.empty() ) {
+        counts_.assign( length_ * num_chars, 0 );
+    }
+    for( size_t s = 0; s < length_; ++s ) {
+        auto const c = lookup[ static_cast<unsigned char>( sites[s] ) ];
+        if( c < num_chars ) {
+            ++counts_[ c * length_ + s ];
+        }
+    }
+    ++num_seqs_;
+}
+
+void PhatSiteCounts::add_counts( PhatSiteCounts const& other )
+{
+    if( other.length_ != length_ ) {
+        throw std::runtime_error( "Cannot add site counts of different lengths." );
+    }
+
+    if( other.counts_.empty() ) {
+        // Nothing to add to the sites.
+    } else if( counts_.empty() ) {
+        counts_ = other.counts_;
+    } else {
+        assert( counts_.size() == other.counts_.size() );
+        auto* const dst = counts_.data();
+        auto const* const src = other.counts_.data();
+        for( size_t i = 0; i < counts_.size(); ++i ) {
+            dst[i] += src[i];
+        }
+    }
+    num_seqs_ += other.num_seqs_;
+}
+
+void PhatSiteCounts::release_sites()
+{
+    // Swap with an empty vector, as clear() does not free the memory.
+    std::vector<CountsIntType>().swap( counts_ );
+}
+
+// =================================================================================================
+//      Phat Taxon Counts
+// =================================================================================================
+
+size_t const PhatTaxonCounts::npos;
+
+PhatTaxonCounts make_phat_taxon_counts(
+    genesis::taxonomy::Taxonomy const& subtaxonomy,
+    size_t length
+) {
+    using namespace genesis::taxonomy;
+
+    PhatTaxonCounts result;
+    std::function<void( Taxon const&, size_t )> add_taxon;
+    add_taxon = [&]( Taxon const& taxon, size_t parent ){
+        auto const index = result.taxa.size();
+        result.taxon_indices[ &taxon ] = index;
+        result.taxa.push_back( &taxon );
+        result.parents.push_back( parent );
+        result.counts.emplace_back( length );
+
+        for( size_t i = 0; i < taxon.size(); ++i ) {
+            add_taxon( taxon.at( i ), index );
+        }
+    };
+
+    // If the subtaxonomy is a taxon, it is part of the counts. If it is the whole taxonomy,
+    // its top level taxa are.
+    auto const top_taxon = dynamic_cast<Taxon const*>( &subtaxonomy );
+    if( top_taxon ) {
+        add_taxon( *top_taxon, PhatTaxonCounts::npos );
+    } else {
+        for( size_t i = 0; i < subtaxonomy.size(); ++i ) {
+            add_taxon( subtaxonomy.at( i ), PhatTaxonCounts::npos );
+        }
+    }
+    return result;
+}
+
+void accumulate_phat_taxon_counts( PhatTaxonCounts& taxon_counts )
+{
+    auto const& parents = taxon_counts.parents;
+    auto const size = parents.size();
+
+    // Get the children of each taxon, and group the taxa by their depth. As the taxa are indexed
+    // in preorder, the parent of a taxon is already processed when we get to the taxon.
+    std::vector<std::vector<size_t>> children( size );
+    std::vector<std::vector<size_t>> levels;
+    std::vector<size_t> depths( size, 0 );
+    for( size_t i = 0; i < size; ++i ) {
+        if( parents[i] != PhatTaxonCounts::npos ) {
+            assert( parents[i] < i );
+            children[ parents[i] ].push_back( i );
+            depths[i] = depths[ parents[i] ] + 1;
+        }
+        if( levels.size() <= depths[i] ) {
+            levels.resize( depths[i] + 1 );
+        }
+        levels[ depths[i] ].push_back( i );
+    }
+
+    // Go up the taxonomy level by level, and add the counts of the children to each taxon.
+    // The taxa of one level have disjoint sets of children, whose counts are already complete,
+    // as their level has been processed before. Hence, we can process each level in parallel.
+    for( size_t l = levels.size(); l > 0; --l ) {
+        auto const& level = levels[ l - 1 ];
+
+        #pragma omp parallel for schedule(dynamic)
+        for( size_t i = 0; i < level.size(); ++i ) {
+            auto& counts = taxon_counts.counts[ level[i] ];
+            for( auto const child : children[ level[i] ] ) {
+                counts.add_counts( taxon_counts.counts[ child ] );
+            }
+        }
+    }
+}
+
+// =================================================================================================
+//      Entropy and Consensus
+// =================================================================================================
+
+double average_site_entropy( PhatSiteCounts const& counts )
+{
+    auto const num_seqs = counts.added_sequences_count();
+    if( counts.length() == 0 || num_seqs == 0 || ! counts.has_sites() ) {
+        return 0.0;
+    }
+
+    // Table of the values n log2(n), with 0 log2(0) = 0, for all possible counts at a site.
+    std::vector<double> xlogx( num_seqs + 1, 0.0 );
+    for( size_t n = 1; n <= num_seqs; ++n ) {
+        xlogx[n] = static_cast<double>( n ) * std::log2( static_cast<double>( n ));
+    }
+
+    // Sum up the table values of all characters and the gaps at all sites.
+    auto const chars = char_arrays( counts );
+    double sum = 0.0;
+    for( size_t s = 0; s < counts.length(); ++s ) {
+        size_t gaps = num_seqs;
+        for( size_t c = 0; c < PhatSiteCounts::num_chars; ++c ) {
+            gaps -= chars[c][s];
+            sum  += xlogx[ chars[c][s] ];
+        }
+        assert( gaps <= num_seqs );
+        sum += xlogx[ gaps ];
+    }
+
+    // The average of log2(N) - sum / N over all sites.
+    auto const n = static_cast<double>( num_seqs );
+    return std::log2( n ) - sum / ( n * static_cast<double>( counts.length() ));
+}
+
+std::string consensus_with_majorities( PhatSiteCounts const& counts )
+{
+    std::string result( counts.length(), '-' );
+    if( ! counts.has_sites() ) {
+        return result;
+    }
+
+    auto const chars = char_arrays( counts );
+    auto const num_seqs = counts.added_sequences_count();
+    for( size_t s = 0; s < counts.length(); ++s ) {
+
+        // Find the most frequent character. Using strict comparison yields the first one
+        // in case of ties.
+        size_t max_pos = 0;
+        size_t max_val = chars[0][s];
+        size_t sum     = chars[0][s];
+        for( size_t c = 1; c < PhatSiteCounts::num_chars; ++c ) {
+            size_t const val = chars[c][s];
+            bool const greater = val > max_val;
+            max_pos = greater ? c : max_pos;
+            max_val = greater ? val : max_val;
+            sum += val;
+        }
+
+        auto const gaps = num_seqs - sum;
+        if( max_val > 0 && gaps <= max_val ) {
+            result[s] = PhatSiteCounts::characters()[ max_pos ];
+        }
+    }
+    return result;
+}
+
+std::string consensus_with_threshold( PhatSiteCounts const& counts, double threshold )
+{
+    if( threshold < 0.0 || threshold > 1.0 ) {
+        throw std::invalid_argument( "Consensus threshold has to be in [ 0.0, 1.0 ]." );
+    }
+
+    std::string result( counts.length(), '-' );
+    if( ! counts.has_sites() ) {
+        return result;
+    }
+
+    auto const chars = char_arrays( counts );
+    auto const num_seqs = counts.added_sequences_count();
+    auto const seqs_count = static_cast<double>( num_seqs );
+    auto const gap_index = PhatSiteCounts::num_chars;
+    for( size_t s = 0; s < counts.length(); ++s ) {
+
+        // Sort the characters and the gap by frequency. Characters with the same count keep
+        // their order, with the gap last among them.
+        std::array<uint64_t, PhatSiteCounts::num_chars + 1> keys;
+        size_t sum = 0;
+        for( size_t c = 0; c < PhatSiteCounts::num_chars; ++c ) {
+            keys[c] = site_key( chars[c][s], c );
+            sum += chars[c][s];
+        }
+        keys[ gap_index ] = site_key( num_seqs - sum, gap_index );
+        sort_site_keys( keys );
+
+        // If the gaps are the most frequent, or if there are no characters at all, use a gap.
+        if( site_key_index( keys[0] ) == gap_index || site_key_count( keys[0] ) == 0 ) {
+            continue;
+        }
+
+        // Add characters until their frequency reaches the threshold. The gaps count towards the
+        // frequency, but are not part of the ambiguity code.
+        size_t char_bits = 0;
+        size_t accumulated = 0;
+        for( auto const key : keys ) {
+            auto const c = site_key_index( key );
+            if( c != gap_index ) {
+                char_bits |= ( 1u << c );
+            }
+            accumulated += site_key_count( key );
+            if( static_cast<double>( accumulated ) / seqs_count >= threshold ) {
+                break;
+            }
+        }
+        result[s] = ambiguity_code( char_bits );
+    }
+    return result;
+}
+
+std::string consensus_cavener( PhatSiteCounts const& counts )
+{
+    std::string result( counts.length(), '-' );
+    if( ! counts.has_sites() ) {
+        return result;
+    }
+
+    auto const chars = char_arrays( counts );
+    auto const num_seqs = static_cast<double>( counts.added_sequences_count() );
+    for( size_t s = 0; s < counts.length(); ++s ) {
+
+        // Sort the characters by frequency, and get the frequencies, including the gaps.
+        std::array<uint64_t, PhatSiteCounts::num_chars> keys;
+        size_t sum = 0;
+        size_t char_bits = 0;
+        for( size_t c = 0; c < PhatSiteCounts::num_chars; ++c ) {
+            keys[c] = site_key( chars[c][s], c );
+            sum += chars[c][s];
+            char_bits |= ( chars[c][s] > 0 ? 1u : 0u ) << c;
+        }
+        sort_site_keys( keys );
+        std::array<double, PhatSiteCounts::num_chars> freqs;
+        for( size_t i = 0; i < PhatSiteCounts::num_chars; ++i ) {
+            freqs[i] = static_cast<double>( site_key_count( keys[i] )) / num_seqs;
+        }
+        auto const gap_freq = ( num_seqs - static_cast<double>( sum )) / num_seqs;
+
+        // No characters at all, or mostly gaps.
+        if( sum == 0 || ( gap_freq > 0.5 && gap_freq > 2.0 * freqs[0] )) {
+            continue;
+        }
+
+        // Rules (a) to (d) by Cavener. For rule (c), we use the code of all characters that
+        // occur. Usually, these are three, but with many gaps, rule (b) can also fail for two.
+        auto const first  = site_key_index( keys[0] );
+        auto const second = site_key_index( keys[1] );
+        if( freqs[0] > 0.5 && freqs[0] > 2.0 * freqs[1] ) {
+            result[s] = PhatSiteCounts::characters()[ first ];
+        } else if( freqs[0] + freqs[1] > 0.75 ) {
+            result[s] = ambiguity_code(( 1u << first ) | ( 1u << second ));
+        } else if( freqs[3] == 0.0 ) {
+            result[s] = ambiguity_code( char_bits );
+        } else {
+            result[s] = 'N';
+        }
+    }
+    return result;
+}
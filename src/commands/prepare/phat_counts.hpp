@@ -0,0 +1,272 @@
+#ifndef GAPPA_COMMANDS_PREPARE_PHAT_COUNTS_H_
+#define GAPPA_COMMANDS_PREPARE_PHAT_COUNTS_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "genesis/taxonomy/taxon.hpp"
+#include "genesis/taxonomy/taxonomy.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// =================================================================================================
+//      Phat Site Counts
+// =================================================================================================
+
+/**
+ * @brief Counts of the nucleotides `ACGT` at each site of a set of aligned sequences.
+ *
+ * This is the equivalent of the genesis SiteCounts for the characters `ACGT`, which additionally
+ * allows to add the counts of another instance, so that the counts of a taxon can be obtained by
+ * summing up the counts of its children. All other characters are not counted, and hence
+ * are treated as gaps.
+ *
+ * The counts are stored with 32 bit per value, as one contiguous array per character, so that the
+ * entropy and consensus functions can process the sites in simple loops over these arrays.
+ * The memory for the counts is only allocated once a sequence or non-empty counts are added,
+ * so that taxa without any sequences do not need memory for their sites.
+ */
+class PhatSiteCounts
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Typedefs and Constants
+    // -------------------------------------------------------------------------
+
+    using CountsIntType = uint32_t;
+
+    static size_t const num_chars = 4;
+
+    /**
+     * @brief The characters that are counted, in the order of their character index.
+     */
+    static char const* characters()
+    {
+        return "ACGT";
+    }
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    PhatSiteCounts() = default;
+
+    /**
+     * @brief Create counts for sequences of the given @p length.
+     *
+     * The counts are all zero, and no memory is allocated for them yet.
+     */
+    explicit PhatSiteCounts( size_t length );
+
+    ~PhatSiteCounts() = default;
+
+    PhatSiteCounts( PhatSiteCounts const& other ) = default;
+    PhatSiteCounts( PhatSiteCounts&& )            = default;
+
+    PhatSiteCounts& operator= ( PhatSiteCounts const& other ) = default;
+    PhatSiteCounts& operator= ( PhatSiteCounts&& )            = default;
+
+    // -------------------------------------------------------------------------
+    //     Accessors
+    // -------------------------------------------------------------------------
+
+    size_t length() const
+    {
+        return length_;
+    }
+
+    size_t added_sequences_count() const
+    {
+        return num_seqs_;
+    }
+
+    /**
+     * @brief Return whether memory for the counts of the sites is allocated.
+     *
+     * If not, all counts are zero.
+     */
+    bool has_sites() const
+    {
+        return ! counts_.empty();
+    }
+
+    /**
+     * @brief Return the count of the character with index @p char_index at site @p site_index.
+     */
+    CountsIntType count_at( size_t char_index, size_t site_index ) const
+    {
+        return counts_.empty() ? 0 : counts_[ char_index * length_ + site_index ];
+    }
+
+    /**
+     * @brief Return the counts of the character with index @p char_index at all sites,
+     * as a contiguous array of length() many values, or `nullptr` if has_sites() is `false`.
+     */
+    CountsIntType const* char_counts( size_t char_index ) const
+    {
+        return counts_.empty() ? nullptr : counts_.data() + char_index * length_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Modifiers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Add the sites of a sequence to the counts.
+     *
+     * The @p sites need to have the same length as the counts.
+     */
+    void add_sequence( std::string const& sites );
+
+    /**
+     * @brief Add the counts of @p other, which needs to have the same length.
+     */
+    void add_counts( PhatSiteCounts const& other );
+
+    /**
+     * @brief Release the memory of the counts of the sites, which are all zero afterwards.
+     *
+     * The added_sequences_count() is kept, so that it can still be reported.
+     */
+    void release_sites();
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    size_t length_   = 0;
+    size_t num_seqs_ = 0;
+
+    // Counts, with one contiguous array of length_ values per character, or empty if nothing
+    // has been counted yet.
+    std::vector<CountsIntType> counts_;
+
+};
+
+// =================================================================================================
+//      Phat Taxon Counts
+// =================================================================================================
+
+/**
+ * @brief Site counts of all taxa of a (sub)taxonomy.
+ *
+ * The taxa are indexed in preorder, so that the parent of a taxon always has a smaller index than
+ * the taxon itself. For each taxon, we keep the index of its parent, so that the counts can be
+ * summed up towards the root without touching the Taxonomy.
+ */
+struct PhatTaxonCounts
+{
+    static size_t const npos = static_cast<size_t>( -1 );
+
+    /**
+     * @brief Return the index of a taxon, or `npos` if the taxon is not part of the counts.
+     */
+    size_t index_of( genesis::taxonomy::Taxon const& taxon ) const
+    {
+        auto const it = taxon_indices.find( &taxon );
+        return it == taxon_indices.end() ? npos : it->second;
+    }
+
+    std::unordered_map<genesis::taxonomy::Taxon const*, size_t> taxon_indices;
+    std::vector<genesis::taxonomy::Taxon const*> taxa;
+
+    /**
+     * @brief Index of the parent of each taxon, or `npos` for the top taxon of the counts.
+     */
+    std::vector<size_t> parents;
+
+    std::vector<PhatSiteCounts> counts;
+};
+
+/**
+ * @brief Create empty counts for the @p subtaxonomy and all taxa below, for sequences of the
+ * given @p length.
+ */
+PhatTaxonCounts make_phat_taxon_counts(
+    genesis::taxonomy::Taxonomy const& subtaxonomy,
+    size_t length
+);
+
+/**
+ * @brief Add the counts of each taxon to its parent, in postorder, so that afterwards, each taxon
+ * contains the counts of all sequences of its clade.
+ *
+ * Before, each taxon is expected to only contain the counts of the sequences that were directly
+ * assigned to it. The taxa of each level are processed in parallel.
+ */
+void accumulate_phat_taxon_counts( PhatTaxonCounts& taxon_counts );
+
+// =================================================================================================
+//      Entropy and Consensus
+// =================================================================================================
+
+/**
+ * @brief Return the average entropy of the sites of the @p counts, including gaps.
+ *
+ * This is the same as the genesis `average_entropy()` with `SiteEntropyOptions::kIncludeGaps`,
+ * that is, the gaps at a site are treated as an additional character. Instead of computing the
+ * logarithm of each probability, we use that the entropy of a site with `N` sequences and counts
+ * `n_i` is `log2(N) - sum_i n_i log2(n_i) / N`, and look up the values `n log2(n)` in a table.
+ */
+double average_site_entropy( PhatSiteCounts const& counts );
+
+/**
+ * @brief Consensus sequence that uses the most frequent character at each site.
+ *
+ * Ties between characters are resolved in favour of the first character in `ACGT` order.
+ * A gap is used if there are more gaps than the most frequent character at a site,
+ * or if the site does not contain any characters.
+ */
+std::string consensus_with_majorities( PhatSiteCounts const& counts );
+
+/**
+ * @brief Consensus sequence that uses the ambiguity code of the most frequent characters
+ * whose summed frequency reaches the @p threshold.
+ *
+ * The gaps at a site are treated as an additional character: A gap is used if there are more gaps
+ * than each of the characters. Otherwise, the gaps count towards the threshold, but are not part
+ * of the ambiguity code.
+ */
+std::string consensus_with_threshold( PhatSiteCounts const& counts, double threshold );
+
+/**
+ * @brief Consensus sequence following the rules of Cavener (1987).
+ *
+ * Frequencies are relative to the number of sequences, so that gaps are treated as an additional
+ * character: A gap is used if it is more frequent than 50% and twice as frequent as the most
+ * frequent character. Otherwise, with the characters sorted by frequency,
+ * a single character is used if it is more frequent than 50% and twice as frequent as the
+ * second; the ambiguity code of the first two is used if they are together more frequent
+ * than 75%; the ambiguity code of the characters that occur is used if one of them does not
+ * occur at all; and `N` is used otherwise.
+ */
+std::string consensus_cavener( PhatSiteCounts const& counts );
+
+#endif // include guard
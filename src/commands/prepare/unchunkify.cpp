@@ -25,11 +25,11 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
 
 #include "CLI/CLI.hpp"
 
 #include "genesis/placement/formats/jplace_reader.hpp"
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/sample.hpp"
 
 #include "genesis/sequence/sequence.hpp"
@@ -609,7 +609,7 @@ void run_unchunkify_with_hash( UnchunkifyOptions const& options )
     // -----------------------------------------------------------
 
     // Writer for samples
-    auto const jplace_writer = JplaceWriter();
+    auto const jplace_writer = ParallelJplaceWriter();
 
     // Make a cache for storing the jplace chunk files.
     // We load a file given its path. This makes it flexible for the different
@@ -721,10 +721,7 @@ void run_unchunkify_with_hash( UnchunkifyOptions const& options )
         }
 
         // We are done with the map/sample. Write it.
-        jplace_writer.write(
-            sample,
-            options.file_output.get_output_target( sample_name, "jplace" )
-        );
+        jplace_writer.write( sample, options.file_output, sample_name );
     }
 
     LOG_MSG1 << "Wrote " << total_seqs_count << " sequences to sample files.";
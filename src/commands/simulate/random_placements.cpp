@@ -25,11 +25,11 @@
 
 #include "options/global.hpp"
 #include "tools/cli_setup.hpp"
+#include "tools/jplace_writer.hpp"
 #include "tools/misc.hpp"
 
 #include "CLI/CLI.hpp"
 
-#include "genesis/placement/formats/jplace_writer.hpp"
 #include "genesis/placement/function/operators.hpp"
 #include "genesis/placement/sample.hpp"
 #include "genesis/placement/simulator/distributions.hpp"
@@ -193,8 +193,5 @@ void run_random_placements( RandomPlacementsOptions const& options )
     sim.generate( sample, options.num_pqueries );
 
     // Write result file.
-    JplaceWriter().write(
-        sample,
-        options.file_output.get_output_target( "random-placements", "jplace" )
-    );
+    ParallelJplaceWriter().write( sample, options.file_output, "random-placements" );
 }
@@ -49,6 +49,9 @@ void GlobalOptions::initialize( int const argc, char const* const* argv )
     // Set number of threads for genesis.
     genesis::utils::Options::get().number_of_threads( opt_threads_ );
 
+    // Also tell genesis the command line, so that it can be stored in output files.
+    genesis::utils::Options::get().command_line( argc, argv );
+
     // Set verbosity to max, just in case.
     genesis::utils::Logging::max_level( genesis::utils::Logging::LoggingLevel::kDebug4 );
 
@@ -24,18 +24,34 @@
 #include "options/jplace_input.hpp"
 
 #include "options/global.hpp"
+#include "tools/jplace_scanner.hpp"
 
+#include "genesis/placement/formats/newick_reader.hpp"
+#include "genesis/placement/formats/newick_writer.hpp"
 #include "genesis/placement/function/epca.hpp"
 #include "genesis/placement/function/functions.hpp"
+#include "genesis/placement/function/helper.hpp"
 #include "genesis/placement/function/masses.hpp"
 #include "genesis/placement/function/operators.hpp"
 #include "genesis/tree/mass_tree/functions.hpp"
+#include "genesis/utils/core/exception.hpp"
 #include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/options.hpp"
 #include "genesis/utils/io/input_source.hpp"
 #include "genesis/utils/text/string.hpp"
 
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <stdexcept>
+#include <unordered_map>
+
+#include <sys/stat.h>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -122,17 +138,74 @@ CLI::Option* JplaceInputOptions::add_mass_norm_opt_to_app( CLI::App* sub, bool r
     return mass_norm_option;
 }
 
+CLI::Option* JplaceInputOptions::add_profile_file_opt_to_app( CLI::App* sub )
+{
+    // Correct setup check.
+    if( profile_file_option != nullptr ) {
+        throw std::domain_error( "Cannot set up --profile-file option multiple times." );
+    }
+
+    profile_file_option = sub->add_option(
+        "--profile-file",
+        profile_file_,
+        "Binary file to store the per-sample edge masses and imbalances in, instead of keeping "
+        "them in memory. The file is memory-mapped, which allows to process more samples than "
+        "fit into main memory. The file also serves as a cache: If it already contains a profile "
+        "of the same input files (with unchanged sizes and modification times) and the same "
+        "settings, for example from a previous run of this or another command, it is re-used "
+        "instead of reading the jplace files again."
+    )->group( "Settings" );
+
+    profile_precision_option = sub->add_option(
+        "--profile-precision",
+        profile_precision_,
+        "Floating point precision of the values in the `--profile-file`. Using `float` halves "
+        "the file size, at the cost of precision.",
+        true
+    )->group( "Settings" )
+    ->transform(CLI::IsMember({ "double", "float" }, CLI::ignore_case))
+    ->needs( profile_file_option );
+
+    return profile_file_option;
+}
+
 // =================================================================================================
 //      Run Functions
 // =================================================================================================
 
 genesis::placement::Sample JplaceInputOptions::sample( size_t index ) const
 {
+    std::shared_ptr<genesis::placement::PlacementTree const> tree;
+    return sample( index, tree );
+}
+
+genesis::placement::Sample JplaceInputOptions::sample(
+    size_t index,
+    std::shared_ptr<genesis::placement::PlacementTree const>& tree
+) const {
     using namespace genesis;
     using namespace genesis::placement;
 
-    // Do the reading.
-    auto sample = reader_.read( utils::from_file( file_path( index ) ));
+    // Do the reading. We scan the file, and only parse its tree if we have not seen it before.
+    // Jplace version 1 uses a different way of specifying edge nums in the tree,
+    // so for those old files, we fall back to the genesis reader. The same applies if the reader
+    // settings were customized, as the scanner does not support them.
+    Sample sample;
+    auto const read_sample = [&](){
+        sample = reader_.read( utils::from_file( file_path( index ) ));
+        tree = std::make_shared<PlacementTree const>( sample.tree() );
+    };
+    if( custom_reader_ ) {
+        read_sample();
+    } else {
+        auto const scan = JplaceScanner().scan( utils::from_file( file_path( index ) ));
+        if( scan.version == 1 ) {
+            read_sample();
+        } else {
+            tree = interned_tree_( scan.tree );
+            sample = jplace_scan_to_sample( scan, *tree );
+        }
+    }
 
     // Point mass: remove all but the most likely placement, and set its weight to one.
     if( point_mass_option && point_mass_ ) {
@@ -170,6 +243,119 @@ genesis::placement::Sample JplaceInputOptions::sample( size_t index ) const
     return sample;
 }
 
+std::vector<double> JplaceInputOptions::edge_masses(
+    size_t index,
+    std::shared_ptr<genesis::placement::PlacementTree const>& tree
+) const {
+    using namespace genesis;
+    using namespace genesis::placement;
+
+    // Old files, and all files with custom reader settings, are read via the genesis reader
+    // anyway, so we can just use the sample.
+    if( custom_reader_ ) {
+        return placement_mass_per_edges_with_multiplicities( sample( index, tree ));
+    }
+    auto const scan = JplaceScanner().store_names( false ).scan(
+        utils::from_file( file_path( index ))
+    );
+    if( scan.version == 1 ) {
+        return placement_mass_per_edges_with_multiplicities( sample( index, tree ));
+    }
+    tree = interned_tree_( scan.tree );
+
+    // Get the fields that we need.
+    auto const edge_num_idx = scan.field_index( "edge_num" );
+    auto const lwr_idx      = scan.field_index( "like_weight_ratio" );
+    if( scan.placement_count() > 0 && (
+        edge_num_idx == JplaceScan::npos || lwr_idx == JplaceScan::npos
+    )) {
+        throw std::runtime_error(
+            "Invalid jplace file " + file_path( index ) +
+            ": Fields edge_num and like_weight_ratio are needed."
+        );
+    }
+
+    // Accumulate the masses, applying the same per-pquery settings as sample().
+    bool const point_mass = point_mass_option && point_mass_;
+    bool const ignore_mult = ignore_multiplicities_option && ignore_multiplicities_;
+    auto const edge_map = edge_num_to_index_map( *tree );
+    auto result = std::vector<double>( tree->edge_count(), 0.0 );
+    for( size_t pqi = 0; pqi < scan.pquery_count(); ++pqi ) {
+        auto const first = scan.placement_offsets[ pqi ];
+        auto const last  = scan.placement_offsets[ pqi + 1 ];
+        if( first == last ) {
+            continue;
+        }
+
+        // Ignoring multiplicities means dividing them by their total, as in sample().
+        auto mult = scan.total_multiplicity( pqi );
+        if( ignore_mult ) {
+            mult /= mult;
+        }
+
+        // Point mass keeps the most likely placement only, with a weight of one.
+        size_t max_pi = first;
+        if( point_mass ) {
+            for( size_t pi = first + 1; pi < last; ++pi ) {
+                if( scan.value( pi, lwr_idx ) > scan.value( max_pi, lwr_idx )) {
+                    max_pi = pi;
+                }
+            }
+        }
+
+        for( size_t pi = first; pi < last; ++pi ) {
+            if( point_mass && pi != max_pi ) {
+                continue;
+            }
+            auto const edge_num = scan.value( pi, edge_num_idx );
+            auto const edge_idx = jplace_edge_index( edge_num, edge_map );
+            if( edge_idx == JplaceScan::npos ) {
+                throw std::runtime_error(
+                    "Invalid jplace file " + file_path( index ) +
+                    ": Placement with invalid edge_num " + std::to_string( edge_num ) + "."
+                );
+            }
+            auto const lwr = point_mass ? 1.0 : scan.value( pi, lwr_idx );
+            result[ edge_idx ] += lwr * mult;
+        }
+    }
+
+    // Relative masses: normalize by the total, which is the same as normalizing the multiplicities.
+    // Samples without any mass keep their zeros, as in sample(), where there is nothing to divide.
+    if( mass_norm_option && mass_norm_relative() ) {
+        double total = 0.0;
+        for( auto const v : result ) {
+            total += v;
+        }
+        if( total > 0.0 ) {
+            for( auto& v : result ) {
+                v /= total;
+            }
+        }
+    }
+
+    return result;
+}
+
+JplaceScan JplaceInputOptions::scan(
+    size_t index,
+    std::shared_ptr<genesis::placement::PlacementTree const>& tree
+) const {
+    using namespace genesis;
+
+    if( custom_reader_ ) {
+        tree.reset();
+        return JplaceScan();
+    }
+    auto result = JplaceScanner().scan( utils::from_file( file_path( index )));
+    if( result.version == 1 ) {
+        tree.reset();
+    } else {
+        tree = interned_tree_( result.tree );
+    }
+    return result;
+}
+
 genesis::placement::SampleSet JplaceInputOptions::sample_set() const
 {
     using namespace genesis;
@@ -212,6 +398,326 @@ genesis::placement::SampleSet JplaceInputOptions::sample_set() const
     return set;
 }
 
+// =================================================================================================
+//      Profile File
+// =================================================================================================
+
+/**
+ * @brief Header of the binary profile file.
+ *
+ * The file consists of this header, followed by the reference tree as a newick string (with
+ * edge nums), the key of the profile (see profile_file_key()), the edge masses matrix, and,
+ * if present, the edge imbalances matrix. The matrices are stored row-major in native byte order,
+ * and start at page boundaries.
+ *
+ * The columns of the matrices correspond to the edge indices of the tree that is obtained by
+ * reading the stored newick string, which might differ from the edge indices of the tree in the
+ * jplace files. This way, re-using the file later yields a tree that fits the matrices.
+ */
+struct ProfileFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint8_t  value_type;
+    uint8_t  has_imbalances;
+    uint8_t  imbalances_normalized;
+    uint8_t  complete;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t tree_offset;
+    uint64_t tree_size;
+    uint64_t key_offset;
+    uint64_t key_size;
+    uint64_t masses_offset;
+    uint64_t imbalances_offset;
+};
+
+static char const     profile_file_magic_[8]  = { 'G', 'A', 'P', 'P', 'A', 'P', 'R', 'F' };
+static uint32_t const profile_file_version_    = 2;
+static uint32_t const profile_file_byte_order_ = 0x01020304;
+static size_t const   profile_file_alignment_  = 4096;
+
+static size_t profile_file_align( size_t offset )
+{
+    return ( offset + profile_file_alignment_ - 1 ) / profile_file_alignment_ * profile_file_alignment_;
+}
+
+static genesis::tree::Tree profile_file_read_tree( std::string const& newick )
+{
+    using namespace genesis;
+    return placement::PlacementTreeNewickReader().read( utils::from_string( newick ));
+}
+
+/**
+ * @brief Get the key that identifies the content of a profile file.
+ *
+ * The profile only depends on the input files and on the settings that change how samples are read.
+ * We hence use the settings, and the absolute path, size, and modification time of each input
+ * file as the key. If any of that changes, the file needs to be computed again.
+ */
+static std::string profile_file_key(
+    std::vector<std::string> const& paths,
+    bool point_mass,
+    bool ignore_multiplicities,
+    std::string const& mass_norm
+) {
+    std::ostringstream key;
+    key << "point-mass\t" << point_mass << "\n";
+    key << "ignore-multiplicities\t" << ignore_multiplicities << "\n";
+    key << "mass-norm\t" << mass_norm << "\n";
+
+    for( auto const& path : paths ) {
+        struct stat st;
+        if( ::stat( path.c_str(), &st ) != 0 ) {
+            throw std::runtime_error( "Cannot access input file " + path );
+        }
+
+        // Use the absolute path if possible, so that the key does not depend on the working dir.
+        std::string abs_path = path;
+        char* resolved = ::realpath( path.c_str(), nullptr );
+        if( resolved ) {
+            abs_path = resolved;
+            std::free( resolved );
+        }
+
+        key << "file\t" << abs_path << "\t" << st.st_size << "\t" << st.st_mtime << "\n";
+    }
+    return key.str();
+}
+
+/**
+ * @brief Try to use an existing profile file. Return whether that worked.
+ *
+ * If the file does not exist, or is a profile file that does not fit the current input, we return
+ * `false`, so that the profile is computed (and written to the file) again. Other existing files
+ * are only overwritten if the user allowed that.
+ */
+static bool read_profile_file(
+    std::string const& path,
+    size_t rows,
+    std::string const& key,
+    bool with_imbalances,
+    bool imbal_norm,
+    JplaceInputOptions::PlacementProfile& result
+) {
+    using namespace genesis;
+
+    if( ! utils::file_exists( path ) ) {
+        return false;
+    }
+
+    // Helper to decide what to do with files that we cannot use.
+    auto const is_profile = []( char const* data, size_t size ){
+        return size >= sizeof( ProfileFileHeader ) &&
+            std::memcmp( data, profile_file_magic_, sizeof( profile_file_magic_ )) == 0
+        ;
+    };
+    auto const reject = [&]( bool profile, std::string const& reason ){
+        if( ! profile && ! utils::Options::get().allow_file_overwriting() ) {
+            throw utils::ExistingFileError(
+                "Profile file already exists and is not a gappa profile: " + path +
+                "\nUse " + allow_file_overwriting_flag + " to allow gappa to overwrite the file.",
+                path
+            );
+        }
+        LOG_WARN << "Warning: Profile file " << path << " cannot be used (" << reason
+                 << "), and will be overwritten.";
+        return false;
+    };
+
+    // Empty files cannot be mapped. We treat them like any other foreign file.
+    if( utils::file_size( path ) < sizeof( ProfileFileHeader )) {
+        return reject( false, "too small" );
+    }
+
+    auto const file = MappedFile::open( path );
+    if( ! is_profile( file->data(), file->size() )) {
+        return reject( false, "not a profile file" );
+    }
+    ProfileFileHeader header;
+    std::memcpy( &header, file->data(), sizeof( header ));
+
+    // Check that the file is usable for the current input.
+    if( header.version != profile_file_version_ ) {
+        return reject( true, "different file format version" );
+    }
+    if( header.byte_order != profile_file_byte_order_ ) {
+        return reject( true, "different byte order" );
+    }
+    if( ! header.complete ) {
+        return reject( true, "incomplete file" );
+    }
+    if( header.rows != rows ) {
+        return reject( true, "different number of samples" );
+    }
+    if(
+        header.key_offset + header.key_size > file->size() ||
+        key.compare( 0, std::string::npos, file->data() + header.key_offset, header.key_size ) != 0
+    ) {
+        return reject( true, "different input files or settings" );
+    }
+    if( with_imbalances && ( ! header.has_imbalances || header.imbalances_normalized != imbal_norm )) {
+        return reject( true, "different imbalances" );
+    }
+
+    // Get the value type, and check that the file is large enough for what the header claims.
+    auto const value_type = static_cast<ProfileMatrix::ValueType>( header.value_type );
+    if(
+        ( value_type != ProfileMatrix::ValueType::kFloat32 &&
+          value_type != ProfileMatrix::ValueType::kFloat64 ) ||
+        header.tree_offset + header.tree_size > file->size() ||
+        header.masses_offset + ProfileMatrix::byte_size(
+            header.rows, header.cols, value_type
+        ) > file->size() ||
+        ( header.has_imbalances && header.imbalances_offset + ProfileMatrix::byte_size(
+            header.rows, header.cols, value_type
+        ) > file->size() )
+    ) {
+        return reject( true, "corrupt file" );
+    }
+
+    // Read the tree, and set up the matrices.
+    result.tree = profile_file_read_tree(
+        std::string( file->data() + header.tree_offset, header.tree_size )
+    );
+    if( result.tree.edge_count() != header.cols ) {
+        return reject( true, "corrupt file" );
+    }
+    result.edge_masses = ProfileMatrix(
+        file, header.masses_offset, header.rows, header.cols, value_type
+    );
+    if( with_imbalances ) {
+        result.edge_imbalances = ProfileMatrix(
+            file, header.imbalances_offset, header.rows, header.cols, value_type
+        );
+    }
+    return true;
+}
+
+/**
+ * @brief Create a new profile file for the given @p tree, and return a profile that uses it.
+ *
+ * The function also fills @p col_order, such that `col_order[i]` is the edge index in the given
+ * @p tree that corresponds to column `i` of the matrices in the file.
+ */
+static JplaceInputOptions::PlacementProfile create_profile_file(
+    std::string const& path,
+    genesis::tree::Tree const& tree,
+    size_t rows,
+    std::string const& key,
+    bool with_imbalances,
+    bool imbal_norm,
+    ProfileMatrix::ValueType value_type,
+    std::vector<size_t>& col_order
+) {
+    using namespace genesis;
+    using namespace genesis::placement;
+
+    JplaceInputOptions::PlacementProfile result;
+
+    // Write the tree with full precision and edge nums, and read it back, so that we work
+    // with exactly the tree that is later obtained when re-using the file.
+    auto writer = PlacementTreeNewickWriter();
+    writer.enable_edge_nums( true );
+    writer.branch_length_precision( std::numeric_limits<double>::max_digits10 );
+    auto const newick = writer.to_string( tree );
+    result.tree = profile_file_read_tree( newick );
+    if( result.tree.edge_count() != tree.edge_count() ) {
+        throw std::runtime_error( "Internal Error: Cannot store reference tree in profile file." );
+    }
+
+    // Find the column order, using the edge nums.
+    std::unordered_map<int, size_t> edge_num_to_index;
+    for( auto const& edge : tree.edges() ) {
+        edge_num_to_index[ edge.data<PlacementEdgeData>().edge_num() ] = edge.index();
+    }
+    col_order.resize( result.tree.edge_count() );
+    for( auto const& edge : result.tree.edges() ) {
+        auto const num = edge.data<PlacementEdgeData>().edge_num();
+        if( edge_num_to_index.count( num ) == 0 ) {
+            throw std::runtime_error( "Internal Error: Invalid edge nums in profile file tree." );
+        }
+        col_order[ edge.index() ] = edge_num_to_index.at( num );
+    }
+
+    // Prepare the header and layout of the file.
+    ProfileFileHeader header;
+    std::memset( &header, 0, sizeof( header ));
+    std::memcpy( header.magic, profile_file_magic_, sizeof( profile_file_magic_ ));
+    header.version               = profile_file_version_;
+    header.byte_order            = profile_file_byte_order_;
+    header.value_type            = static_cast<uint8_t>( value_type );
+    header.has_imbalances        = with_imbalances;
+    header.imbalances_normalized = with_imbalances && imbal_norm;
+    header.complete              = 0;
+    header.rows                  = rows;
+    header.cols                  = tree.edge_count();
+    header.tree_offset           = sizeof( header );
+    header.tree_size             = newick.size();
+    header.key_offset            = header.tree_offset + header.tree_size;
+    header.key_size              = key.size();
+
+    auto const matrix_bytes = ProfileMatrix::byte_size( rows, tree.edge_count(), value_type );
+    header.masses_offset = profile_file_align( header.key_offset + header.key_size );
+    header.imbalances_offset = profile_file_align( header.masses_offset + matrix_bytes );
+    auto const file_bytes = with_imbalances
+        ? header.imbalances_offset + matrix_bytes
+        : header.masses_offset + matrix_bytes
+    ;
+
+    // Create the file, and write the header, tree, and key. The file is only marked as complete
+    // once all rows are written, see finish_profile_file().
+    LOG_MSG2 << "Creating profile file " << path << " with " << file_bytes << " bytes";
+    auto const file = MappedFile::create( path, file_bytes );
+    std::memcpy( file->data(), &header, sizeof( header ));
+    std::memcpy( file->data() + header.tree_offset, newick.data(), newick.size() );
+    std::memcpy( file->data() + header.key_offset, key.data(), key.size() );
+
+    result.edge_masses = ProfileMatrix(
+        file, header.masses_offset, rows, tree.edge_count(), value_type
+    );
+    if( with_imbalances ) {
+        result.edge_imbalances = ProfileMatrix(
+            file, header.imbalances_offset, rows, tree.edge_count(), value_type
+        );
+    }
+    return result;
+}
+
+/**
+ * @brief Mark a profile file created by create_profile_file() as complete, and flush it to disk.
+ */
+static void finish_profile_file( JplaceInputOptions::PlacementProfile const& profile )
+{
+    auto const& file = profile.edge_masses.file();
+    if( ! file ) {
+        return;
+    }
+
+    ProfileFileHeader header;
+    std::memcpy( &header, file->data(), sizeof( header ));
+    header.complete = 1;
+    std::memcpy( file->data(), &header, sizeof( header ));
+    file->sync();
+}
+
+/**
+ * @brief Reorder the values of a row from the edge order of the jplace tree to the column order
+ * of the profile file.
+ */
+static std::vector<double> permute_profile_row(
+    std::vector<double> const& values,
+    std::vector<size_t> const& col_order
+) {
+    auto result = std::vector<double>( col_order.size() );
+    for( size_t i = 0; i < col_order.size(); ++i ) {
+        result[i] = values[ col_order[i] ];
+    }
+    return result;
+}
+
 // =================================================================================================
 //      Covenience Functions
 // =================================================================================================
@@ -225,6 +731,28 @@ JplaceInputOptions::PlacementProfile JplaceInputOptions::placement_profile(
     using namespace genesis::utils;
 
     PlacementProfile result;
+    bool const imbal_norm = force_imbal_norm || mass_norm_relative();
+    bool const use_file = profile_file_option && ! profile_file_.empty();
+
+    // If we have a profile file that matches our input, we can skip all the reading.
+    auto const key = use_file ? profile_file_key(
+        file_paths(),
+        point_mass_option && point_mass_,
+        ignore_multiplicities_option && ignore_multiplicities_,
+        ( mass_norm_option && mass_norm_relative() ) ? "relative" : "absolute"
+    ) : std::string();
+    if( use_file && read_profile_file(
+        profile_file_, file_count(), key, with_imbalances, imbal_norm, result
+    )) {
+        LOG_MSG1 << "Using existing profile file " << profile_file_;
+        return result;
+    }
+
+    // The tree of the first sample, used for compatibility checks, and the order of columns
+    // that is needed to match the tree stored in the profile file (see there for details).
+    genesis::tree::Tree first_tree;
+    std::shared_ptr<PlacementTree const> first_tree_ptr;
+    std::vector<size_t> col_order;
     size_t fc = 0;
 
     // Read all jplace files and accumulate their data.
@@ -237,56 +765,82 @@ JplaceInputOptions::PlacementProfile JplaceInputOptions::placement_profile(
 
         // Read in file and get data vectors.
         // This is the part that can trivially be done in parallel.
-        auto const smpl = sample( fi );
-        auto const edge_masses = placement_mass_per_edges_with_multiplicities( smpl );
-        auto const edge_imbals
+        std::shared_ptr<PlacementTree const> smpl_tree;
+        auto const smpl = sample( fi, smpl_tree );
+        auto edge_masses = placement_mass_per_edges_with_multiplicities( smpl );
+        auto edge_imbals
             = with_imbalances
-            ? epca_imbalance_vector( smpl, force_imbal_norm || mass_norm_relative() )
+            ? epca_imbalance_vector( smpl, imbal_norm )
             : std::vector<double>()
         ;
 
-        // The main merging is single threaded.
-        // Could be done in parallel if we make sure that the matrices are initialized first.
-        // Right now, not worth the effort.
+        // Only the tree check and the initialization of the matrices are single threaded.
+        // Once initialized, each thread can write its own rows.
         #pragma omp critical(GAPPA_JPLACE_INPUT_ACCUMULATE)
         {
-            // Set tree
-            if( result.tree.empty() ) {
-                result.tree = smpl.tree();
-            } else if( ! genesis::placement::compatible_trees( result.tree, smpl.tree() ) ) {
+            // Set tree and init matrices.
+            if( first_tree.empty() ) {
+                first_tree = smpl.tree();
+                first_tree_ptr = smpl_tree;
+                if( use_file ) {
+                    result = create_profile_file(
+                        profile_file_, first_tree, file_count(), key, with_imbalances, imbal_norm,
+                        profile_precision_ == "float"
+                            ? ProfileMatrix::ValueType::kFloat32
+                            : ProfileMatrix::ValueType::kFloat64,
+                        col_order
+                    );
+                } else {
+                    result.tree = first_tree;
+                    result.edge_masses = ProfileMatrix( file_count(), first_tree.edge_count() );
+                    if( with_imbalances ) {
+                        result.edge_imbalances = ProfileMatrix(
+                            file_count(), first_tree.edge_count()
+                        );
+                    }
+                }
+            } else if(
+                smpl_tree != first_tree_ptr &&
+                ! genesis::placement::compatible_trees( first_tree, smpl.tree() )
+            ) {
                 throw std::runtime_error( "Input jplace files have differing reference trees." );
             }
+        }
 
-            // Init matrices if needed.
-            if( result.edge_masses.empty() ) {
-                result.edge_masses = Matrix<double>( file_count(), result.tree.edge_count() );
-            }
-            if( with_imbalances && result.edge_imbalances.empty() ) {
-                result.edge_imbalances = Matrix<double>( file_count(), result.tree.edge_count() );
-            }
-
-            // Do some checks for correct input.
-            if( fi >= result.edge_masses.rows() || fi >= result.edge_imbalances.rows() ) {
-                throw std::runtime_error(
-                    "Internal Error: Placement profile matrices have wrong number of rows."
-                );
-            }
-            if(
-                edge_masses.size() != edge_imbals.size()            ||
-                edge_masses.size() != result.edge_masses.cols()     ||
-                ( with_imbalances && edge_imbals.size() != result.edge_imbalances.cols() )
-            ) {
-                throw std::runtime_error(
-                    "Internal Error: Placement profile matrices have wrong number of columns."
-                );
-            }
+        // Do some checks for correct input.
+        if(
+            fi >= result.edge_masses.rows() ||
+            ( with_imbalances && fi >= result.edge_imbalances.rows() )
+        ) {
+            throw std::runtime_error(
+                "Internal Error: Placement profile matrices have wrong number of rows."
+            );
+        }
+        if(
+            edge_masses.size() != result.edge_masses.cols() ||
+            ( with_imbalances && edge_imbals.size() != result.edge_imbalances.cols() )
+        ) {
+            throw std::runtime_error(
+                "Internal Error: Placement profile matrices have wrong number of columns."
+            );
+        }
 
-            // Fill the matrices.
-            result.edge_masses.row( fi ) = edge_masses;
+        // Fill the matrices, using the column order of the profile file tree if needed.
+        if( ! col_order.empty() ) {
+            edge_masses = permute_profile_row( edge_masses, col_order );
             if( with_imbalances ) {
-                result.edge_imbalances.row( fi ) = edge_imbals;
+                edge_imbals = permute_profile_row( edge_imbals, col_order );
             }
         }
+        result.edge_masses.set_row( fi, edge_masses );
+        if( with_imbalances ) {
+            result.edge_imbalances.set_row( fi, edge_imbals );
+        }
+    }
+
+    // Mark the profile file as complete.
+    if( use_file ) {
+        finish_profile_file( result );
     }
 
     return result;
@@ -375,6 +929,43 @@ genesis::placement::Sample JplaceInputOptions::merged_samples() const
 //      Helper Functions
 // =================================================================================================
 
+std::shared_ptr<genesis::placement::PlacementTree const> JplaceInputOptions::interned_tree_(
+    std::string const& newick
+) const {
+    using namespace genesis;
+    using namespace genesis::placement;
+
+    // We parse the tree within the critical section, so that each tree is only parsed once,
+    // even if multiple threads encounter it at the same time. Exceptions cannot leave the
+    // critical section, so we have to rethrow them afterwards.
+    std::shared_ptr<PlacementTree const> result;
+    std::exception_ptr error;
+    #pragma omp critical(GAPPA_JPLACE_INPUT_TREE_CACHE)
+    {
+        auto& entry = tree_cache_[ newick ];
+        if( ! entry ) {
+            try {
+                auto tree = PlacementTreeNewickReader().read( utils::from_string( newick ));
+                if( ! has_correct_edge_nums( tree )) {
+                    LOG_WARN << "Jplace file has invalid edge_num tags in its reference tree. "
+                             << "Results might be unexpected.";
+                }
+                entry = std::make_shared<PlacementTree const>( std::move( tree ));
+            } catch( ... ) {
+                tree_cache_.erase( newick );
+                error = std::current_exception();
+            }
+        }
+        if( ! error ) {
+            result = entry;
+        }
+    }
+    if( error ) {
+        std::rethrow_exception( error );
+    }
+    return result;
+}
+
 bool JplaceInputOptions::mass_norm_absolute() const
 {
     if( mass_norm_ != "absolute" && mass_norm_ != "relative" ) {
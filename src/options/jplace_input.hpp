@@ -27,14 +27,19 @@
 #include "CLI/CLI.hpp"
 
 #include "options/file_input.hpp"
+#include "tools/jplace_scanner.hpp"
+#include "tools/profile_matrix.hpp"
 
 #include "genesis/placement/formats/jplace_reader.hpp"
+#include "genesis/placement/placement_tree.hpp"
 #include "genesis/placement/sample_set.hpp"
 #include "genesis/placement/sample.hpp"
 #include "genesis/tree/mass_tree/tree.hpp"
 #include "genesis/utils/math/matrix.hpp"
 
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // =================================================================================================
@@ -71,6 +76,7 @@ public:
     CLI::Option* add_point_mass_opt_to_app( CLI::App* sub );
     CLI::Option* add_ignore_multiplicities_opt_to_app( CLI::App* sub );
     CLI::Option* add_mass_norm_opt_to_app( CLI::App* sub, bool required );
+    CLI::Option* add_profile_file_opt_to_app( CLI::App* sub );
 
     // -------------------------------------------------------------------------
     //     Run Functions
@@ -84,6 +90,51 @@ public:
      */
     genesis::placement::Sample sample( size_t index ) const;
 
+    /**
+     * @brief Read in the jplace files at @p index, and also return its reference tree.
+     *
+     * The reference tree of each distinct newick string in the input files is only parsed once,
+     * and shared between all samples that use it. The shared tree is returned via @p tree,
+     * so that callers that accumulate data across files can check whether two samples have
+     * the same reference tree by simply comparing the pointers, instead of having to call
+     * genesis::placement::compatible_trees(). If the pointers differ, the trees can still be
+     * compatible, for example if they only differ in the formatting of the branch lengths.
+     */
+    genesis::placement::Sample sample(
+        size_t index,
+        std::shared_ptr<genesis::placement::PlacementTree const>& tree
+    ) const;
+
+    /**
+     * @brief Read in the jplace file at @p index, and return its placement mass per edge,
+     * including the multiplicities of the pqueries.
+     *
+     * This is the same as calling genesis::placement::placement_mass_per_edges_with_multiplicities()
+     * on the result of sample(), including all normalizations, but accumulates the masses directly
+     * while going through the placements of the file, without building a Sample. The returned
+     * vector is indexed by the edge indices of the reference tree, which is returned via @p tree,
+     * see sample() for details.
+     */
+    std::vector<double> edge_masses(
+        size_t index,
+        std::shared_ptr<genesis::placement::PlacementTree const>& tree
+    ) const;
+
+    /**
+     * @brief Scan the jplace file at @p index, and return its content without building a Sample.
+     *
+     * The reference tree of the file is returned via @p tree, and shared between files,
+     * see sample() for details. None of the settings of this class (point mass, multiplicities,
+     * mass norm) are applied to the scan. Files in the old jplace version 1 format use different
+     * edge nums, which do not work with the scan. For those, as well as for all files if the reader
+     * settings have been customized via reader(), @p tree is reset to an empty pointer,
+     * and callers need to use sample() instead.
+     */
+    JplaceScan scan(
+        size_t index,
+        std::shared_ptr<genesis::placement::PlacementTree const>& tree
+    ) const;
+
     /**
      * @brief Read in all jplace files given by the user and return them as a SampleSet.
      */
@@ -98,13 +149,14 @@ public:
      *
      * In some cases, the actual placement data is not needed. Instead it is enough to know
      * the masses per edge of the tree, and maybe their imbalances.
-     * This struct encapsulates this data.
+     * This struct encapsulates this data. The matrices have one row per sample,
+     * and one column per edge of the tree.
      */
     struct PlacementProfile
     {
-        genesis::tree::Tree            tree;
-        genesis::utils::Matrix<double> edge_masses;
-        genesis::utils::Matrix<double> edge_imbalances;
+        genesis::tree::Tree tree;
+        ProfileMatrix       edge_masses;
+        ProfileMatrix       edge_imbalances;
     };
 
     /**
@@ -113,6 +165,10 @@ public:
      * Can choose whether also do compute imbalances.
      * If the additional second parameter is set to true, the imbalances are normalzied independently
      * from the norm setting in this class.
+     *
+     * If the profile file option was used, the matrices are backed by a memory-mapped file instead
+     * of being kept in memory. If that file already contains a matching profile, it is reused
+     * instead of reading the jplace files again.
      */
     PlacementProfile placement_profile(
         bool with_imbalances = true,
@@ -142,10 +198,15 @@ public:
      * @brief Return the JplaceReader used for the convenience functions.
      *
      * By modifying the settings of the reader before calling sample() or sample_set(),
-     * the reading behaviour can be customized if needed for a program.
+     * the reading behaviour can be customized if needed for a program. By default, the reader
+     * is only used for files in the old jplace version 1 format, and all other files are read with
+     * a JplaceScanner, so that their reference trees can be shared, see sample(). As the scanner
+     * does not know about the reader settings, calling this function switches all reading
+     * to the reader, so that the settings apply to all files.
      */
     genesis::placement::JplaceReader& reader()
     {
+        custom_reader_ = true;
         return reader_;
     }
 
@@ -172,6 +233,21 @@ public:
     bool mass_norm_absolute() const;
     bool mass_norm_relative() const;
 
+    std::string profile_file() const
+    {
+        return profile_file_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Internal Functions
+    // -------------------------------------------------------------------------
+
+private:
+
+    std::shared_ptr<genesis::placement::PlacementTree const> interned_tree_(
+        std::string const& newick
+    ) const;
+
     // -------------------------------------------------------------------------
     //     Option Members
     // -------------------------------------------------------------------------
@@ -179,17 +255,28 @@ public:
 private:
 
     genesis::placement::JplaceReader reader_;
+    bool custom_reader_ = false;
+
+    // Reference trees that we have already parsed, by their newick string.
+    mutable std::unordered_map<
+        std::string, std::shared_ptr<genesis::placement::PlacementTree const>
+    > tree_cache_;
 
     bool point_mass_            = false;
     bool ignore_multiplicities_ = false;
     std::string mass_norm_      = "absolute";
 
+    std::string profile_file_;
+    std::string profile_precision_ = "double";
+
 public:
 
     CLI::Option* jplace_input_option          = nullptr;
     CLI::Option* point_mass_option            = nullptr;
     CLI::Option* ignore_multiplicities_option = nullptr;
     CLI::Option* mass_norm_option             = nullptr;
+    CLI::Option* profile_file_option          = nullptr;
+    CLI::Option* profile_precision_option     = nullptr;
 
 };
 
@@ -25,15 +25,78 @@
 #include "options/global.hpp"
 
 #include "genesis/tree/drawing/functions.hpp"
+#include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/formats/svg/svg.hpp"
+#include "genesis/utils/io/output_stream.hpp"
 #include "genesis/utils/text/string.hpp"
 #include "genesis/utils/color/functions.hpp"
 #include "genesis/utils/color/helpers.hpp"
 #include "genesis/utils/tools/tickmarks.hpp"
 
 #include <cassert>
+#include <fstream>
 #include <iostream>
 #include <stdexcept>
 
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Write a colored tree to an svg file, using a copy of a prepared layout.
+ *
+ * This is what genesis::tree::write_color_tree_to_svg_file() does, but without computing the
+ * layout, which is the expensive part for large trees. The layout is taken by value,
+ * as setting the edge strokes modifies it. If a @p color_map and @p color_norm are given,
+ * a color scale is added as well.
+ */
+template<class Layout>
+static void write_prepared_layout_to_svg_file(
+    Layout                                    layout,
+    genesis::tree::LayoutParameters const&    params,
+    std::vector<genesis::utils::Color> const& color_per_branch,
+    genesis::utils::ColorMap const*           color_map,
+    genesis::utils::ColorNormalization const* color_norm,
+    std::string const&                        svg_filename
+) {
+    using namespace genesis::utils;
+
+    // Set edge colors.
+    std::vector<SvgStroke> strokes;
+    strokes.reserve( color_per_branch.size() );
+    for( auto const& color : color_per_branch ) {
+        auto stroke = params.stroke;
+        stroke.color = color;
+        stroke.line_cap = SvgStroke::LineCap::kRound;
+        strokes.push_back( std::move( stroke ));
+    }
+    layout.set_edge_strokes( strokes );
+
+    // Prepare svg doc.
+    auto svg_doc = layout.to_svg_document();
+    svg_doc.margin = SvgMargin( 200.0 );
+
+    // Add the color scale to the right of the tree, vertically centered.
+    if( color_map && color_norm ) {
+        auto const bbox = svg_doc.bounding_box();
+        SvgColorBarSettings bar_settings;
+        bar_settings.height = bbox.height() / 2.0;
+        bar_settings.width  = bar_settings.height / 10.0;
+        auto svg_scale = make_svg_color_bar( bar_settings, *color_map, *color_norm );
+        svg_scale.second.transform.append( SvgTransform::Translate(
+            bbox.bottom_right.x + 0.2 * bbox.width(),
+            bbox.top_left.y + ( bbox.height() - bar_settings.height ) / 2.0
+        ));
+        svg_doc.defs.push_back( svg_scale.first );
+        svg_doc << svg_scale.second;
+    }
+
+    // Write to file.
+    std::ofstream ofs;
+    file_output_stream( svg_filename, ofs );
+    svg_doc.write( ofs );
+}
+
 // =================================================================================================
 //      Setup Functions
 // =================================================================================================
@@ -250,12 +313,176 @@ void TreeOutputOptions::write_tree_to_files(
     }
 
     if( print_legend ) {
-        // TODO maybe make the num ticks changable. if so, also use it for the svg output!
-        auto const tickmarks = color_tickmarks( color_norm, 5 );
+        print_color_legend_( color_map, color_norm );
+    }
+}
+
+TreeOutputOptions::PreparedLayout TreeOutputOptions::prepare_layout(
+    genesis::tree::CommonTree const& tree
+) const {
+    using namespace genesis::tree;
+
+    // Prepared layouts are only used for trees with colored branches, so we warn about Newick here,
+    // once, instead of for every tree that is written with the layout.
+    if( write_newick_tree_ && !( write_nexus_tree_ || write_phyloxml_tree_ || write_svg_tree_ )) {
+        LOG_WARN << "Warning: Option --write-newick-tree is set, but the output contains colors, "
+                 << "which are not available in the Newick format. The Newick tree only "
+                 << "contains the topology of the tree with names and branch lengths. "
+                 << "Use another format such as nexus, phyloxml, or svg to get a colored tree!";
+    }
+
+    PreparedLayout result;
+    result.tree = tree;
+    if( write_svg_tree_ ) {
+        auto const params = svg_tree_output.layout_parameters();
+        if( params.shape == LayoutShape::kCircular ) {
+            result.circular_layout = std::make_shared<CircularLayout const>(
+                tree, params.type, params.ladderize
+            );
+        } else {
+            result.rectangular_layout = std::make_shared<RectangularLayout const>(
+                tree, params.type, params.ladderize
+            );
+        }
+    }
+    return result;
+}
+
+void TreeOutputOptions::write_tree_to_files(
+    PreparedLayout const&                     layout,
+    std::vector<genesis::utils::Color> const& color_per_branch,
+    FileOutputOptions const&                  file_output_options,
+    std::string const&                        infix
+) const {
+    using namespace genesis::tree;
+
+    // See above for reasoning of these assertions.
+    assert( file_output_options.compress_option == nullptr );
+    assert( !file_output_options.compress() );
 
+    write_prepared_non_svg_( layout, color_per_branch, file_output_options, infix );
+    if( write_svg_tree_ ) {
+        write_prepared_svg_( layout, color_per_branch, nullptr, nullptr, file_output_options, infix );
+    }
+}
+
+void TreeOutputOptions::write_tree_to_files(
+    PreparedLayout const&                     layout,
+    std::vector<genesis::utils::Color> const& color_per_branch,
+    genesis::utils::ColorMap const&           color_map,
+    genesis::utils::ColorNormalization const& color_norm,
+    FileOutputOptions const&                  file_output_options,
+    std::string const&                        infix,
+    bool                                      print_legend
+) const {
+    using namespace genesis::tree;
+    using namespace genesis::utils;
+
+    // See above for reasoning of these assertions.
+    assert( file_output_options.compress_option == nullptr );
+    assert( !file_output_options.compress() );
+
+    write_prepared_non_svg_( layout, color_per_branch, file_output_options, infix );
+
+    if( write_svg_tree_ ) {
+        write_prepared_svg_(
+            layout, color_per_branch, &color_map, &color_norm, file_output_options, infix
+        );
+    }
+
+    if( print_legend ) {
+        print_color_legend( color_map, color_norm );
+    }
+}
+
+void TreeOutputOptions::print_color_legend(
+    genesis::utils::ColorMap const&           color_map,
+    genesis::utils::ColorNormalization const& color_norm,
+    std::string const&                        title
+) const {
+    if( write_nexus_tree_ || write_phyloxml_tree_ ) {
+        print_color_legend_( color_map, color_norm, title );
+    }
+}
+
+// =================================================================================================
+//      Internal Functions
+// =================================================================================================
+
+void TreeOutputOptions::write_prepared_non_svg_(
+    PreparedLayout const&                     layout,
+    std::vector<genesis::utils::Color> const& color_per_branch,
+    FileOutputOptions const&                  file_output_options,
+    std::string const&                        infix
+) const {
+    using namespace genesis::tree;
+
+    // These formats do not use a layout, so they are written as in the functions above.
+    if( write_newick_tree_ ) {
+        newick_tree_output.write_tree(
+            layout.tree, file_output_options.get_output_target( infix, "newick" )
+        );
+    }
+    if( write_nexus_tree_ ) {
+        write_color_tree_to_nexus_file(
+            layout.tree, color_per_branch, file_output_options.get_output_filename( infix, "nexus" )
+        );
+    }
+    if( write_phyloxml_tree_ ) {
+        write_color_tree_to_phyloxml_file(
+            layout.tree, color_per_branch,
+            file_output_options.get_output_filename( infix, "phyloxml" )
+        );
+    }
+}
+
+void TreeOutputOptions::write_prepared_svg_(
+    PreparedLayout const&                     layout,
+    std::vector<genesis::utils::Color> const& color_per_branch,
+    genesis::utils::ColorMap const*           color_map,
+    genesis::utils::ColorNormalization const* color_norm,
+    FileOutputOptions const&                  file_output_options,
+    std::string const&                        infix
+) const {
+    if( ! layout.circular_layout && ! layout.rectangular_layout ) {
+        throw std::runtime_error(
+            "Internal Error: Tree layout was not prepared before writing svg trees."
+        );
+    }
+    auto const params = svg_tree_output.layout_parameters();
+    auto const svg_filename = file_output_options.get_output_filename( infix, "svg" );
+    if( layout.circular_layout ) {
+        write_prepared_layout_to_svg_file(
+            *layout.circular_layout, params, color_per_branch, color_map, color_norm, svg_filename
+        );
+    } else {
+        write_prepared_layout_to_svg_file(
+            *layout.rectangular_layout, params, color_per_branch, color_map, color_norm,
+            svg_filename
+        );
+    }
+}
+
+void TreeOutputOptions::print_color_legend_(
+    genesis::utils::ColorMap const&           color_map,
+    genesis::utils::ColorNormalization const& color_norm,
+    std::string const&                        title
+) const {
+    using namespace genesis::utils;
+
+    // TODO maybe make the num ticks changable. if so, also use it for the svg output!
+    auto const tickmarks = color_tickmarks( color_norm, 5 );
+
+    // Trees might be written in parallel, so we make sure that the lines of a legend stay together.
+    #pragma omp critical(GAPPA_TREE_OUTPUT_LEGEND)
+    {
+        if( ! title.empty() ) {
+            LOG_MSG1 << "Color legend of " << title << ":";
+        }
         LOG_MSG1 << "Output options --write-nexus-tree and --write-phyloxml-tree produce trees "
-                 << "with colored branches. These formats are however not able to store the legend, "
-                 << "that is, which color represents which value. Thus, use to following positions "
+                 << "with colored branches. These formats are however not able to store the "
+                 << "legend, that is, which color represents which value. "
+                 << "Thus, use to following positions "
                  << "to create a legend (with linear color interpolation between the positions). "
                  << "These positions range from 0.0 (lowest) to 1.0 (heighest), and are labeled "
                  << "with the values and colors represented by those positions.";
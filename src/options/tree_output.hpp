@@ -31,10 +31,13 @@
 #include "options/file_output.hpp"
 
 #include "genesis/tree/common_tree/tree.hpp"
+#include "genesis/tree/drawing/circular_layout.hpp"
+#include "genesis/tree/drawing/rectangular_layout.hpp"
 #include "genesis/utils/color/color.hpp"
 #include "genesis/utils/color/map.hpp"
 #include "genesis/utils/color/normalization.hpp"
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -57,6 +60,29 @@ class TreeOutputOptions
 {
 public:
 
+    // -------------------------------------------------------------------------
+    //     Typedefs
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Tree for which the layout of the svg output has already been computed.
+     *
+     * Computing the layout of a large tree takes a while. When writing many trees that only
+     * differ in their branch colors, the layout can be computed once via prepare_layout(),
+     * and then be reused for each of them, see write_tree_to_files(). As the prepared layout
+     * is never modified, writing from it can be done in parallel.
+     *
+     * The layout is computed for the tree that is given to prepare_layout(). Trees written
+     * with it are expected to have the same topology, with colors indexed by edge index,
+     * and are written with the names and branch lengths of that tree.
+     */
+    struct PreparedLayout
+    {
+        genesis::tree::CommonTree                               tree;
+        std::shared_ptr<genesis::tree::CircularLayout const>    circular_layout;
+        std::shared_ptr<genesis::tree::RectangularLayout const> rectangular_layout;
+    };
+
     // -------------------------------------------------------------------------
     //     Constructor and Rule of Five
     // -------------------------------------------------------------------------
@@ -123,6 +149,86 @@ public:
         std::string const&                        infix
     ) const;
 
+    /**
+     * @brief Compute the layout of the svg tree, if the user wants an svg tree.
+     *
+     * As prepared layouts are used for trees with colored branches, this also warns once if
+     * the only requested format is Newick, which cannot store colors.
+     */
+    PreparedLayout prepare_layout( genesis::tree::CommonTree const& tree ) const;
+
+    /**
+     * @brief Write a tree with colored branches to all formats specified by the user,
+     * using a prepared layout.
+     */
+    void write_tree_to_files(
+        PreparedLayout const&                     layout,
+        std::vector<genesis::utils::Color> const& color_per_branch,
+        FileOutputOptions const&                  file_output_options,
+        std::string const&                        infix
+    ) const;
+
+    /**
+     * @brief Write a tree with colored branches and color scale to all formats specified
+     * by the user, using a prepared layout.
+     *
+     * This does the same as the above function, but reuses the layout. The information about
+     * the color scale for non-svg formats is only printed if @p print_legend is set, so that
+     * the function can be called in parallel without messing up the output.
+     */
+    void write_tree_to_files(
+        PreparedLayout const&                     layout,
+        std::vector<genesis::utils::Color> const& color_per_branch,
+        genesis::utils::ColorMap const&           color_map,
+        genesis::utils::ColorNormalization const& color_norm,
+        FileOutputOptions const&                  file_output_options,
+        std::string const&                        infix,
+        bool                                      print_legend = true
+    ) const;
+
+    /**
+     * @brief Print information about the color scale, if the user wants trees in formats that
+     * cannot store it (nexus and phyloxml).
+     *
+     * This is what write_tree_to_files() does with @p print_legend set. When writing many trees
+     * with the same color scale in parallel, call this once, and do not print the legend
+     * with each tree. If the trees have different scales, a @p title can be given to tell
+     * the legends apart.
+     */
+    void print_color_legend(
+        genesis::utils::ColorMap const&           color_map,
+        genesis::utils::ColorNormalization const& color_norm,
+        std::string const&                        title = ""
+    ) const;
+
+    // -------------------------------------------------------------------------
+    //     Internal Functions
+    // -------------------------------------------------------------------------
+
+private:
+
+    void write_prepared_non_svg_(
+        PreparedLayout const&                     layout,
+        std::vector<genesis::utils::Color> const& color_per_branch,
+        FileOutputOptions const&                  file_output_options,
+        std::string const&                        infix
+    ) const;
+
+    void write_prepared_svg_(
+        PreparedLayout const&                     layout,
+        std::vector<genesis::utils::Color> const& color_per_branch,
+        genesis::utils::ColorMap const*           color_map,
+        genesis::utils::ColorNormalization const* color_norm,
+        FileOutputOptions const&                  file_output_options,
+        std::string const&                        infix
+    ) const;
+
+    void print_color_legend_(
+        genesis::utils::ColorMap const&           color_map,
+        genesis::utils::ColorNormalization const& color_norm,
+        std::string const&                        title = ""
+    ) const;
+
     // -------------------------------------------------------------------------
     //     Option Members
     // -------------------------------------------------------------------------
@@ -77,6 +77,20 @@ public:
         CLI::App* sub, CLI::Option* newick_tree_opt
     );
 
+    // -------------------------------------------------------------------------
+    //     Accessors
+    // -------------------------------------------------------------------------
+
+    int branch_length_precision() const
+    {
+        return branch_length_precision_;
+    }
+
+    bool quote_invalid_chars() const
+    {
+        return quote_invalid_chars_;
+    }
+
     // -------------------------------------------------------------------------
     //     Run Functions
     // -------------------------------------------------------------------------
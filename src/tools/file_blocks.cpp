@@ -0,0 +1,119 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/file_blocks.hpp"
+
+#include "genesis/utils/io/output_stream.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef GENESIS_ZLIB
+#   include <zlib.h>
+#endif
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Write the @p text to the open stream, optionally as a gzip member.
+ */
+static void write_block(
+    std::ofstream& ofs,
+    std::string const& file_path,
+    std::string const& text,
+    bool compress
+) {
+    if( compress ) {
+        auto const block = gzip_block( text );
+        ofs.write( block.data(), static_cast<std::streamsize>( block.size() ));
+    } else {
+        ofs.write( text.data(), static_cast<std::streamsize>( text.size() ));
+    }
+    if( ! ofs ) {
+        throw std::runtime_error( "Cannot write to file " + file_path );
+    }
+}
+
+// =================================================================================================
+//      File Blocks
+// =================================================================================================
+
+std::string gzip_block( std::string const& text )
+{
+    #ifdef GENESIS_ZLIB
+
+        z_stream zs;
+        std::memset( &zs, 0, sizeof( zs ));
+
+        // Window bits of 15 + 16 produce a gzip header and trailer around the deflate stream.
+        auto const init = deflateInit2(
+            &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY
+        );
+        if( init != Z_OK ) {
+            throw std::runtime_error( "Cannot initialize gzip compression." );
+        }
+
+        // The bound includes the gzip header, so that we can compress the block in one go.
+        std::string result( deflateBound( &zs, static_cast<uLong>( text.size() )), '\0' );
+        zs.next_in   = reinterpret_cast<Bytef*>( const_cast<char*>( text.data() ));
+        zs.avail_in  = static_cast<uInt>( text.size() );
+        zs.next_out  = reinterpret_cast<Bytef*>( &result[0] );
+        zs.avail_out = static_cast<uInt>( result.size() );
+
+        auto const ret = deflate( &zs, Z_FINISH );
+        auto const total = zs.total_out;
+        deflateEnd( &zs );
+        if( ret != Z_STREAM_END ) {
+            throw std::runtime_error( "Error while compressing output with gzip." );
+        }
+        result.resize( total );
+        return result;
+
+    #else
+
+        (void) text;
+        throw std::runtime_error(
+            "Cannot write gzip compressed files, as zlib is not available."
+        );
+
+    #endif
+}
+
+void create_block_file( std::string const& file_path, std::string const& text, bool compress )
+{
+    using namespace genesis::utils;
+
+    std::ofstream ofs;
+    file_output_stream( file_path, ofs, std::ios_base::out | std::ios_base::binary );
+    write_block( ofs, file_path, text, compress );
+}
+
+void append_block_file( std::string const& file_path, std::string const& text, bool compress )
+{
+    auto const mode = std::ios_base::out | std::ios_base::app | std::ios_base::binary;
+    std::ofstream ofs( file_path, mode );
+    write_block( ofs, file_path, text, compress );
+}
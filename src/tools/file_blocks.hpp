@@ -0,0 +1,57 @@
+#ifndef GAPPA_TOOLS_FILE_BLOCKS_H_
+#define GAPPA_TOOLS_FILE_BLOCKS_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include <string>
+
+// =================================================================================================
+//      File Blocks
+// =================================================================================================
+
+/**
+ * @brief Compress the @p text as a complete gzip member.
+ *
+ * Concatenated gzip members are valid gzip files (as written by `pigz`), so that blocks of text
+ * can be compressed independently, and written one after another to the same file.
+ */
+std::string gzip_block( std::string const& text );
+
+/**
+ * @brief Create the file at @p file_path, and write the @p text to it, optionally as a
+ * gzip member.
+ *
+ * This uses genesis' file_output_stream(), so that its settings for overwriting files apply.
+ */
+void create_block_file( std::string const& file_path, std::string const& text, bool compress );
+
+/**
+ * @brief Append the @p text to the file at @p file_path, optionally as a gzip member.
+ *
+ * The file is only opened for this write, so that many files can be written to at the same
+ * time without running into the limit of open files of the system.
+ */
+void append_block_file( std::string const& file_path, std::string const& text, bool compress );
+
+#endif // include guard
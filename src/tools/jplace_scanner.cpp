@@ -0,0 +1,675 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/jplace_scanner.hpp"
+
+#include "genesis/utils/io/input_stream.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <initializer_list>
+#include <limits>
+#include <stdexcept>
+
+// =================================================================================================
+//      Jplace Scan
+// =================================================================================================
+
+size_t const JplaceScan::npos;
+
+double JplaceScan::total_multiplicity( size_t pquery ) const
+{
+    double result = 0.0;
+    for( size_t i = name_offsets[ pquery ]; i < name_offsets[ pquery + 1 ]; ++i ) {
+        result += multiplicities[i];
+    }
+    return result;
+}
+
+size_t JplaceScan::field_index( std::string const& field ) const
+{
+    for( size_t i = 0; i < fields.size(); ++i ) {
+        if( fields[i] == field ) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+// =================================================================================================
+//      Scan Parser
+// =================================================================================================
+
+/**
+ * @brief Internal helper that does the actual parsing of the JSON for the JplaceScanner.
+ *
+ * This is a minimal JSON parser that only supports what is needed for jplace files. Unknown keys
+ * (such as `metadata`) are skipped, whatever their values are.
+ */
+class JplaceScanParser
+{
+public:
+
+    JplaceScanParser(
+        genesis::utils::InputStream& it,
+        JplaceScan& scan,
+        bool store_placements,
+        bool store_names
+    )
+        : it_( it )
+        , scan_( scan )
+        , store_placements_( store_placements )
+        , store_names_( store_placements && store_names )
+    {}
+
+    void parse_document()
+    {
+        if( store_placements_ ) {
+            scan_.placement_offsets.push_back( 0 );
+            scan_.name_offsets.push_back( 0 );
+        }
+        if( store_names_ ) {
+            scan_.name_char_offsets.push_back( 0 );
+        }
+
+        skip_ws_();
+        expect_( '{' );
+        parse_object_( [&]( std::string const& key ){
+            if( key == "tree" ) {
+                read_string_( scan_.tree );
+            } else if( key == "fields" ) {
+                std::string field;
+                parse_array_( [&](){
+                    read_string_( field );
+                    scan_.fields.push_back( field );
+                });
+            } else if( key == "version" ) {
+                scan_.version = static_cast<int>( read_number_() );
+            } else if( key == "placements" ) {
+                parse_array_( [&](){
+                    parse_pquery_();
+                });
+            } else {
+                skip_value_();
+            }
+        });
+
+        // Only whitespace is allowed after the document.
+        skip_ws_();
+        if( it_ ) {
+            error_( "Unexpected content after the end of the document" );
+        }
+    }
+
+private:
+
+    // -------------------------------------------------------------------------
+    //     Jplace Elements
+    // -------------------------------------------------------------------------
+
+    void parse_pquery_()
+    {
+        std::vector<double> m_values;
+        std::string name;
+        multiplicities_.clear();
+
+        expect_( '{' );
+        parse_object_( [&]( std::string const& key ){
+            if( key == "p" ) {
+
+                // Array of placements, each of them an array of values.
+                parse_array_( [&](){
+                    size_t width = 0;
+                    expect_( '[' );
+                    parse_array_( [&](){
+                        if( store_placements_ ) {
+                            scan_.values.push_back( read_number_or_null_() );
+                        } else {
+                            skip_value_();
+                        }
+                        ++width;
+                    }, true );
+                    if( scan_.row_width == 0 ) {
+                        scan_.row_width = width;
+                    }
+                    if( width == 0 || width != scan_.row_width ) {
+                        error_( "Placements with differing number of values" );
+                    }
+                    ++scan_.total_placements;
+                });
+
+            } else if( key == "n" ) {
+
+                // Names, either as an array, or (in older versions) as a single string.
+                skip_ws_();
+                if( it_ && *it_ == '"' ) {
+                    read_string_( name );
+                    add_name_( name, 1.0 );
+                } else {
+                    parse_array_( [&](){
+                        read_string_( name );
+                        add_name_( name, 1.0 );
+                    });
+                }
+
+            } else if( key == "nm" ) {
+
+                // Names with multiplicities, as arrays of two elements.
+                parse_array_( [&](){
+                    skip_ws_();
+                    expect_( '[' );
+                    skip_ws_();
+                    read_string_( name );
+                    skip_ws_();
+                    expect_( ',' );
+                    auto const multiplicity = read_number_();
+                    skip_ws_();
+                    expect_( ']' );
+                    add_name_( name, multiplicity );
+                });
+
+            } else if( key == "m" ) {
+
+                // Multiplicities of the names given in "n", as used in older versions.
+                parse_array_( [&](){
+                    m_values.push_back( read_number_() );
+                });
+
+            } else {
+                skip_value_();
+            }
+        });
+
+        // Apply separate multiplicities, if they fit the names of this pquery.
+        if( ! m_values.empty() ) {
+            if( m_values.size() != multiplicities_.size() ) {
+                error_( "Pquery with differing number of names and multiplicities" );
+            }
+            multiplicities_ = m_values;
+        }
+
+        // Update the totals, and store the pquery.
+        ++scan_.total_pqueries;
+        scan_.total_names += multiplicities_.size();
+        for( auto const m : multiplicities_ ) {
+            scan_.multiplicity_sum += m;
+        }
+        if( store_placements_ ) {
+            scan_.multiplicities.insert(
+                scan_.multiplicities.end(), multiplicities_.begin(), multiplicities_.end()
+            );
+            scan_.placement_offsets.push_back( scan_.total_placements );
+            scan_.name_offsets.push_back( scan_.multiplicities.size() );
+        }
+    }
+
+    void add_name_( std::string const& name, double multiplicity )
+    {
+        multiplicities_.push_back( multiplicity );
+        if( store_names_ ) {
+            scan_.name_chars.append( name );
+            scan_.name_char_offsets.push_back( scan_.name_chars.size() );
+        }
+    }
+
+    // -------------------------------------------------------------------------
+    //     JSON Structure
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Parse the members of an object whose opening brace has been read,
+     * calling @p on_key for each key, which then has to consume the value.
+     */
+    template<class Callback>
+    void parse_object_( Callback on_key )
+    {
+        std::string key;
+        skip_ws_();
+        if( it_ && *it_ == '}' ) {
+            ++it_;
+            return;
+        }
+        while( true ) {
+            skip_ws_();
+            read_string_( key );
+            skip_ws_();
+            expect_( ':' );
+            skip_ws_();
+            on_key( key );
+            skip_ws_();
+            if( ! it_ ) {
+                error_( "Unexpected end of input in object" );
+            }
+            if( *it_ == ',' ) {
+                ++it_;
+            } else if( *it_ == '}' ) {
+                ++it_;
+                return;
+            } else {
+                error_( "Expecting ',' or '}' in object" );
+            }
+        }
+    }
+
+    /**
+     * @brief Parse the elements of an array, calling @p on_element for each of them.
+     *
+     * If @p opened is set, the opening bracket has already been read.
+     */
+    template<class Callback>
+    void parse_array_( Callback on_element, bool opened = false )
+    {
+        skip_ws_();
+        if( ! opened ) {
+            expect_( '[' );
+            skip_ws_();
+        }
+        if( it_ && *it_ == ']' ) {
+            ++it_;
+            return;
+        }
+        while( true ) {
+            skip_ws_();
+            on_element();
+            skip_ws_();
+            if( ! it_ ) {
+                error_( "Unexpected end of input in array" );
+            }
+            if( *it_ == ',' ) {
+                ++it_;
+            } else if( *it_ == ']' ) {
+                ++it_;
+                return;
+            } else {
+                error_( "Expecting ',' or ']' in array" );
+            }
+        }
+    }
+
+    void skip_value_()
+    {
+        skip_ws_();
+        if( ! it_ ) {
+            error_( "Unexpected end of input" );
+        }
+        switch( *it_ ) {
+            case '{': {
+                ++it_;
+                parse_object_( [&]( std::string const& ){
+                    skip_value_();
+                });
+                break;
+            }
+            case '[': {
+                parse_array_( [&](){
+                    skip_value_();
+                });
+                break;
+            }
+            case '"': {
+                read_string_( skip_buffer_ );
+                break;
+            }
+            default: {
+                // Numbers and literals (true, false, null).
+                while( it_ && *it_ != ',' && *it_ != '}' && *it_ != ']' && ! is_ws_( *it_ )) {
+                    ++it_;
+                }
+            }
+        }
+    }
+
+    // -------------------------------------------------------------------------
+    //     JSON Values
+    // -------------------------------------------------------------------------
+
+    void read_string_( std::string& target )
+    {
+        target.clear();
+        expect_( '"' );
+        while( true ) {
+            if( ! it_ ) {
+                error_( "Unexpected end of input in string" );
+            }
+            char c = *it_;
+            ++it_;
+            if( c == '"' ) {
+                return;
+            }
+            if( c != '\\' ) {
+                target += c;
+                continue;
+            }
+
+            // Escape sequences.
+            if( ! it_ ) {
+                error_( "Unexpected end of input in string" );
+            }
+            c = *it_;
+            ++it_;
+            switch( c ) {
+                case '"':  target += '"';  break;
+                case '\\': target += '\\'; break;
+                case '/':  target += '/';  break;
+                case 'b':  target += '\b'; break;
+                case 'f':  target += '\f'; break;
+                case 'n':  target += '\n'; break;
+                case 'r':  target += '\r'; break;
+                case 't':  target += '\t'; break;
+                case 'u': {
+                    append_utf8_( target, read_hex4_() );
+                    break;
+                }
+                default: {
+                    error_( "Invalid escape sequence in string" );
+                }
+            }
+        }
+    }
+
+    unsigned read_hex4_()
+    {
+        unsigned result = 0;
+        for( size_t i = 0; i < 4; ++i ) {
+            if( ! it_ ) {
+                error_( "Unexpected end of input in string" );
+            }
+            auto const c = *it_;
+            ++it_;
+            result <<= 4;
+            if( c >= '0' && c <= '9' ) {
+                result += static_cast<unsigned>( c - '0' );
+            } else if( c >= 'a' && c <= 'f' ) {
+                result += static_cast<unsigned>( c - 'a' + 10 );
+            } else if( c >= 'A' && c <= 'F' ) {
+                result += static_cast<unsigned>( c - 'A' + 10 );
+            } else {
+                error_( "Invalid unicode escape sequence in string" );
+            }
+        }
+        return result;
+    }
+
+    static void append_utf8_( std::string& target, unsigned cp )
+    {
+        // Surrogate pairs are not combined, as they do not occur in sequence names in practice.
+        if( cp < 0x80 ) {
+            target += static_cast<char>( cp );
+        } else if( cp < 0x800 ) {
+            target += static_cast<char>( 0xC0 | ( cp >> 6 ));
+            target += static_cast<char>( 0x80 | ( cp & 0x3F ));
+        } else {
+            target += static_cast<char>( 0xE0 | ( cp >> 12 ));
+            target += static_cast<char>( 0x80 | (( cp >> 6 ) & 0x3F ));
+            target += static_cast<char>( 0x80 | ( cp & 0x3F ));
+        }
+    }
+
+    double read_number_()
+    {
+        skip_ws_();
+
+        // Copy the characters of the number into a fixed buffer, so that we do not allocate.
+        char buffer[64];
+        size_t len = 0;
+        while( it_ && len < sizeof( buffer ) - 1 ) {
+            auto const c = *it_;
+            if(( c >= '0' && c <= '9' ) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' ) {
+                buffer[ len++ ] = c;
+                ++it_;
+            } else {
+                break;
+            }
+        }
+        buffer[ len ] = '\0';
+
+        char* end = nullptr;
+        auto const result = std::strtod( buffer, &end );
+        if( len == 0 || end != buffer + len ) {
+            error_( "Invalid number" );
+        }
+        return result;
+    }
+
+    double read_number_or_null_()
+    {
+        skip_ws_();
+        if( it_ && *it_ == 'n' ) {
+            for( char const c : { 'n', 'u', 'l', 'l' } ) {
+                expect_( c );
+            }
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        return read_number_();
+    }
+
+    // -------------------------------------------------------------------------
+    //     Helpers
+    // -------------------------------------------------------------------------
+
+    static bool is_ws_( char c )
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    void skip_ws_()
+    {
+        while( it_ && is_ws_( *it_ )) {
+            ++it_;
+        }
+    }
+
+    void expect_( char c )
+    {
+        if( ! it_ || *it_ != c ) {
+            error_( std::string( "Expecting '" ) + c + "'" );
+        }
+        ++it_;
+    }
+
+    [[noreturn]] void error_( std::string const& message ) const
+    {
+        throw std::runtime_error(
+            "Invalid jplace file " + it_.source_name() + " at " + it_.at() + ": " + message
+        );
+    }
+
+    genesis::utils::InputStream& it_;
+    JplaceScan& scan_;
+    bool store_placements_;
+    bool store_names_;
+
+    // Buffers, to avoid reallocations.
+    std::vector<double> multiplicities_;
+    std::string skip_buffer_;
+};
+
+// =================================================================================================
+//      Jplace Scanner
+// =================================================================================================
+
+JplaceScan JplaceScanner::scan( std::shared_ptr<genesis::utils::BaseInputSource> source ) const
+{
+    JplaceScan result;
+    genesis::utils::InputStream it( source );
+    JplaceScanParser( it, result, store_placements_, store_names_ ).parse_document();
+
+    if( result.tree.empty() ) {
+        throw std::runtime_error( "Invalid jplace file " + it.source_name() + ": No tree found." );
+    }
+    if( result.placement_count() > 0 && result.fields.size() != result.row_width ) {
+        throw std::runtime_error(
+            "Invalid jplace file " + it.source_name() + ": Number of fields (" +
+            std::to_string( result.fields.size() ) + ") does not match the number of values " +
+            "per placement (" + std::to_string( result.row_width ) + ")."
+        );
+    }
+    return result;
+}
+
+// =================================================================================================
+//      Helper Functions
+// =================================================================================================
+
+std::vector<size_t> edge_num_to_index_map( genesis::placement::PlacementTree const& tree )
+{
+    using namespace genesis::placement;
+
+    std::vector<size_t> result;
+    for( auto const& edge : tree.edges() ) {
+        auto const num = edge.data<PlacementEdgeData>().edge_num();
+        if( num < 0 ) {
+            continue;
+        }
+        auto const unum = static_cast<size_t>( num );
+        if( unum >= result.size() ) {
+            result.resize( unum + 1, JplaceScan::npos );
+        }
+        result[ unum ] = edge.index();
+    }
+    return result;
+}
+
+size_t jplace_edge_index( double edge_num, std::vector<size_t> const& edge_map )
+{
+    // The genesis reader expects edge nums to be integers, so we do the same here,
+    // instead of silently truncating values such as 1.5.
+    if(
+        ! std::isfinite( edge_num ) || edge_num < 0.0 || std::floor( edge_num ) != edge_num ||
+        edge_num >= static_cast<double>( edge_map.size() )
+    ) {
+        return JplaceScan::npos;
+    }
+    return edge_map[ static_cast<size_t>( edge_num ) ];
+}
+
+NewickCounts newick_counts( std::string const& newick )
+{
+    size_t commas = 0;
+    size_t parens = 0;
+    for( size_t i = 0; i < newick.size(); ++i ) {
+        switch( newick[i] ) {
+            case ',': {
+                ++commas;
+                break;
+            }
+            case '(': {
+                ++parens;
+                break;
+            }
+            case '\'': {
+                // Quoted label, where two single quotes are an escaped quote,
+                // which we can simply treat as the end of one and start of another label.
+                ++i;
+                while( i < newick.size() && newick[i] != '\'' ) {
+                    ++i;
+                }
+                break;
+            }
+            case '[': {
+                ++i;
+                while( i < newick.size() && newick[i] != ']' ) {
+                    ++i;
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    NewickCounts result;
+    if( newick.find_first_not_of( " \t\r\n;" ) == std::string::npos ) {
+        return result;
+    }
+    result.leaves = commas + 1;
+    result.edges  = commas + parens;
+    return result;
+}
+
+genesis::placement::Sample jplace_scan_to_sample(
+    JplaceScan const& scan,
+    genesis::placement::PlacementTree const& tree
+) {
+    using namespace genesis::placement;
+
+    // Find the fields that we need.
+    auto const edge_num_idx = scan.field_index( "edge_num" );
+    auto const like_idx     = scan.field_index( "likelihood" );
+    auto const lwr_idx      = scan.field_index( "like_weight_ratio" );
+    auto const distal_idx   = scan.field_index( "distal_length" );
+    auto const proximal_idx = scan.field_index( "proximal_length" );
+    auto const pendant_idx  = scan.field_index( "pendant_length" );
+    if( scan.pquery_count() > 0 && scan.placement_offsets.empty() ) {
+        throw std::runtime_error( "Cannot build Sample from jplace scan without placements." );
+    }
+    if( scan.placement_count() > 0 && edge_num_idx == JplaceScan::npos ) {
+        throw std::runtime_error( "Invalid jplace file: Field edge_num is missing." );
+    }
+
+    Sample sample( tree );
+    auto const edge_map = edge_num_to_index_map( sample.tree() );
+
+    for( size_t pqi = 0; pqi < scan.pquery_count(); ++pqi ) {
+        auto& pquery = sample.add();
+
+        for( size_t pi = scan.placement_offsets[pqi]; pi < scan.placement_offsets[pqi + 1]; ++pi ) {
+            auto const edge_num = scan.value( pi, edge_num_idx );
+            auto const edge_idx = jplace_edge_index( edge_num, edge_map );
+            if( edge_idx == JplaceScan::npos ) {
+                throw std::runtime_error(
+                    "Invalid jplace file: Placement with invalid edge_num " +
+                    std::to_string( edge_num ) + "."
+                );
+            }
+            auto& edge = sample.tree().edge_at( edge_idx );
+            auto& placement = pquery.add_placement( edge );
+
+            if( like_idx != JplaceScan::npos ) {
+                placement.likelihood = scan.value( pi, like_idx );
+            }
+            if( lwr_idx != JplaceScan::npos ) {
+                placement.like_weight_ratio = scan.value( pi, lwr_idx );
+            }
+            if( proximal_idx != JplaceScan::npos ) {
+                placement.proximal_length = scan.value( pi, proximal_idx );
+            } else if( distal_idx != JplaceScan::npos ) {
+                auto const branch_length = edge.data<PlacementEdgeData>().branch_length;
+                placement.proximal_length = branch_length - scan.value( pi, distal_idx );
+            }
+            if( pendant_idx != JplaceScan::npos ) {
+                placement.pendant_length = scan.value( pi, pendant_idx );
+            }
+        }
+
+        for( size_t ni = scan.name_offsets[pqi]; ni < scan.name_offsets[pqi + 1]; ++ni ) {
+            pquery.add_name(
+                scan.name_char_offsets.empty() ? std::string() : scan.name( ni ),
+                scan.multiplicities[ ni ]
+            );
+        }
+    }
+
+    return sample;
+}
@@ -0,0 +1,284 @@
+#ifndef GAPPA_TOOLS_JPLACE_SCANNER_H_
+#define GAPPA_TOOLS_JPLACE_SCANNER_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "genesis/placement/placement_tree.hpp"
+#include "genesis/placement/sample.hpp"
+#include "genesis/utils/io/input_source.hpp"
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//      Jplace Scan
+// =================================================================================================
+
+/**
+ * @brief Compact representation of the content of a jplace file, as produced by JplaceScanner.
+ *
+ * Instead of building a Sample with a PlacementTree and Pquery objects, the placements are kept
+ * as flat arrays of the raw values, in the order of the jplace `fields`. The tree is kept as
+ * the raw newick string, so that callers can decide whether and how to parse it.
+ */
+struct JplaceScan
+{
+    // -------------------------------------------------------------------------
+    //     Typedefs and Constants
+    // -------------------------------------------------------------------------
+
+    static size_t const npos = std::numeric_limits<size_t>::max();
+
+    // -------------------------------------------------------------------------
+    //     Accessors
+    // -------------------------------------------------------------------------
+
+    size_t pquery_count() const
+    {
+        return total_pqueries;
+    }
+
+    size_t placement_count() const
+    {
+        return total_placements;
+    }
+
+    size_t name_count() const
+    {
+        return total_names;
+    }
+
+    /**
+     * @brief Return the value of the placement with index @p placement for field @p field.
+     */
+    double value( size_t placement, size_t field ) const
+    {
+        return values[ placement * row_width + field ];
+    }
+
+    /**
+     * @brief Return the name with index @p index, if names were stored.
+     */
+    std::string name( size_t index ) const
+    {
+        return name_chars.substr(
+            name_char_offsets[ index ], name_char_offsets[ index + 1 ] - name_char_offsets[ index ]
+        );
+    }
+
+    /**
+     * @brief Return the sum of the multiplicities of the names of a pquery,
+     * if placements were stored.
+     *
+     * As in genesis, a pquery without names has a total multiplicity of 0.
+     */
+    double total_multiplicity( size_t pquery ) const;
+
+    /**
+     * @brief Return the index of a field, or `npos` if the field is not present.
+     */
+    size_t field_index( std::string const& field ) const;
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+    std::string              tree;
+    std::vector<std::string> fields;
+    int                      version = 0;
+
+    /**
+     * @brief Totals of the file, which are also filled if the placements are not stored.
+     */
+    size_t                   total_pqueries    = 0;
+    size_t                   total_placements  = 0;
+    size_t                   total_names       = 0;
+    double                   multiplicity_sum  = 0.0;
+
+    /**
+     * @brief Values of all placements, with `row_width` values per placement.
+     * The values and all following members are only filled if the scanner is set to store
+     * placements.
+     */
+    size_t                   row_width = 0;
+    std::vector<double>      values;
+
+    /**
+     * @brief Index of the first placement of each pquery, plus the total at the end.
+     */
+    std::vector<size_t>      placement_offsets;
+
+    /**
+     * @brief Index of the first name of each pquery, plus the total at the end.
+     */
+    std::vector<size_t>      name_offsets;
+
+    /**
+     * @brief Multiplicity of each name.
+     */
+    std::vector<double>      multiplicities;
+
+    /**
+     * @brief Names, concatenated, with the start of each name (plus the end) in the offsets.
+     * Only filled if the scanner is set to store placements and names.
+     */
+    std::string              name_chars;
+    std::vector<size_t>      name_char_offsets;
+};
+
+// =================================================================================================
+//      Jplace Scanner
+// =================================================================================================
+
+/**
+ * @brief Lightweight streaming reader for jplace files.
+ *
+ * The scanner reads the JSON of a jplace file in a single pass, without building a JSON document,
+ * and stores the placements in a JplaceScan. As the jplace standard does not specify the order of
+ * the top level keys, and some programs (such as EPA-ng) write the `fields` after the `placements`,
+ * the placement values are buffered, and only interpreted after scanning the whole file.
+ */
+class JplaceScanner
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    JplaceScanner()  = default;
+    ~JplaceScanner() = default;
+
+    JplaceScanner( JplaceScanner const& other ) = default;
+    JplaceScanner( JplaceScanner&& )            = default;
+
+    JplaceScanner& operator= ( JplaceScanner const& other ) = default;
+    JplaceScanner& operator= ( JplaceScanner&& )            = default;
+
+    // -------------------------------------------------------------------------
+    //     Settings
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Set whether to store pquery names. If not, only their multiplicities are kept.
+     */
+    JplaceScanner& store_names( bool value )
+    {
+        store_names_ = value;
+        return *this;
+    }
+
+    bool store_names() const
+    {
+        return store_names_;
+    }
+
+    /**
+     * @brief Set whether to store the placements at all.
+     *
+     * If not, the placement values are only checked for consistency, but not even converted to
+     * numbers, and only the totals of the JplaceScan are filled. This is the fast path for when
+     * only counts are needed.
+     */
+    JplaceScanner& store_placements( bool value )
+    {
+        store_placements_ = value;
+        return *this;
+    }
+
+    bool store_placements() const
+    {
+        return store_placements_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Scanning
+    // -------------------------------------------------------------------------
+
+    JplaceScan scan( std::shared_ptr<genesis::utils::BaseInputSource> source ) const;
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    bool store_names_      = true;
+    bool store_placements_ = true;
+
+};
+
+// =================================================================================================
+//      Helper Functions
+// =================================================================================================
+
+/**
+ * @brief Map from the `edge_num` of each edge of the @p tree to its index, with JplaceScan::npos
+ * for numbers that are not used by any edge.
+ */
+std::vector<size_t> edge_num_to_index_map( genesis::placement::PlacementTree const& tree );
+
+/**
+ * @brief Look up the edge index for an @p edge_num value of a placement, using the map
+ * from edge_num_to_index_map().
+ *
+ * Returns JplaceScan::npos if the value is not a non-negative integer, or not used by any edge.
+ */
+size_t jplace_edge_index( double edge_num, std::vector<size_t> const& edge_map );
+
+/**
+ * @brief Number of edges and leaves of a tree in newick format.
+ */
+struct NewickCounts
+{
+    size_t edges  = 0;
+    size_t leaves = 0;
+};
+
+/**
+ * @brief Count the edges and leaves of a newick tree, without parsing it.
+ *
+ * Every comma separates two nodes, and every opening parenthesis starts an inner node.
+ * Hence, for trees without nodes of degree two, the number of leaves is the number of commas
+ * plus one, and the number of edges is the number of commas plus the number of opening
+ * parentheses. Quoted labels and comments in square brackets are skipped.
+ */
+NewickCounts newick_counts( std::string const& newick );
+
+/**
+ * @brief Build a Sample from a JplaceScan, using a copy of the given reference @p tree,
+ * which needs to be the tree of the scanned jplace file.
+ *
+ * This does what the genesis JplaceReader does, but allows to parse the tree only once for many
+ * files, see JplaceInputOptions.
+ */
+genesis::placement::Sample jplace_scan_to_sample(
+    JplaceScan const& scan,
+    genesis::placement::PlacementTree const& tree
+);
+
+#endif // include guard
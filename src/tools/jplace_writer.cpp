@@ -0,0 +1,388 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/jplace_writer.hpp"
+
+#include "tools/file_blocks.hpp"
+
+#include "genesis/placement/formats/newick_writer.hpp"
+#include "genesis/placement/placement_tree.hpp"
+#include "genesis/utils/core/fs.hpp"
+#include "genesis/utils/core/genesis.hpp"
+#include "genesis/utils/core/options.hpp"
+#include "genesis/utils/io/output_stream.hpp"
+#include "genesis/utils/tools/date_time.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef GENESIS_OPENMP
+#   include <omp.h>
+#endif
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Append a number to the @p buffer, in the same format as writing it to a stream
+ * with default settings, but without the overhead of the stream.
+ */
+static void append_jplace_number( std::string& buffer, double value )
+{
+    char chars[32];
+    auto const n = std::snprintf( chars, sizeof( chars ), "%g", value );
+    if( n > 0 && static_cast<size_t>( n ) < sizeof( chars )) {
+        buffer.append( chars, static_cast<size_t>( n ));
+    }
+}
+
+/**
+ * @brief Append a string to the @p buffer as a JSON string, with quotation marks.
+ *
+ * New lines and tabs are escaped as usual, and all other control characters are written as
+ * `\u00XX`, as JSON does not allow them in strings.
+ */
+static void append_jplace_string( std::string& buffer, std::string const& value )
+{
+    buffer += '"';
+    for( auto const c : value ) {
+        switch( c ) {
+            case '"':  buffer += "\\\""; break;
+            case '\\': buffer += "\\\\"; break;
+            case '\n': buffer += "\\n";  break;
+            case '\t': buffer += "\\t";  break;
+            default: {
+                auto const u = static_cast<unsigned char>( c );
+                if( u < 0x20 ) {
+                    char chars[8];
+                    std::snprintf( chars, sizeof( chars ), "\\u%04x", static_cast<unsigned>( u ));
+                    buffer += chars;
+                } else {
+                    buffer += c;
+                }
+                break;
+            }
+        }
+    }
+    buffer += '"';
+}
+
+/**
+ * @brief Append a pquery in jplace format to the @p buffer, indented as the genesis JplaceWriter
+ * does, but without the trailing comma or new line.
+ *
+ * If a @p name is given, it is written as the only name of the pquery, instead of its own names.
+ */
+static void append_jplace_pquery(
+    std::string& buffer,
+    genesis::placement::Pquery const& pquery,
+    genesis::placement::PqueryName const* name = nullptr
+) {
+    using namespace genesis::placement;
+
+    buffer += "        {\n";
+    buffer += "            \"p\": [\n";
+    for( size_t i = 0; i < pquery.placement_size(); ++i ) {
+        auto const& placement = pquery.placement_at( i );
+        auto const& edge_data = placement.edge().data<PlacementEdgeData>();
+
+        buffer += "                [ ";
+        buffer += std::to_string( placement.edge_num() );
+        buffer += ", ";
+        append_jplace_number( buffer, placement.likelihood );
+        buffer += ", ";
+        append_jplace_number( buffer, placement.like_weight_ratio );
+        buffer += ", ";
+        append_jplace_number( buffer, edge_data.branch_length - placement.proximal_length );
+        buffer += ", ";
+        append_jplace_number( buffer, placement.pendant_length );
+        buffer += ( i + 1 < pquery.placement_size() ) ? " ],\n" : " ]\n";
+    }
+    buffer += "            ],\n";
+
+    // Only write multiplicities if there are any that are not the default.
+    auto const name_size = name ? 1 : pquery.name_size();
+    auto name_at = [&]( size_t i ) -> PqueryName const& {
+        return name ? *name : pquery.name_at( i );
+    };
+    bool has_nm = false;
+    for( size_t i = 0; i < name_size; ++i ) {
+        has_nm |= ( name_at( i ).multiplicity != 1.0 );
+    }
+    buffer += has_nm ? "            \"nm\": [ " : "            \"n\": [ ";
+    for( size_t i = 0; i < name_size; ++i ) {
+        auto const& pquery_name = name_at( i );
+        if( i > 0 ) {
+            buffer += ", ";
+        }
+        if( has_nm ) {
+            buffer += "[ ";
+            append_jplace_string( buffer, pquery_name.name );
+            buffer += ", ";
+            append_jplace_number( buffer, pquery_name.multiplicity );
+            buffer += " ]";
+        } else {
+            append_jplace_string( buffer, pquery_name.name );
+        }
+    }
+    buffer += " ]\n";
+    buffer += "        }";
+}
+
+/**
+ * @brief Return the beginning of a jplace file for the @p tree, up to the opening bracket of the
+ * placements, in the same layout as the genesis JplaceWriter.
+ */
+static std::string jplace_header( genesis::placement::PlacementTree const& tree )
+{
+    using namespace genesis;
+    using namespace genesis::placement;
+    using namespace genesis::utils;
+
+    std::string header;
+    header += "{\n";
+    header += "    \"version\": 3,\n";
+    header += "    \"metadata\": {\n";
+    header += "        \"program\": \"genesis " + genesis_version() + "\",\n";
+    header += "        \"invocation\": ";
+    append_jplace_string( header, Options::get().command_line_string() );
+    header += ",\n";
+    header += "        \"created\": \"" + current_date() + " " + current_time() + "\"\n";
+    header += "    },\n";
+    header += "    \"tree\": \"" + PlacementTreeNewickWriter().to_string( tree ) + "\",\n";
+    header += "    \"fields\": [ \"edge_num\", \"likelihood\", \"like_weight_ratio\", ";
+    header += "\"distal_length\", \"pendant_length\" ],\n";
+    header += "    \"placements\": [\n";
+    return header;
+}
+
+// =================================================================================================
+//      Writing
+// =================================================================================================
+
+void ParallelJplaceWriter::write(
+    genesis::placement::Sample const& sample,
+    FileOutputOptions const& file_output,
+    std::string const& infix
+) const {
+    // Create dir if needed, as FileOutputOptions::get_output_target() does.
+    genesis::utils::dir_create( file_output.out_dir(), true );
+    write( sample, file_output.get_output_filename( infix, "jplace" ), file_output.compress() );
+}
+
+void ParallelJplaceWriter::write(
+    genesis::placement::Sample const& sample,
+    std::string const& file_path,
+    bool compress
+) const {
+    using namespace genesis;
+    using namespace genesis::placement;
+    using namespace genesis::utils;
+
+    std::ofstream ofs;
+    file_output_stream( file_path, ofs, std::ios_base::out | std::ios_base::binary );
+    auto write_block = [&]( std::string const& text ){
+        if( compress ) {
+            auto const block = gzip_block( text );
+            ofs.write( block.data(), static_cast<std::streamsize>( block.size() ));
+        } else {
+            ofs.write( text.data(), static_cast<std::streamsize>( text.size() ));
+        }
+        if( ! ofs ) {
+            throw std::runtime_error( "Cannot write to jplace file " + file_path );
+        }
+    };
+
+    // Header, including the tree.
+    write_block( jplace_header( sample.tree() ));
+
+    // Pqueries, in blocks. Each block is formatted and compressed independently, and the blocks
+    // are written in order. This needs memory for about as many blocks as there are threads.
+    // Exceptions cannot leave the parallel region, so we keep the first one, skip the remaining
+    // blocks, and rethrow it afterwards.
+    auto const block_size = std::max<size_t>( 1, block_size_ );
+    auto const num_blocks = ( sample.size() + block_size - 1 ) / block_size;
+    std::exception_ptr error;
+    auto const failed = [&](){
+        bool result = false;
+        #pragma omp critical(GAPPA_JPLACE_WRITER_ERROR)
+        {
+            result = static_cast<bool>( error );
+        }
+        return result;
+    };
+    auto const set_error = [&]( std::exception_ptr ptr ){
+        #pragma omp critical(GAPPA_JPLACE_WRITER_ERROR)
+        {
+            if( ! error ) {
+                error = ptr;
+            }
+        }
+    };
+
+    #pragma omp parallel for schedule(dynamic) ordered
+    for( size_t bi = 0; bi < num_blocks; ++bi ) {
+        auto const first = bi * block_size;
+        auto const last  = std::min( first + block_size, sample.size() );
+
+        std::string text;
+        if( ! failed() ) {
+            try {
+                for( size_t i = first; i < last; ++i ) {
+                    append_jplace_pquery( text, sample.at( i ));
+                    text += ( i + 1 < sample.size() ) ? ",\n" : "\n";
+                }
+                if( compress ) {
+                    text = gzip_block( text );
+                }
+            } catch( ... ) {
+                set_error( std::current_exception() );
+            }
+        }
+
+        #pragma omp ordered
+        {
+            if( ! failed() ) {
+                ofs.write( text.data(), static_cast<std::streamsize>( text.size() ));
+                if( ! ofs ) {
+                    set_error( std::make_exception_ptr( std::runtime_error(
+                        "Cannot write to jplace file " + file_path
+                    )));
+                }
+            }
+        }
+    }
+    if( error ) {
+        std::rethrow_exception( error );
+    }
+
+    // Footer.
+    write_block( "    ]\n}\n" );
+}
+
+// =================================================================================================
+//      Jplace Stream Writer
+// =================================================================================================
+
+JplaceStreamWriter::JplaceStreamWriter(
+    std::string const& file_path,
+    genesis::placement::PlacementTree const& tree,
+    bool compress
+)
+    : file_path_( file_path )
+    , compress_( compress )
+{
+    // Create the file with the header. Everything else is appended to it later.
+    create_block_file( file_path_, jplace_header( tree ), compress_ );
+}
+
+JplaceStreamWriter::~JplaceStreamWriter()
+{
+    // If the file was not finished, something went wrong, for example, an exception ended the
+    // run early. We do not want to leave a file that looks valid, but misses pqueries.
+    if( ! finished_ ) {
+        std::remove( file_path_.c_str() );
+    }
+}
+
+void JplaceStreamWriter::append(
+    genesis::placement::Sample const& sample,
+    std::vector<size_t> const& pquery_indices
+) {
+    append_( pquery_indices.size(), [&]( std::string& text, size_t i ){
+        auto const& pquery = sample.at( pquery_indices[i] );
+        append_jplace_pquery( text, pquery );
+        return pquery.name_size();
+    });
+}
+
+void JplaceStreamWriter::append(
+    genesis::placement::Sample const& sample,
+    std::vector<std::pair<size_t, genesis::placement::PqueryName>> const& pqueries
+) {
+    append_( pqueries.size(), [&]( std::string& text, size_t i ){
+        append_jplace_pquery( text, sample.at( pqueries[i].first ), &pqueries[i].second );
+        return size_t( 1 );
+    });
+}
+
+void JplaceStreamWriter::finish()
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    if( finished_ ) {
+        return;
+    }
+    finished_ = true;
+
+    buffer_ += ( pquery_count_ > 0 ? "\n" : "" ) + std::string( "    ]\n}\n" );
+    flush_();
+}
+
+void JplaceStreamWriter::append_(
+    size_t count,
+    std::function<size_t( std::string&, size_t )> const& format_pquery
+) {
+    // Format the pqueries in blocks, without holding the lock, and then add each block to the
+    // buffer at once, so that pqueries of other threads are not interleaved.
+    auto const block_size = std::max<size_t>( 1, block_size_ );
+    for( size_t first = 0; first < count; first += block_size ) {
+        auto const last = std::min( first + block_size, count );
+
+        std::string text;
+        size_t name_count = 0;
+        for( size_t i = first; i < last; ++i ) {
+            if( i > first ) {
+                text += ",\n";
+            }
+            name_count += format_pquery( text, i );
+        }
+
+        std::lock_guard<std::mutex> lock( mutex_ );
+        if( finished_ ) {
+            throw std::runtime_error( "Cannot append to finished jplace file " + file_path_ );
+        }
+        if( pquery_count_ > 0 ) {
+            buffer_ += ",\n";
+        }
+        buffer_ += text;
+        pquery_count_ += last - first;
+        name_count_   += name_count;
+        if( buffer_.size() >= buffer_size_ ) {
+            flush_();
+        }
+    }
+}
+
+void JplaceStreamWriter::flush_()
+{
+    // We only open the file while writing to it, so that many writers can be used at the same time
+    // without running into the limit of open files of the system.
+    append_block_file( file_path_, buffer_, compress_ );
+    buffer_.clear();
+}
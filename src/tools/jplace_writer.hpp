@@ -0,0 +1,246 @@
+#ifndef GAPPA_TOOLS_JPLACE_WRITER_H_
+#define GAPPA_TOOLS_JPLACE_WRITER_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "options/file_output.hpp"
+
+#include "genesis/placement/placement_tree.hpp"
+#include "genesis/placement/sample.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+//      Parallel Jplace Writer
+// =================================================================================================
+
+/**
+ * @brief Write a Sample to a jplace file, formatting and compressing the pqueries in parallel.
+ *
+ * The output uses the same layout as the genesis JplaceWriter. The pqueries are split into
+ * blocks of block_size() many pqueries, which are formatted in parallel, and written in order.
+ * If compression is used, each block is compressed individually, and written as a separate
+ * gzip member. Concatenated gzip members are valid gzip files (as written by `pigz`), so that
+ * the result can be read by any gzip reader.
+ */
+class ParallelJplaceWriter
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    ParallelJplaceWriter()  = default;
+    ~ParallelJplaceWriter() = default;
+
+    ParallelJplaceWriter( ParallelJplaceWriter const& other ) = default;
+    ParallelJplaceWriter( ParallelJplaceWriter&& )            = default;
+
+    ParallelJplaceWriter& operator= ( ParallelJplaceWriter const& other ) = default;
+    ParallelJplaceWriter& operator= ( ParallelJplaceWriter&& )            = default;
+
+    // -------------------------------------------------------------------------
+    //     Settings
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Set the number of pqueries that are formatted (and compressed) as one block.
+     */
+    ParallelJplaceWriter& block_size( size_t value )
+    {
+        block_size_ = value;
+        return *this;
+    }
+
+    size_t block_size() const
+    {
+        return block_size_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Writing
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Write the @p sample to a jplace file, whose name is obtained from the
+     * @p file_output options with the given @p infix, using their compression setting.
+     */
+    void write(
+        genesis::placement::Sample const& sample,
+        FileOutputOptions const& file_output,
+        std::string const& infix
+    ) const;
+
+    /**
+     * @brief Write the @p sample to the file at @p file_path, optionally gzip compressed.
+     */
+    void write(
+        genesis::placement::Sample const& sample,
+        std::string const& file_path,
+        bool compress
+    ) const;
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    size_t block_size_ = 4096;
+
+};
+
+// =================================================================================================
+//      Jplace Stream Writer
+// =================================================================================================
+
+/**
+ * @brief Write a jplace file incrementally, by appending pqueries to it.
+ *
+ * The header of the file, including the tree, is written on construction, and the pqueries are
+ * then appended, so that they do not have to be collected in a Sample first. The file is complete
+ * once finish() is called. If the writer is destroyed before that, for example because an error
+ * ended the run early, the incomplete file is removed. The layout and the compression are the
+ * same as for the ParallelJplaceWriter.
+ *
+ * Appended pqueries are formatted right away, and collected in a buffer, which is written to the
+ * file once it reaches buffer_size() bytes. The file is only opened for writing the buffer, so that
+ * a large number of writers can be used at the same time. Appending is thread safe, so that
+ * several threads can write to the same file; the pqueries are formatted without holding the lock.
+ */
+class JplaceStreamWriter
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    JplaceStreamWriter(
+        std::string const& file_path,
+        genesis::placement::PlacementTree const& tree,
+        bool compress
+    );
+
+    ~JplaceStreamWriter();
+
+    JplaceStreamWriter( JplaceStreamWriter const& other ) = delete;
+    JplaceStreamWriter( JplaceStreamWriter&& )            = delete;
+
+    JplaceStreamWriter& operator= ( JplaceStreamWriter const& other ) = delete;
+    JplaceStreamWriter& operator= ( JplaceStreamWriter&& )            = delete;
+
+    // -------------------------------------------------------------------------
+    //     Settings and Accessors
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Set the number of bytes of formatted pqueries that are buffered before writing them
+     * to the file (and compressing them, if needed).
+     */
+    JplaceStreamWriter& buffer_size( size_t value )
+    {
+        buffer_size_ = value;
+        return *this;
+    }
+
+    size_t buffer_size() const
+    {
+        return buffer_size_;
+    }
+
+    size_t pquery_count() const
+    {
+        return pquery_count_;
+    }
+
+    size_t name_count() const
+    {
+        return name_count_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Writing
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Append the pqueries at the given @p pquery_indices of the @p sample to the file.
+     *
+     * The tree of the @p sample is expected to be compatible with the one of the file.
+     */
+    void append(
+        genesis::placement::Sample const& sample,
+        std::vector<size_t> const& pquery_indices
+    );
+
+    /**
+     * @brief Append the pqueries at the given indices of the @p sample to the file,
+     * each with the given name as its only name, instead of the names of the pquery.
+     */
+    void append(
+        genesis::placement::Sample const& sample,
+        std::vector<std::pair<size_t, genesis::placement::PqueryName>> const& pqueries
+    );
+
+    /**
+     * @brief Write the end of the file. This has to be called to complete the file.
+     */
+    void finish();
+
+private:
+
+    void append_(
+        size_t count,
+        std::function<size_t( std::string&, size_t )> const& format_pquery
+    );
+
+    void flush_();
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    std::string file_path_;
+    bool compress_;
+    size_t block_size_  = 4096;
+    size_t buffer_size_ = 256 * 1024;
+
+    std::string buffer_;
+    std::mutex mutex_;
+    bool finished_ = false;
+
+    size_t pquery_count_ = 0;
+    size_t name_count_   = 0;
+
+};
+
+#endif // include guard
@@ -0,0 +1,135 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/mapped_file.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+static std::runtime_error mapped_file_error( std::string const& path, std::string const& what )
+{
+    return std::runtime_error(
+        "Cannot " + what + " memory-mapped file " + path + ": " + std::strerror( errno )
+    );
+}
+
+// =================================================================================================
+//      Constructor and Rule of Five
+// =================================================================================================
+
+MappedFile::~MappedFile()
+{
+    // No throwing in destructors. If unmapping fails, there is nothing we can do anyway.
+    if( data_ ) {
+        ::munmap( data_, size_ );
+    }
+    if( fd_ >= 0 ) {
+        ::close( fd_ );
+    }
+}
+
+std::shared_ptr<MappedFile> MappedFile::create( std::string const& path, size_t size )
+{
+    if( size == 0 ) {
+        throw std::invalid_argument( "Cannot create empty memory-mapped file " + path );
+    }
+
+    // Use the private constructor, so that the RAII cleanup takes care of partial failures.
+    auto result = std::shared_ptr<MappedFile>( new MappedFile() );
+    result->path_     = path;
+    result->size_     = size;
+    result->writable_ = true;
+
+    result->fd_ = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( result->fd_ < 0 ) {
+        throw mapped_file_error( path, "create" );
+    }
+    if( ::ftruncate( result->fd_, static_cast<off_t>( size )) != 0 ) {
+        throw mapped_file_error( path, "resize" );
+    }
+
+    auto const ptr = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, result->fd_, 0 );
+    if( ptr == MAP_FAILED ) {
+        throw mapped_file_error( path, "map" );
+    }
+    result->data_ = static_cast<char*>( ptr );
+    return result;
+}
+
+std::shared_ptr<MappedFile> MappedFile::open( std::string const& path, bool writable )
+{
+    auto result = std::shared_ptr<MappedFile>( new MappedFile() );
+    result->path_     = path;
+    result->writable_ = writable;
+
+    result->fd_ = ::open( path.c_str(), writable ? O_RDWR : O_RDONLY );
+    if( result->fd_ < 0 ) {
+        throw mapped_file_error( path, "open" );
+    }
+
+    struct stat st;
+    if( ::fstat( result->fd_, &st ) != 0 ) {
+        throw mapped_file_error( path, "stat" );
+    }
+    if( st.st_size <= 0 ) {
+        throw std::runtime_error( "Cannot map empty file " + path );
+    }
+    result->size_ = static_cast<size_t>( st.st_size );
+
+    auto const prot = writable ? ( PROT_READ | PROT_WRITE ) : PROT_READ;
+    auto const ptr = ::mmap( nullptr, result->size_, prot, MAP_SHARED, result->fd_, 0 );
+    if( ptr == MAP_FAILED ) {
+        throw mapped_file_error( path, "map" );
+    }
+    result->data_ = static_cast<char*>( ptr );
+    return result;
+}
+
+// =================================================================================================
+//      Operations
+// =================================================================================================
+
+void MappedFile::sync() const
+{
+    if( data_ && writable_ && ::msync( data_, size_, MS_SYNC ) != 0 ) {
+        throw mapped_file_error( path_, "sync" );
+    }
+}
+
+void MappedFile::advise_sequential() const
+{
+    // Only a hint, so we do not care whether it worked.
+    if( data_ ) {
+        ::madvise( data_, size_, MADV_SEQUENTIAL );
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef GAPPA_TOOLS_MAPPED_FILE_H_
+#define GAPPA_TOOLS_MAPPED_FILE_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// =================================================================================================
+//      Mapped File
+// =================================================================================================
+
+/**
+ * @brief Memory-mapped file, for data that does not fit into main memory.
+ *
+ * The class maps a whole file into the address space of the process, and unmaps it again on
+ * destruction. Instances are neither copyable nor movable; use the static create() and open()
+ * functions, which return a `std::shared_ptr`, so that several objects can share one mapping.
+ */
+class MappedFile
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    ~MappedFile();
+
+    MappedFile( MappedFile const& other ) = delete;
+    MappedFile( MappedFile&& )            = delete;
+
+    MappedFile& operator= ( MappedFile const& other ) = delete;
+    MappedFile& operator= ( MappedFile&& )            = delete;
+
+    /**
+     * @brief Create a file of the given @p size (or truncate an existing one to that size),
+     * and map it for reading and writing.
+     *
+     * The content of the file is zero-initialized by the operating system.
+     */
+    static std::shared_ptr<MappedFile> create( std::string const& path, size_t size );
+
+    /**
+     * @brief Map an existing file, either read-only, or, if @p writable is set, for reading
+     * and writing.
+     */
+    static std::shared_ptr<MappedFile> open( std::string const& path, bool writable = false );
+
+    // -------------------------------------------------------------------------
+    //     Accessors
+    // -------------------------------------------------------------------------
+
+    std::string const& path() const
+    {
+        return path_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool writable() const
+    {
+        return writable_;
+    }
+
+    char* data()
+    {
+        return data_;
+    }
+
+    char const* data() const
+    {
+        return data_;
+    }
+
+    // -------------------------------------------------------------------------
+    //     Operations
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Flush changes of a writable mapping to disk.
+     */
+    void sync() const;
+
+    /**
+     * @brief Hint to the operating system that the mapping is going to be read sequentially.
+     */
+    void advise_sequential() const;
+
+    // -------------------------------------------------------------------------
+    //     Internal Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    MappedFile() = default;
+
+    std::string path_;
+    size_t      size_     = 0;
+    bool        writable_ = false;
+    int         fd_       = -1;
+    char*       data_     = nullptr;
+
+};
+
+#endif // include guard
@@ -0,0 +1,128 @@
+#ifndef GAPPA_TOOLS_PARALLEL_CHUNKS_H_
+#define GAPPA_TOOLS_PARALLEL_CHUNKS_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "genesis/utils/core/options.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <limits>
+
+// =================================================================================================
+//      Parallel Chunks
+// =================================================================================================
+
+/**
+ * @brief Number of chunks to split @p item_count items into for parallel processing.
+ *
+ * We use a few chunks per thread, so that threads that are done with their chunks can take over
+ * others when the items differ in size, but never more chunks than items, and at least one.
+ * Without an item count, this is the number of chunks for batches of unknown size.
+ */
+inline size_t parallel_chunk_count( size_t item_count = std::numeric_limits<size_t>::max() )
+{
+    auto const threads = std::max<size_t>( 1, genesis::utils::Options::get().number_of_threads() );
+    return std::max<size_t>( 1, std::min<size_t>( item_count, 4 * threads ));
+}
+
+/**
+ * @brief First item of chunk @p chunk_index when splitting @p item_count items into
+ * @p chunk_count contiguous chunks of (nearly) equal size.
+ *
+ * The chunk ends where the next one begins, that is, at `chunk_index + 1`.
+ */
+inline size_t parallel_chunk_begin( size_t chunk_index, size_t chunk_count, size_t item_count )
+{
+    return chunk_index * item_count / chunk_count;
+}
+
+/**
+ * @brief Call @p function for each of @p chunk_count contiguous chunks of @p item_count items,
+ * in parallel.
+ *
+ * The function is called as `function( chunk_index, first, last )` for the items in the range
+ * `[ first, last )`. The chunks are scheduled dynamically, but their items do not depend on the
+ * number of threads or the scheduling. Hence, callers that keep per-chunk state (indexed by the
+ * chunk index) and combine it in chunk order after this function returns get deterministic
+ * results. Use parallel_chunk_count() to get a suitable number of chunks.
+ *
+ * Exceptions must not leave an OpenMP region, so the first exception thrown by the function is
+ * kept, the remaining chunks are skipped, and the exception is rethrown once all threads are done.
+ */
+template<class Function>
+void parallel_for_chunks( size_t item_count, size_t chunk_count, Function function )
+{
+    std::exception_ptr error;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t ci = 0; ci < chunk_count; ++ci ) {
+        bool failed = false;
+        #pragma omp critical(GAPPA_PARALLEL_CHUNKS_ERROR)
+        {
+            failed = static_cast<bool>( error );
+        }
+        if( failed ) {
+            continue;
+        }
+
+        try {
+            function(
+                ci,
+                parallel_chunk_begin( ci,     chunk_count, item_count ),
+                parallel_chunk_begin( ci + 1, chunk_count, item_count )
+            );
+        } catch( ... ) {
+            #pragma omp critical(GAPPA_PARALLEL_CHUNKS_ERROR)
+            {
+                if( ! error ) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if( error ) {
+        std::rethrow_exception( error );
+    }
+}
+
+/**
+ * @brief Call @p function for each of @p item_count items, in parallel, as
+ * `function( item_index )`.
+ *
+ * This is parallel_for_chunks() with one chunk per item, for loops where each item is a larger
+ * piece of work on its own, such as writing a tree, so that they are scheduled individually.
+ * Exceptions are handled the same way.
+ */
+template<class Function>
+void parallel_for_items( size_t item_count, Function function )
+{
+    parallel_for_chunks( item_count, item_count, [&]( size_t index, size_t, size_t ){
+        function( index );
+    });
+}
+
+#endif // include guard
@@ -0,0 +1,222 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/profile_matrix.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Read a value of type T from a possibly unaligned position in memory.
+ */
+template<typename T>
+static inline double load_value( char const* ptr )
+{
+    T value;
+    std::memcpy( &value, ptr, sizeof( T ));
+    return static_cast<double>( value );
+}
+
+template<typename T>
+static inline void store_value( char* ptr, double value )
+{
+    auto const tmp = static_cast<T>( value );
+    std::memcpy( ptr, &tmp, sizeof( T ));
+}
+
+// =================================================================================================
+//      Constructor and Rule of Five
+// =================================================================================================
+
+ProfileMatrix::ProfileMatrix( size_t rows, size_t cols )
+    : rows_( rows )
+    , cols_( cols )
+    , value_type_( ValueType::kFloat64 )
+    , data_( rows * cols, 0.0 )
+{}
+
+ProfileMatrix::ProfileMatrix(
+    std::shared_ptr<MappedFile> file,
+    size_t offset,
+    size_t rows,
+    size_t cols,
+    ValueType value_type
+)
+    : rows_( rows )
+    , cols_( cols )
+    , value_type_( value_type )
+    , file_( file )
+    , offset_( offset )
+{
+    if( ! file_ || offset_ + byte_size( rows_, cols_, value_type_ ) > file_->size() ) {
+        throw std::runtime_error(
+            "Memory-mapped file is too small for a profile matrix of the requested size."
+        );
+    }
+}
+
+size_t ProfileMatrix::byte_size( size_t rows, size_t cols, ValueType value_type )
+{
+    return rows * cols * static_cast<size_t>( value_type );
+}
+
+// =================================================================================================
+//      Element Access
+// =================================================================================================
+
+char const* ProfileMatrix::row_ptr_( size_t row ) const
+{
+    assert( row < rows_ );
+    if( file_ ) {
+        auto const row_bytes = cols_ * static_cast<size_t>( value_type_ );
+        return file_->data() + offset_ + row * row_bytes;
+    }
+    return reinterpret_cast<char const*>( data_.data() + row * cols_ );
+}
+
+double ProfileMatrix::operator () ( size_t row, size_t col ) const
+{
+    if( row >= rows_ || col >= cols_ ) {
+        throw std::out_of_range( "Profile matrix index out of range." );
+    }
+    if( ! file_ ) {
+        return data_[ row * cols_ + col ];
+    }
+    auto const ptr = row_ptr_( row ) + col * static_cast<size_t>( value_type_ );
+    return value_type_ == ValueType::kFloat32 ? load_value<float>( ptr ) : load_value<double>( ptr );
+}
+
+std::vector<double> ProfileMatrix::row( size_t row ) const
+{
+    auto result = std::vector<double>( cols_ );
+    read_row( row, result.data() );
+    return result;
+}
+
+std::vector<double> ProfileMatrix::col( size_t col ) const
+{
+    auto result = std::vector<double>();
+    read_col_block( col, 1, result );
+    return result;
+}
+
+void ProfileMatrix::read_row( size_t row, double* buffer ) const
+{
+    if( row >= rows_ ) {
+        throw std::out_of_range( "Profile matrix row index out of range." );
+    }
+    auto const ptr = row_ptr_( row );
+    if( value_type_ == ValueType::kFloat64 ) {
+        std::memcpy( buffer, ptr, cols_ * sizeof( double ));
+    } else {
+        for( size_t c = 0; c < cols_; ++c ) {
+            buffer[c] = load_value<float>( ptr + c * sizeof( float ));
+        }
+    }
+}
+
+void ProfileMatrix::read_col_block(
+    size_t first_col, size_t count, std::vector<double>& buffer
+) const {
+    if( first_col + count > cols_ ) {
+        throw std::out_of_range( "Profile matrix column index out of range." );
+    }
+    buffer.resize( count * rows_ );
+    read_col_block( first_col, count, 0, rows_, buffer.data() );
+}
+
+void ProfileMatrix::read_col_block(
+    size_t first_col, size_t count, size_t first_row, size_t last_row, double* buffer
+) const {
+    if( first_col + count > cols_ ) {
+        throw std::out_of_range( "Profile matrix column index out of range." );
+    }
+    if( first_row > last_row || last_row > rows_ ) {
+        throw std::out_of_range( "Profile matrix row index out of range." );
+    }
+
+    // Go through the rows in storage order, and scatter each row segment into the columns
+    // of the buffer. This touches every page of the (mapped) storage at most once per block.
+    auto const width = static_cast<size_t>( value_type_ );
+    for( size_t r = first_row; r < last_row; ++r ) {
+        auto const ptr = row_ptr_( r ) + first_col * width;
+        if( value_type_ == ValueType::kFloat64 ) {
+            for( size_t c = 0; c < count; ++c ) {
+                buffer[ c * rows_ + r ] = load_value<double>( ptr + c * width );
+            }
+        } else {
+            for( size_t c = 0; c < count; ++c ) {
+                buffer[ c * rows_ + r ] = load_value<float>( ptr + c * width );
+            }
+        }
+    }
+}
+
+void ProfileMatrix::set_row( size_t row, std::vector<double> const& values )
+{
+    if( row >= rows_ ) {
+        throw std::out_of_range( "Profile matrix row index out of range." );
+    }
+    if( values.size() != cols_ ) {
+        throw std::runtime_error(
+            "Cannot set profile matrix row with " + std::to_string( values.size() ) +
+            " values, as the matrix has " + std::to_string( cols_ ) + " columns."
+        );
+    }
+
+    if( ! file_ ) {
+        std::copy( values.begin(), values.end(), data_.begin() + row * cols_ );
+        return;
+    }
+    if( ! file_->writable() ) {
+        throw std::runtime_error( "Cannot write to read-only profile matrix " + file_->path() );
+    }
+
+    // We only ever get const access to the mapping via row_ptr_(), but know that it is writable.
+    auto ptr = const_cast<char*>( row_ptr_( row ));
+    if( value_type_ == ValueType::kFloat64 ) {
+        std::memcpy( ptr, values.data(), cols_ * sizeof( double ));
+    } else {
+        for( size_t c = 0; c < cols_; ++c ) {
+            store_value<float>( ptr + c * sizeof( float ), values[c] );
+        }
+    }
+}
+
+genesis::utils::Matrix<double> ProfileMatrix::to_matrix() const
+{
+    auto result = genesis::utils::Matrix<double>( rows_, cols_ );
+    if( cols_ == 0 ) {
+        return result;
+    }
+    for( size_t r = 0; r < rows_; ++r ) {
+        read_row( r, &result( r, 0 ));
+    }
+    return result;
+}
@@ -0,0 +1,225 @@
+#ifndef GAPPA_TOOLS_PROFILE_MATRIX_H_
+#define GAPPA_TOOLS_PROFILE_MATRIX_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/mapped_file.hpp"
+
+#include "genesis/utils/containers/matrix.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//      Profile Matrix
+// =================================================================================================
+
+/**
+ * @brief Row-major matrix of per-sample edge values, as used for the placement profile.
+ *
+ * The matrix either keeps its values in memory as `double`, or is backed by a region of a
+ * MappedFile, in which case the values are stored as either `double` or `float`. The latter
+ * allows to work with profiles that are larger than main memory. In both cases, the values
+ * are accessed as `double`.
+ *
+ * Rows are samples, columns are edges. Different rows can be written concurrently via set_row().
+ */
+class ProfileMatrix
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Typedefs and Enums
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Value type of the storage. The enum value is the size of the type in bytes.
+     */
+    enum class ValueType : uint8_t
+    {
+        kFloat32 = 4,
+        kFloat64 = 8
+    };
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    ProfileMatrix() = default;
+
+    /**
+     * @brief Create an in-memory matrix of the given dimensions, initialized with zeros.
+     */
+    ProfileMatrix( size_t rows, size_t cols );
+
+    /**
+     * @brief Create a matrix that uses the given @p file, starting at byte @p offset,
+     * as its storage.
+     */
+    ProfileMatrix(
+        std::shared_ptr<MappedFile> file,
+        size_t offset,
+        size_t rows,
+        size_t cols,
+        ValueType value_type
+    );
+
+    ~ProfileMatrix() = default;
+
+    ProfileMatrix( ProfileMatrix const& other ) = default;
+    ProfileMatrix( ProfileMatrix&& )            = default;
+
+    ProfileMatrix& operator= ( ProfileMatrix const& other ) = default;
+    ProfileMatrix& operator= ( ProfileMatrix&& )            = default;
+
+    // -------------------------------------------------------------------------
+    //     Properties
+    // -------------------------------------------------------------------------
+
+    size_t rows() const
+    {
+        return rows_;
+    }
+
+    size_t cols() const
+    {
+        return cols_;
+    }
+
+    size_t size() const
+    {
+        return rows_ * cols_;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    bool is_mapped() const
+    {
+        return static_cast<bool>( file_ );
+    }
+
+    ValueType value_type() const
+    {
+        return value_type_;
+    }
+
+    /**
+     * @brief Return the file backing the matrix, or an empty pointer for in-memory matrices.
+     */
+    std::shared_ptr<MappedFile> const& file() const
+    {
+        return file_;
+    }
+
+    /**
+     * @brief Return the number of bytes needed to store a matrix of the given dimensions.
+     */
+    static size_t byte_size( size_t rows, size_t cols, ValueType value_type );
+
+    // -------------------------------------------------------------------------
+    //     Element Access
+    // -------------------------------------------------------------------------
+
+    double operator () ( size_t row, size_t col ) const;
+
+    /**
+     * @brief Return a copy of the values of a row.
+     */
+    std::vector<double> row( size_t row ) const;
+
+    /**
+     * @brief Return a copy of the values of a column.
+     *
+     * This is a strided access. For iterating many columns, prefer read_col_block().
+     */
+    std::vector<double> col( size_t col ) const;
+
+    /**
+     * @brief Copy the row into the given buffer, which needs to have space for cols() values.
+     */
+    void read_row( size_t row, double* buffer ) const;
+
+    /**
+     * @brief Copy a block of @p count consecutive columns, starting at @p first_col,
+     * into @p buffer in column-major order.
+     *
+     * That is, afterwards, `buffer[ c * rows() + r ]` contains the value at `( r, first_col + c )`.
+     * The rows are traversed in storage order, so that this is the efficient way to stream over
+     * the columns of a large (memory-mapped) matrix.
+     */
+    void read_col_block( size_t first_col, size_t count, std::vector<double>& buffer ) const;
+
+    /**
+     * @brief Copy the rows `[ first_row, last_row )` of a block of @p count consecutive columns,
+     * starting at @p first_col, into @p buffer, using the same layout as read_col_block().
+     *
+     * The @p buffer needs to have space for `count * rows()` values, of which only the values of
+     * the given rows are written. This way, several threads can each fill a slab of rows of the
+     * same buffer.
+     */
+    void read_col_block(
+        size_t first_col, size_t count, size_t first_row, size_t last_row, double* buffer
+    ) const;
+
+    /**
+     * @brief Set the values of a row.
+     *
+     * This can be called concurrently for different rows.
+     */
+    void set_row( size_t row, std::vector<double> const& values );
+
+    /**
+     * @brief Copy the whole matrix into a genesis Matrix in memory.
+     */
+    genesis::utils::Matrix<double> to_matrix() const;
+
+    // -------------------------------------------------------------------------
+    //     Internal Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    char const* row_ptr_( size_t row ) const;
+
+    size_t rows_ = 0;
+    size_t cols_ = 0;
+    ValueType value_type_ = ValueType::kFloat64;
+
+    // In-memory storage.
+    std::vector<double> data_;
+
+    // Memory-mapped storage. We keep the offset instead of a pointer, so that copies of the
+    // matrix stay valid.
+    std::shared_ptr<MappedFile> file_;
+    size_t offset_ = 0;
+
+};
+
+#endif // include guard
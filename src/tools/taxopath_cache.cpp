@@ -0,0 +1,141 @@
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "tools/taxopath_cache.hpp"
+
+#include "genesis/taxonomy/formats/taxopath_parser.hpp"
+#include "genesis/taxonomy/functions/taxopath.hpp"
+#include "genesis/taxonomy/taxopath.hpp"
+
+#include <cctype>
+#include <functional>
+
+// =================================================================================================
+//      Local Helpers
+// =================================================================================================
+
+/**
+ * @brief Return the length of the @p taxopath without a trailing semicolon,
+ * or `std::string::npos` if the taxopath is not in the plain form that is stored in the cache.
+ *
+ * The plain form consists of non-empty elements, separated by semicolons, without white space
+ * at the beginning or end of the elements. For these, parsing yields the elements as they are,
+ * so that the string can be looked up directly.
+ */
+static size_t plain_taxopath_length( std::string const& taxopath )
+{
+    auto length = taxopath.size();
+    if( length > 0 && taxopath[ length - 1 ] == ';' ) {
+        --length;
+    }
+    if( length == 0 || taxopath[ length - 1 ] == ';' ) {
+        // Empty taxopath, or empty last element.
+        return std::string::npos;
+    }
+
+    auto is_space = []( char c ){
+        return std::isspace( static_cast<unsigned char>( c )) != 0;
+    };
+    for( size_t i = 0; i < length; ++i ) {
+        auto const c = taxopath[i];
+        bool const elem_begin = ( i == 0 || taxopath[ i - 1 ] == ';' );
+        bool const elem_end   = ( i + 1 == length || taxopath[ i + 1 ] == ';' );
+        if( c == ';' ) {
+            if( elem_begin ) {
+                // Empty element.
+                return std::string::npos;
+            }
+        } else if( is_space( c ) && ( elem_begin || elem_end )) {
+            return std::string::npos;
+        }
+    }
+    return length;
+}
+
+// =================================================================================================
+//      Constructor
+// =================================================================================================
+
+TaxopathCache::TaxopathCache( genesis::taxonomy::Taxonomy& taxonomy )
+    : taxonomy_( &taxonomy )
+{
+    using namespace genesis::taxonomy;
+
+    // Add all taxa, with the taxopath of their parent as prefix.
+    std::function<void( Taxonomy&, std::string const& )> add_children;
+    add_children = [&]( Taxonomy& parent, std::string const& prefix ){
+        for( size_t i = 0; i < parent.size(); ++i ) {
+            auto& taxon = parent.at( i );
+            auto const path = prefix.empty() ? taxon.name() : prefix + ";" + taxon.name();
+            taxa_[ path ] = &taxon;
+            add_children( taxon, path );
+        }
+    };
+    add_children( taxonomy, "" );
+}
+
+// =================================================================================================
+//      Lookup
+// =================================================================================================
+
+genesis::taxonomy::Taxon* TaxopathCache::find( std::string const& taxopath ) const
+{
+    using namespace genesis::taxonomy;
+
+    // Fast path: Plain taxopaths are either in the cache, or not in the taxonomy at all.
+    auto const length = plain_taxopath_length( taxopath );
+    if( length != std::string::npos ) {
+        auto const it = length == taxopath.size()
+            ? taxa_.find( taxopath )
+            : taxa_.find( taxopath.substr( 0, length ))
+        ;
+        return it == taxa_.end() ? nullptr : it->second;
+    }
+
+    // Slow path for all other strings.
+    return find_taxon_by_taxopath( *taxonomy_, TaxopathParser().parse( taxopath ));
+}
+
+genesis::taxonomy::Taxon* TaxopathCache::find_without_last( std::string const& taxopath ) const
+{
+    using namespace genesis::taxonomy;
+
+    // Fast path, as above, but using the part before the last semicolon.
+    auto const length = plain_taxopath_length( taxopath );
+    if( length != std::string::npos ) {
+        auto const delim = taxopath.rfind( ';', length - 1 );
+        if( delim == std::string::npos ) {
+            return nullptr;
+        }
+        auto const it = taxa_.find( taxopath.substr( 0, delim ));
+        return it == taxa_.end() ? nullptr : it->second;
+    }
+
+    // Slow path for all other strings.
+    auto path = TaxopathParser().parse( taxopath );
+    if( path.size() < 2 ) {
+        return nullptr;
+    }
+    path.pop_back();
+    return find_taxon_by_taxopath( *taxonomy_, path );
+}
@@ -0,0 +1,103 @@
+#ifndef GAPPA_TOOLS_TAXOPATH_CACHE_H_
+#define GAPPA_TOOLS_TAXOPATH_CACHE_H_
+
+/*
+    gappa - Genesis Applications for Phylogenetic Placement Analysis
+    Copyright (C) 2017-2024 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lczech@carnegiescience.edu>
+    Department of Plant Biology, Carnegie Institution For Science
+    260 Panama Street, Stanford, CA 94305, USA
+*/
+
+#include "genesis/taxonomy/taxon.hpp"
+#include "genesis/taxonomy/taxonomy.hpp"
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+// =================================================================================================
+//      Taxopath Cache
+// =================================================================================================
+
+/**
+ * @brief Fast lookup of the taxa of a Taxonomy by their taxopath string.
+ *
+ * The cache stores the taxopath of each taxon, with its names joined by semicolons, in a hash map.
+ * Taxopath strings that have this plain form (apart from an optional trailing semicolon) are then
+ * found with a single hash lookup, instead of parsing them with a TaxopathParser and walking the
+ * Taxonomy by name. All other strings, for example with empty elements or with white space around
+ * the semicolons, are handed to the parser, so that the result is the same in both cases.
+ *
+ * The cache is filled on construction, and not changed afterwards, so that it can be used by
+ * several threads at the same time. It needs to be re-created if the Taxonomy is changed.
+ */
+class TaxopathCache
+{
+public:
+
+    // -------------------------------------------------------------------------
+    //     Constructor and Rule of Five
+    // -------------------------------------------------------------------------
+
+    explicit TaxopathCache( genesis::taxonomy::Taxonomy& taxonomy );
+    ~TaxopathCache() = default;
+
+    TaxopathCache( TaxopathCache const& other ) = default;
+    TaxopathCache( TaxopathCache&& )            = default;
+
+    TaxopathCache& operator= ( TaxopathCache const& other ) = default;
+    TaxopathCache& operator= ( TaxopathCache&& )            = default;
+
+    // -------------------------------------------------------------------------
+    //     Lookup
+    // -------------------------------------------------------------------------
+
+    size_t size() const
+    {
+        return taxa_.size();
+    }
+
+    /**
+     * @brief Return the taxon with the given @p taxopath, or `nullptr` if there is none.
+     *
+     * This is the same as parsing the string and calling `find_taxon_by_taxopath()`.
+     */
+    genesis::taxonomy::Taxon* find( std::string const& taxopath ) const;
+
+    /**
+     * @brief Return the taxon with the given @p taxopath without its last element,
+     * or `nullptr` if there is none.
+     *
+     * This is useful for taxopaths that contain an additional level, such as species names, that
+     * are not part of the Taxonomy.
+     */
+    genesis::taxonomy::Taxon* find_without_last( std::string const& taxopath ) const;
+
+    // -------------------------------------------------------------------------
+    //     Data Members
+    // -------------------------------------------------------------------------
+
+private:
+
+    genesis::taxonomy::Taxonomy* taxonomy_;
+    std::unordered_map<std::string, genesis::taxonomy::Taxon*> taxa_;
+
+};
+
+#endif // include guard